@@ -0,0 +1,99 @@
+#ifndef DEMO_COMMON_LATENCY_RECORDER_H
+#define DEMO_COMMON_LATENCY_RECORDER_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "base/strings/stringprintf.h"
+#include "base/time/time.h"
+
+namespace demo {
+
+// 记录一组耗时样本并计算分位数，用于各个 demo 的 benchmark 输出。
+// 非线程安全，需要调用方保证在同一个线程/sequence 中使用。
+class LatencyRecorder {
+ public:
+  explicit LatencyRecorder(const std::string& name) : name_(name) {}
+
+  void Add(base::TimeDelta sample) { samples_.push_back(sample); }
+  void Reset() { samples_.clear(); }
+
+  size_t count() const { return samples_.size(); }
+  const std::string& name() const { return name_; }
+
+  // percentile 取值范围为 [0, 100]
+  base::TimeDelta Percentile(double percentile) const {
+    if (samples_.empty())
+      return base::TimeDelta();
+    std::vector<base::TimeDelta> sorted = samples_;
+    size_t index = static_cast<size_t>(percentile / 100.0 * (sorted.size() - 1) +
+                                       0.5);
+    std::nth_element(sorted.begin(), sorted.begin() + index, sorted.end());
+    return sorted[index];
+  }
+
+  base::TimeDelta Mean() const {
+    if (samples_.empty())
+      return base::TimeDelta();
+    base::TimeDelta sum;
+    for (const auto& sample : samples_)
+      sum += sample;
+    return sum / samples_.size();
+  }
+
+  base::TimeDelta Max() const {
+    if (samples_.empty())
+      return base::TimeDelta();
+    return *std::max_element(samples_.begin(), samples_.end());
+  }
+
+  // 按 bucket_size 分桶输出直方图，每行格式为:
+  //   [ 16.0,  24.0)ms    12 ########
+  // 超出 max_buckets 的样本归入最后一个桶
+  std::string ToHistogramString(base::TimeDelta bucket_size,
+                                size_t max_buckets = 16) const {
+    if (samples_.empty() || bucket_size <= base::TimeDelta() || !max_buckets)
+      return name_ + ": no samples\n";
+    std::vector<size_t> buckets(max_buckets);
+    for (const auto& sample : samples_) {
+      size_t index = std::max<int64_t>(sample / bucket_size, 0);
+      ++buckets[std::min(index, max_buckets - 1)];
+    }
+    // 去掉末尾的空桶
+    while (buckets.size() > 1 && !buckets.back())
+      buckets.pop_back();
+    const size_t max_count = *std::max_element(buckets.begin(), buckets.end());
+    constexpr size_t kMaxBarWidth = 50;
+    std::string result = name_ + " histogram:\n";
+    for (size_t i = 0; i < buckets.size(); ++i) {
+      const bool overflow = i == max_buckets - 1;
+      result += base::StringPrintf(
+          "  [%6.1f, %6s)ms %6zu %s\n", (bucket_size * i).InMillisecondsF(),
+          overflow ? "inf"
+                   : base::StringPrintf("%.1f", (bucket_size * (i + 1))
+                                                    .InMillisecondsF())
+                         .c_str(),
+          buckets[i],
+          std::string(buckets[i] * kMaxBarWidth / max_count, '#').c_str());
+    }
+    return result;
+  }
+
+  // 格式: name: n=100 mean=1.23ms p50=1.00ms p90=2.00ms p99=3.00ms max=4.00ms
+  std::string ToString() const {
+    return base::StringPrintf(
+        "%s: n=%zu mean=%.3fms p50=%.3fms p90=%.3fms p99=%.3fms max=%.3fms",
+        name_.c_str(), samples_.size(), Mean().InMillisecondsF(),
+        Percentile(50).InMillisecondsF(), Percentile(90).InMillisecondsF(),
+        Percentile(99).InMillisecondsF(), Max().InMillisecondsF());
+  }
+
+ private:
+  std::string name_;
+  std::vector<base::TimeDelta> samples_;
+};
+
+}  // namespace demo
+
+#endif  // DEMO_COMMON_LATENCY_RECORDER_H
@@ -1,6 +1,8 @@
 
 #include "demo/demo_skia/skia_canvas.h"
 
+#include <algorithm>
+
 #include "base/bind.h"
 #include "base/files/file.h"
 #include "base/files/file_path.h"
@@ -21,6 +23,9 @@ const base::FilePath::CharType kTraceFileName[] =
     FILE_PATH_LITERAL("./trace_demo_skia.json");
 std::unique_ptr<base::File> g_trace_file;
 
+// 每个点上绘制的圆点的半径
+constexpr SkScalar kPointRadius = 3.f;
+
 void StartTrace();
 void DemoMain() {
   g_trace_file = std::make_unique<base::File>(
@@ -125,6 +130,10 @@ void SkiaCanvas::OnTouchOnRenderThread(int action, float x, float y) {
     total_frame_time_ = base::TimeDelta();
     total_paint_time_ = base::TimeDelta();
     total_swap_time_ = base::TimeDelta();
+    partial_frame_count_ = 0;
+    skipped_frame_count_ = 0;
+    // 新的笔画需要清除上一次的内容
+    needs_full_redraw_ = true;
     touch_count_ = 1;
     touch_start_time_ = base::TimeTicks::Now();
     total_touch_time_ = base::TimeDelta();
@@ -144,6 +153,8 @@ void SkiaCanvas::OnTouchOnRenderThread(int action, float x, float y) {
 }
 
 void SkiaCanvas::SetNeedsRedraw(bool need_redraw) {
+  if (render_loop_stopped_)
+    return;
   need_redraw_ = need_redraw;
   if (need_redraw && !is_drawing_) {
     if (render_task_runner_->RunsTasksInCurrentSequence())
@@ -153,13 +164,23 @@ void SkiaCanvas::SetNeedsRedraw(bool need_redraw) {
   }
 }
 
+void SkiaCanvas::StopRenderLoop() {
+  DCHECK(render_task_runner_->RunsTasksInCurrentSequence());
+  render_loop_stopped_ = true;
+  need_redraw_ = false;
+  is_drawing_ = false;
+}
+
 void SkiaCanvas::OnRenderOnRenderThread() {
   // 用于在 chrome:://tracing 中显示 Vsync
   TRACE_EVENT0("shell", "VSYNC");
   TRACE_EVENT0("shell", "SkiaCanvas::OnRenderOnRenderThread");
+  if (render_loop_stopped_)
+    return;
   if (!need_redraw_) {
     is_drawing_ = false;
     frame_count_ = 0;
+    OnIdle();
     return;
   }
   // 一旦开始就一直保持以16ms的间隔进行刷新
@@ -176,20 +197,33 @@ void SkiaCanvas::OnRenderOnRenderThread() {
   frame_count_++;
   last_frame_time_ = now;
 
+  const int point_count = skPath_.countPoints();
+  const SkISize size = SkISize::Make(width_, height_);
+  const bool full_redraw =
+      !buffer_preserved_ || needs_full_redraw_ || drawn_size_ != size;
+  if (!full_redraw && point_count == drawn_point_count_) {
+    // 没有新增的点，buffer 中的内容已经是最新的
+    TRACE_EVENT0("shell", "SkipFrame");
+    skipped_frame_count_++;
+    return;
+  }
+
   {
     TRACE_EVENT0("shell", "paint");
     auto paint_start_time = base::TimeTicks::Now();
     TRACE_EVENT0("shell", "BeginPaint");
     auto* canvas = BeginPaint();
-    TRACE_EVENT0("shell", "draw");
-    canvas->clear(background_);
-    canvas->drawPath(skPath_, pathPaint_);
-    auto point_count = skPath_.countPoints();
-    SkPoint p;
-    for(int i = 0;i < point_count;i++) {
-      p = skPath_.getPoint(i);
-      canvas->drawCircle(p,3,circlePaint_);
+    TRACE_EVENT1("shell", "draw", "full_redraw", full_redraw);
+    if (full_redraw) {
+      DrawAllPoints(canvas);
+      damage_rect_ = SkIRect::MakeSize(size);
+    } else {
+      damage_rect_ = DrawNewPoints(canvas);
+      partial_frame_count_++;
     }
+    drawn_point_count_ = point_count;
+    drawn_size_ = size;
+    needs_full_redraw_ = false;
     TRACE_EVENT0("shell", "OnPaint");
     OnPaint(canvas);
     total_paint_time_ += base::TimeTicks::Now() - paint_start_time;
@@ -203,14 +237,57 @@ void SkiaCanvas::OnRenderOnRenderThread() {
   }
 }
 
+void SkiaCanvas::DrawAllPoints(SkCanvas* canvas) {
+  canvas->clear(background_);
+  canvas->drawPath(skPath_, pathPaint_);
+  auto point_count = skPath_.countPoints();
+  SkPoint p;
+  for(int i = 0;i < point_count;i++) {
+    p = skPath_.getPoint(i);
+    canvas->drawCircle(p,kPointRadius,circlePaint_);
+  }
+}
+
+// 只绘制新增的线段和圆点，返回绘制的区域。
+// 上一帧的最后一个点是线段的端点，没有 join，因此从它的前一个点开始绘制，
+// 重画的那段线段和上一帧完全相同，再在其上重画这两个点的圆点，
+// 结果与完整重绘一致。只有新增的线段和更早的圆点重叠时（笔画折返），
+// 圆点会被线段覆盖。
+SkIRect SkiaCanvas::DrawNewPoints(SkCanvas* canvas) {
+  const int point_count = skPath_.countPoints();
+  const int first = std::max(drawn_point_count_ - 2, 0);
+  SkPath segment;
+  segment.moveTo(skPath_.getPoint(first));
+  for (int i = first + 1; i < point_count; i++)
+    segment.lineTo(skPath_.getPoint(i));
+  canvas->drawPath(segment, pathPaint_);
+  for (int i = first; i < point_count; i++)
+    canvas->drawCircle(skPath_.getPoint(i), kPointRadius, circlePaint_);
+
+  // miter join 最多超出线段 miter * strokeWidth / 2，多留 1 个像素用于取整
+  const SkScalar outset =
+      std::max(pathPaint_.getStrokeMiter() * strokeWidth_ / 2, kPointRadius) +
+      1;
+  SkIRect damage = segment.getBounds().makeOutset(outset, outset).roundOut();
+  if (!damage.intersect(SkIRect::MakeWH(width_, height_)))
+    return SkIRect::MakeEmpty();
+  return damage;
+}
+
 void SkiaCanvas::ShowFrameRateOnRenderThread() {
+  // paint 和 swap 只统计实际绘制了的帧
+  const unsigned int painted_frame_count =
+      std::max(frame_count_ - skipped_frame_count_, 1u);
   std::stringstream ss;
   ss << tag_
      << " frame= " << (total_frame_time_ / frame_count_).InMilliseconds()
      << " ms,"
-     << " paint= " << (total_paint_time_ / frame_count_).InMilliseconds()
-     << " ms,"
-     << " swap= " << (total_swap_time_ / frame_count_).InMilliseconds() << " ms"
+     << " paint= "
+     << (total_paint_time_ / painted_frame_count).InMicroseconds() << " us,"
+     << " swap= " << (total_swap_time_ / painted_frame_count).InMicroseconds()
+     << " us"
+     << " partial= " << partial_frame_count_ << "/" << frame_count_
+     << " skipped= " << skipped_frame_count_ << "/" << frame_count_
      << " touch= " << (total_touch_time_ / touch_count_).InMilliseconds()
      << " ms";
   base::ThreadTaskRunnerHandle::Get()->PostTask(
@@ -10,6 +10,8 @@
 #include "third_party/skia/include/core/SkCanvas.h"
 #include "third_party/skia/include/core/SkPath.h"
 #include "third_party/skia/include/core/SkImageInfo.h"
+#include "third_party/skia/include/core/SkRect.h"
+#include "third_party/skia/include/core/SkSize.h"
 #include "third_party/skia/include/core/SkSurface.h"
 
 #include "base/timer/timer.h"
@@ -19,7 +21,7 @@ namespace demo_jni {
 class SkiaCanvas {
  public:
   void OnTouch(int action, float x, float y);
-  ~SkiaCanvas() {} 
+  virtual ~SkiaCanvas() {}
   virtual void Resize(int width, int height) {}
 
  protected:
@@ -28,7 +30,12 @@ class SkiaCanvas {
   virtual SkCanvas* BeginPaint() = 0;
   virtual void OnPaint(SkCanvas* canvas) {}
   virtual void SwapBuffer() = 0;
+  // 一次绘制结束、渲染循环停止之后在 render 线程调用
+  virtual void OnIdle() {}
   void SetNeedsRedraw(bool need_redraw);
+  // 在 render 线程停止渲染循环，之后已经 post 的 render_closure_ 不再绘制，
+  // 子类在析构时释放绘制资源之前调用
+  void StopRenderLoop();
   void ShowInfo(std::string info);
 
   gfx::AcceleratedWidget nativeWindow_;
@@ -51,7 +58,17 @@ class SkiaCanvas {
   unsigned int frame_count_ = 0;
   base::TimeDelta total_paint_time_;
   base::TimeDelta total_swap_time_;
-  
+  // 只重绘了新增部分的帧数，以及没有新增的点而跳过绘制的帧数
+  unsigned int partial_frame_count_ = 0;
+  unsigned int skipped_frame_count_ = 0;
+
+  // 当前帧需要更新的区域，坐标原点在左上角，后端在 OnPaint/SwapBuffer 中
+  // 只提交这部分内容
+  SkIRect damage_rect_ = SkIRect::MakeEmpty();
+  // 后端在 BeginPaint 返回的 canvas 中保留了上一帧的内容，可以只绘制新增的点，
+  // 否则每一帧都需要完整重绘
+  bool buffer_preserved_ = false;
+
   unsigned int touch_count_ = 0;
   base::TimeTicks touch_start_time_;
   base::TimeDelta total_touch_time_;
@@ -60,6 +77,14 @@ class SkiaCanvas {
   void OnTouchOnRenderThread(int action, float x, float y);
   void OnRenderOnRenderThread();
   void ShowFrameRateOnRenderThread();
+  void DrawAllPoints(SkCanvas* canvas);
+  SkIRect DrawNewPoints(SkCanvas* canvas);
+
+  // 已经绘制到 buffer 中的点数和 buffer 的大小，用于计算新增的部分
+  int drawn_point_count_ = 0;
+  SkISize drawn_size_ = SkISize::MakeEmpty();
+  bool needs_full_redraw_ = true;
+  bool render_loop_stopped_ = false;
   base::RepeatingTimer timer_;
   base::RepeatingClosure render_closure_;
   base::WeakPtrFactory<SkiaCanvas> weak_factory_{this};
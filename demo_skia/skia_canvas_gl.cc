@@ -2,8 +2,18 @@
 #include "demo/demo_skia/skia_canvas_gl.h"
 
 #include "base/bind.h"
+#include "base/command_line.h"
 #include "base/lazy_instance.h"
+#include "base/stl_util.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "base/trace_event/memory_allocator_dump.h"
+#include "base/trace_event/memory_dump_manager.h"
+#include "base/trace_event/process_memory_dump.h"
 #include "base/trace_event/trace_event.h"
+#include "skia/ext/skia_trace_memory_dump_impl.h"
 #include "third_party/skia/include/core/SkBitmap.h"
 #include "third_party/skia/include/core/SkCanvas.h"
 #include "third_party/skia/include/core/SkColor.h"
@@ -23,6 +33,39 @@
 namespace demo_jni {
 
 namespace {
+
+constexpr char kGrResourceCacheMb[] = "gr-resource-cache-mb";
+constexpr char kGrGlyphCacheMb[] = "gr-glyph-cache-mb";
+constexpr char kGrPurgeOnIdle[] = "gr-purge-on-idle";
+
+// 停止绘制之后等待一段时间再释放资源，避免连续的笔画之间反复创建资源
+constexpr base::TimeDelta kIdlePurgeDelay = base::TimeDelta::FromSeconds(1);
+
+constexpr char kGrContextDumpName[] = "skia/gr_context/SkiaCanvasGL";
+
+size_t GetMegabytesSwitch(const base::CommandLine* command_line,
+                          const char* name) {
+  if (!command_line->HasSwitch(name))
+    return 0;
+  size_t megabytes = 0;
+  if (!base::StringToSizeT(command_line->GetSwitchValueASCII(name),
+                           &megabytes)) {
+    LOG(ERROR) << "Invalid value for --" << name;
+    return 0;
+  }
+  return megabytes * 1024 * 1024;
+}
+
+bool HasEGLExtension(EGLDisplay display, base::StringPiece name) {
+  const char* extensions = eglQueryString(display, EGL_EXTENSIONS);
+  if (!extensions)
+    return false;
+  return base::Contains(
+      base::SplitStringPiece(extensions, " ", base::TRIM_WHITESPACE,
+                             base::SPLIT_WANT_NONEMPTY),
+      name);
+}
+
 class GLShaderErrorHandler : public GrContextOptions::ShaderErrorHandler {
  public:
   void compileError(const char* shader, const char* errors) override {
@@ -163,7 +206,7 @@ sk_sp<const GrGLInterface> GrGLMakeNativeInterface() {
   return GrGLMakeAssembledInterface(nullptr, egl_get_gl_proc);
 }
 
-GrContextOptions CreateGrContextOptions() {
+GrContextOptions CreateGrContextOptions(const GrCacheOptions& cache_options) {
   static std::unique_ptr<SkExecutor> gGpuExecutor =
       SkExecutor::MakeFIFOThreadPool(1);
   static std::unique_ptr<GLShaderErrorHandler> handler =
@@ -186,6 +229,8 @@ GrContextOptions CreateGrContextOptions() {
   options.fShaderErrorHandler = handler.get();
   options.fSuppressPrints = true;
   // options.fInternalMultisampleCount = 4;
+  if (cache_options.glyph_cache_bytes)
+    options.fGlyphCacheTextureMaximumBytes = cache_options.glyph_cache_bytes;
   return options;
 }
 
@@ -302,8 +347,30 @@ void PrintEGLConfig(EGLDisplay display, EGLConfig config) {
 
 }  // namespace
 
+// static
+GrCacheOptions GrCacheOptions::FromCommandLine() {
+  const base::CommandLine* command_line =
+      base::CommandLine::ForCurrentProcess();
+  GrCacheOptions options;
+  options.resource_cache_bytes =
+      GetMegabytesSwitch(command_line, kGrResourceCacheMb);
+  options.glyph_cache_bytes = GetMegabytesSwitch(command_line, kGrGlyphCacheMb);
+  if (command_line->HasSwitch(kGrPurgeOnIdle)) {
+    const std::string policy =
+        command_line->GetSwitchValueASCII(kGrPurgeOnIdle);
+    if (policy == "scratch")
+      options.idle_purge = IdlePurge::kScratchOnly;
+    else if (policy.empty() || policy == "all")
+      options.idle_purge = IdlePurge::kAll;
+    else
+      LOG(ERROR) << "Invalid value for --" << kGrPurgeOnIdle << ": " << policy;
+  }
+  return options;
+}
+
 SkiaCanvasGL::SkiaCanvasGL(gfx::AcceleratedWidget widget, int width, int height)
-    : SkiaCanvas(widget, width, height) {
+    : SkiaCanvas(widget, width, height),
+      cache_options_(GrCacheOptions::FromCommandLine()) {
   background_ = 0x8000FF00;
   tag_ = "SkiaCanvasGL";
 }
@@ -386,12 +453,18 @@ void SkiaCanvasGL::InitializeOnRenderThread() {
   DLOG(INFO) << "Color Format: "
              << ((color_format_ == GL_RGBA8) ? "GL_RGBA8" : "GL_RGB565");
   
+  // 使用 eglPostSubBufferNV 需要在创建 surface 时声明
+  const bool post_sub_buffer =
+      HasEGLExtension(display_, "EGL_NV_post_sub_buffer");
+  const EGLint kPostSubBufferSurfaceAttribs[] = {
+      EGL_POST_SUB_BUFFER_SUPPORTED_NV, EGL_TRUE, EGL_NONE};
   for (int i = 0; i < numConfigs; i++) {
     surfaceConfig = surfaceConfigs[i];
     DLOG(INFO) << "ChooseConfig: " << i;
     PrintEGLConfig(display_, surfaceConfig);
-    surface_ =
-        eglCreateWindowSurface(display_, surfaceConfig, nativeWindow_, nullptr);
+    surface_ = eglCreateWindowSurface(
+        display_, surfaceConfig, nativeWindow_,
+        post_sub_buffer ? kPostSubBufferSurfaceAttribs : nullptr);
     if(EGL_NO_SURFACE != surface_) {
       break;
     }
@@ -420,6 +493,8 @@ void SkiaCanvasGL::InitializeOnRenderThread() {
   eglGetConfigAttrib(display_, surfaceConfig, EGL_SAMPLES, &sampleCount_);
   sampleCount_ = SkTMax(sampleCount_, 1);
 
+  InitializePartialSwap(surfaceConfig);
+
   // 关闭 VSYNC ，否则会由于帧率的抖动导致平均帧率降低。
   // VSYNC 会阻塞 SkSurface::flush，从而使每帧的耗时接近16.6ms,帧率最多60fps
   eglSwapInterval(display_, 0);
@@ -428,19 +503,84 @@ void SkiaCanvasGL::InitializeOnRenderThread() {
   grGLInterface_ = GrGLMakeNativeInterface();
   DCHECK(grGLInterface_);
 
-  grContext_ = GrContext::MakeGL(grGLInterface_, CreateGrContextOptions());
+  grContext_ =
+      GrContext::MakeGL(grGLInterface_, CreateGrContextOptions(cache_options_));
   DCHECK(grContext_);
+  if (cache_options_.resource_cache_bytes)
+    grContext_->setResourceCacheLimit(cache_options_.resource_cache_bytes);
+  DLOG(INFO) << "GrContext resource cache limit: "
+             << grContext_->getResourceCacheLimit() / 1024 << "KB";
+
+  // GrContext 只能在 render 线程访问，因此 dump 也在 render 线程进行
+  base::trace_event::MemoryDumpManager::GetInstance()->RegisterDumpProvider(
+      this, "SkiaCanvasGL", base::ThreadTaskRunnerHandle::Get());
+  memory_dump_provider_registered_ = true;
   SkiaCanvas::InitializeOnRenderThread();
 }
 
+// 确定 swap 之后 back buffer 是否保留上一帧的内容，以及只提交 damage 区域的方式
+void SkiaCanvasGL::InitializePartialSwap(EGLConfig config) {
+  EGLint post_sub_buffer = EGL_FALSE;
+  if (HasEGLExtension(display_, "EGL_NV_post_sub_buffer") &&
+      eglQuerySurface(display_, surface_, EGL_POST_SUB_BUFFER_SUPPORTED_NV,
+                      &post_sub_buffer) &&
+      post_sub_buffer == EGL_TRUE) {
+    egl_post_sub_buffer_ = reinterpret_cast<PFNEGLPOSTSUBBUFFERNVPROC>(
+        eglGetProcAddress("eglPostSubBufferNV"));
+  }
+
+  if (egl_post_sub_buffer_) {
+    // eglPostSubBufferNV 不会改变 back buffer 的内容
+    buffer_preserved_ = true;
+  } else {
+    EGLint surface_type = 0;
+    eglGetConfigAttrib(display_, config, EGL_SURFACE_TYPE, &surface_type);
+    if ((surface_type & EGL_SWAP_BEHAVIOR_PRESERVED_BIT) &&
+        eglSurfaceAttrib(display_, surface_, EGL_SWAP_BEHAVIOR,
+                         EGL_BUFFER_PRESERVED)) {
+      buffer_preserved_ = true;
+      if (HasEGLExtension(display_, "EGL_KHR_swap_buffers_with_damage")) {
+        egl_swap_buffers_with_damage_ =
+            reinterpret_cast<PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC>(
+                eglGetProcAddress("eglSwapBuffersWithDamageKHR"));
+      } else if (HasEGLExtension(display_,
+                                 "EGL_EXT_swap_buffers_with_damage")) {
+        egl_swap_buffers_with_damage_ =
+            reinterpret_cast<PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC>(
+                eglGetProcAddress("eglSwapBuffersWithDamageEXT"));
+      }
+    }
+  }
+  LOG(INFO) << "[" << tag_ << "] Partial swap: "
+            << (egl_post_sub_buffer_
+                    ? "eglPostSubBufferNV"
+                    : egl_swap_buffers_with_damage_
+                          ? "eglSwapBuffersWithDamage"
+                          : buffer_preserved_ ? "EGL_BUFFER_PRESERVED"
+                                              : "disabled");
+}
+
 void SkiaCanvasGL::Resize(int width, int height) {
   width_ = width;
   height_ = height;
 }
 
 SkiaCanvasGL::~SkiaCanvasGL() {
+  // 停止渲染循环、注销 MemoryDumpProvider、停止 timer 以及释放 GrContext
+  // 都需要在 render 线程进行
+  base::WaitableEvent event;
+  render_task_runner_->PostTask(
+      FROM_HERE, base::BindOnce(
+                     [](SkiaCanvasGL* canvas, base::WaitableEvent* event) {
+                       canvas->ShutdownOnRenderThread();
+                       event->Signal();
+                     },
+                     base::Unretained(this), base::Unretained(&event)));
+  event.Wait();
+  // 销毁 EGL 之前停止 render 线程，丢弃还未执行的 render_closure_，
+  // 否则它可能在子类析构之后调用纯虚的 BeginPaint
+  render_thread_.Stop();
   if (display_ != EGL_NO_DISPLAY) {
-    eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
     if (context_ != EGL_NO_CONTEXT) {
       eglDestroyContext(display_, context_);
       DLOG(INFO) << "eglDestroyContext";
@@ -454,8 +594,31 @@ SkiaCanvasGL::~SkiaCanvasGL() {
   }
 }
 
+void SkiaCanvasGL::ShutdownOnRenderThread() {
+  StopRenderLoop();
+  idle_purge_timer_.Stop();
+  if (memory_dump_provider_registered_) {
+    base::trace_event::MemoryDumpManager::GetInstance()->UnregisterDumpProvider(
+        this);
+    memory_dump_provider_registered_ = false;
+  }
+  // GrContext 持有的 GL 资源需要在 context 仍然是 current 的时候释放
+  recorder_.reset();
+  skSurface_.reset();
+  if (grContext_) {
+    grContext_->flush();
+    grContext_.reset();
+  }
+  grGLInterface_.reset();
+  // context 在 render 线程是 current 的，解除之后才能在其他线程销毁
+  if (display_ != EGL_NO_DISPLAY)
+    eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
 SkCanvas* SkiaCanvasGL::BeginPaint() {
   DCHECK(display_);
+  // 重新开始绘制，取消还未执行的释放
+  idle_purge_timer_.Stop();
   DCHECK(surface_);
   GrGLint buffer = 0;
   grGLInterface_->fFunctions.fGetIntegerv(GL_FRAMEBUFFER_BINDING, &buffer);
@@ -492,13 +655,97 @@ void SkiaCanvasGL::OnPaint(SkCanvas* canvas) {
     skSurface_->flush();
   } else
     skSurface_->flush();
+  TraceResourceCacheUsage();
 }
 
 void SkiaCanvasGL::SwapBuffer() {
   DCHECK(display_);
   DCHECK(surface_);
+  if (damage_rect_.isEmpty())
+    return;
 
-  eglSwapBuffers(display_, surface_);
+  // EGL 的坐标原点在左下角
+  EGLint rect[4] = {damage_rect_.x(), height_ - damage_rect_.bottom(),
+                    damage_rect_.width(), damage_rect_.height()};
+  if (egl_post_sub_buffer_) {
+    // 完整的 swap 也使用 eglPostSubBufferNV，保证 back buffer 的内容不变
+    egl_post_sub_buffer_(display_, surface_, rect[0], rect[1], rect[2],
+                         rect[3]);
+  } else if (egl_swap_buffers_with_damage_ &&
+             damage_rect_ != SkIRect::MakeWH(width_, height_)) {
+    egl_swap_buffers_with_damage_(display_, surface_, rect, 1);
+  } else {
+    eglSwapBuffers(display_, surface_);
+  }
+}
+
+void SkiaCanvasGL::OnIdle() {
+  int resource_count = 0;
+  size_t resource_bytes = 0;
+  grContext_->getResourceCacheUsage(&resource_count, &resource_bytes);
+  LOG(INFO) << "[" << tag_ << "] GrContext resources=" << resource_count
+            << " bytes=" << resource_bytes / 1024 << "KB purgeable="
+            << grContext_->getResourceCachePurgeableBytes() / 1024
+            << "KB limit=" << grContext_->getResourceCacheLimit() / 1024
+            << "KB";
+  if (cache_options_.idle_purge == GrCacheOptions::IdlePurge::kNone)
+    return;
+  idle_purge_timer_.Start(FROM_HERE, kIdlePurgeDelay,
+                          base::BindOnce(&SkiaCanvasGL::PurgeOnIdle,
+                                         base::Unretained(this)));
+}
+
+void SkiaCanvasGL::PurgeOnIdle() {
+  TRACE_EVENT0("shell", "SkiaCanvasGL::PurgeOnIdle");
+  int resource_count = 0;
+  size_t bytes_before = 0;
+  size_t bytes_after = 0;
+  grContext_->getResourceCacheUsage(&resource_count, &bytes_before);
+  // context 在初始化之后一直是 current 的，这里可以直接释放 GL 资源
+  grContext_->purgeUnlockedResources(cache_options_.idle_purge ==
+                                     GrCacheOptions::IdlePurge::kScratchOnly);
+  grContext_->getResourceCacheUsage(&resource_count, &bytes_after);
+  LOG(INFO) << "[" << tag_ << "] Purge on idle: " << bytes_before / 1024
+            << "KB -> " << bytes_after / 1024 << "KB";
+  TraceResourceCacheUsage();
+}
+
+void SkiaCanvasGL::TraceResourceCacheUsage() {
+  int resource_count = 0;
+  size_t resource_bytes = 0;
+  grContext_->getResourceCacheUsage(&resource_count, &resource_bytes);
+  TRACE_COUNTER2("shell", "GrResourceCache", "bytes", resource_bytes,
+                 "purgeable_bytes",
+                 grContext_->getResourceCachePurgeableBytes());
+}
+
+bool SkiaCanvasGL::OnMemoryDump(const base::trace_event::MemoryDumpArgs& args,
+                                base::trace_event::ProcessMemoryDump* pmd) {
+  using base::trace_event::MemoryAllocatorDump;
+  DCHECK(render_task_runner_->RunsTasksInCurrentSequence());
+  if (!grContext_)
+    return true;
+
+  int resource_count = 0;
+  size_t resource_bytes = 0;
+  grContext_->getResourceCacheUsage(&resource_count, &resource_bytes);
+  MemoryAllocatorDump* dump = pmd->CreateAllocatorDump(kGrContextDumpName);
+  dump->AddScalar(MemoryAllocatorDump::kNameSize,
+                  MemoryAllocatorDump::kUnitsBytes, resource_bytes);
+  dump->AddScalar(MemoryAllocatorDump::kNameObjectCount,
+                  MemoryAllocatorDump::kUnitsObjects, resource_count);
+  dump->AddScalar("purgeable_size", MemoryAllocatorDump::kUnitsBytes,
+                  grContext_->getResourceCachePurgeableBytes());
+  dump->AddScalar("limit", MemoryAllocatorDump::kUnitsBytes,
+                  grContext_->getResourceCacheLimit());
+
+  // detailed dump 中输出每一个 GPU 资源，和 chromium 的 gpu 进程一致
+  if (args.level_of_detail !=
+      base::trace_event::MemoryDumpLevelOfDetail::BACKGROUND) {
+    skia::SkiaTraceMemoryDumpImpl trace_memory_dump(args.level_of_detail, pmd);
+    grContext_->dumpMemoryStatistics(&trace_memory_dump);
+  }
+  return true;
 }
 
 }  // namespace demo_jni
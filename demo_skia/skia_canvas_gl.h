@@ -2,6 +2,7 @@
 #define DEMO_DEMO_SKIA_SKIA_CANVAS_GL_H
 
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
 #include <EGL/eglplatform.h>
 #ifndef GL_GLEXT_PROTOTYPES
 #define GL_GLEXT_PROTOTYPES
@@ -12,6 +13,8 @@
 //#include <GLES2/gl2.h>
 #include </usr/include/GLES2/gl2.h>
 
+#include "base/timer/timer.h"
+#include "base/trace_event/memory_dump_provider.h"
 #include "demo/demo_skia/skia_canvas.h"
 
 #include "third_party/skia/include/gpu/GrContext.h"
@@ -21,22 +24,50 @@
 
 namespace demo_jni {
 
-class SkiaCanvasGL : public SkiaCanvas {
+// GrContext 的 GPU 资源缓存选项，通过命令行设置，未设置时使用 Skia 的默认值:
+//   --gr-resource-cache-mb=N  GPU 资源缓存的上限
+//   --gr-glyph-cache-mb=N     glyph atlas 纹理的上限
+//   --gr-purge-on-idle=scratch|all
+//                             停止绘制 kIdlePurgeDelay 之后释放未锁定的资源，
+//                             scratch 只释放可复用的 scratch 资源
+struct GrCacheOptions {
+  enum class IdlePurge { kNone, kScratchOnly, kAll };
+
+  static GrCacheOptions FromCommandLine();
+
+  // 0 表示使用默认值
+  size_t resource_cache_bytes = 0;
+  size_t glyph_cache_bytes = 0;
+  IdlePurge idle_purge = IdlePurge::kNone;
+};
+
+class SkiaCanvasGL : public SkiaCanvas,
+                     public base::trace_event::MemoryDumpProvider {
  public:
   SkiaCanvasGL(gfx::AcceleratedWidget widget,int width,int height);
   void Resize(int width, int height) override;
 
-  ~SkiaCanvasGL(); 
+  ~SkiaCanvasGL() override;
+
+  // base::trace_event::MemoryDumpProvider:
+  bool OnMemoryDump(const base::trace_event::MemoryDumpArgs& args,
+                    base::trace_event::ProcessMemoryDump* pmd) override;
 
  private:
   void InitializeOnRenderThread() override;
   SkCanvas* BeginPaint() override;
   void OnPaint(SkCanvas* canvas) override;
   void SwapBuffer() override;
+  void OnIdle() override;
+
+  void InitializePartialSwap(EGLConfig config);
+  void PurgeOnIdle();
+  void TraceResourceCacheUsage();
+  void ShutdownOnRenderThread();
 
-  EGLDisplay display_;
-  EGLContext context_;
-  EGLSurface surface_;
+  EGLDisplay display_ = EGL_NO_DISPLAY;
+  EGLContext context_ = EGL_NO_CONTEXT;
+  EGLSurface surface_ = EGL_NO_SURFACE;
   EGLint stencilBits_;
   EGLint sampleCount_;
   GLenum color_format_;
@@ -44,6 +75,15 @@ class SkiaCanvasGL : public SkiaCanvas {
   sk_sp<GrContext> grContext_;
   bool use_ddl_ = false;
   std::unique_ptr<SkDeferredDisplayListRecorder> recorder_;
+
+  // 只提交 damage 区域的 swap，优先使用 EGL_NV_post_sub_buffer，
+  // 否则在 back buffer 被保留时使用 EGL_KHR_swap_buffers_with_damage
+  PFNEGLPOSTSUBBUFFERNVPROC egl_post_sub_buffer_ = nullptr;
+  PFNEGLSWAPBUFFERSWITHDAMAGEKHRPROC egl_swap_buffers_with_damage_ = nullptr;
+
+  const GrCacheOptions cache_options_;
+  base::OneShotTimer idle_purge_timer_;
+  bool memory_dump_provider_registered_ = false;
 };
 
 } // namespace demo_jni
@@ -4,6 +4,7 @@
 #include "base/bind.h"
 #include "base/lazy_instance.h"
 #include "base/trace_event/trace_event.h"
+#include "ui/gfx/skia_util.h"
 
 namespace demo_jni {
 
@@ -11,6 +12,7 @@ SkiaCanvasSoftware::SkiaCanvasSoftware(gfx::AcceleratedWidget widget,int width,i
     : SkiaCanvas(widget, width, height) {
   background_ = 0x8800DE96;
   tag_ = "SkiaCanvasSoftware";
+  buffer_preserved_ = true;
 }
 
 void SkiaCanvasSoftware::InitializeOnRenderThread() {
@@ -23,6 +25,7 @@ void SkiaCanvasSoftware::InitializeOnRenderThread() {
   // memset(buffer.bits, 0xAA, buffer.stride * buffer.height * 2);
   auto* canvas = BeginPaint();
   canvas->clear(background_);
+  damage_rect_ = SkIRect::MakeWH(width_, height_);
   //canvas->drawCircle(20, 20, 20, circlePaint_);
   OnPaint(canvas);
   SwapBuffer();
@@ -36,11 +39,29 @@ void SkiaCanvasSoftware::Resize(int width, int height) {
 
 SkCanvas* SkiaCanvasSoftware::BeginPaint() {
   x11_presenter_->Resize(gfx::Size(width_, height_));
-  return x11_presenter_->GetSkCanvas();
+  presenter_canvas_ = x11_presenter_->GetSkCanvas();
+  if (!skSurface_ || skSurface_->width() != width_ ||
+      skSurface_->height() != height_) {
+    skSurface_ = SkSurface::MakeRaster(
+        SkImageInfo::MakeN32Premul(width_, height_));
+  }
+  return skSurface_->getCanvas();
 }
 
 void SkiaCanvasSoftware::OnPaint(SkCanvas* canvas) {
-  x11_presenter_->EndPaint(gfx::Rect(width_,height_));
+  if (damage_rect_.isEmpty())
+    return;
+  {
+    TRACE_EVENT0("shell", "CopyDamage");
+    // 使用 kSrc 直接覆盖，背景色是半透明的
+    SkPaint paint;
+    paint.setBlendMode(SkBlendMode::kSrc);
+    presenter_canvas_->save();
+    presenter_canvas_->clipRect(SkRect::Make(damage_rect_));
+    skSurface_->draw(presenter_canvas_, 0, 0, &paint);
+    presenter_canvas_->restore();
+  }
+  x11_presenter_->EndPaint(gfx::SkIRectToRect(damage_rect_));
 }
 
 void SkiaCanvasSoftware::SwapBuffer() {
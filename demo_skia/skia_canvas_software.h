@@ -20,6 +20,9 @@ class SkiaCanvasSoftware : public SkiaCanvas {
   void SwapBuffer() override;
 
   std::unique_ptr<ui::X11SoftwareBitmapPresenter> x11_presenter_;
+  // presenter 的 shm buffer 会在多个 buffer 之间轮换，不保证保留上一帧的内容，
+  // 因此在自己的 skSurface_ 中绘制，每一帧只把 damage 区域拷贝过去
+  SkCanvas* presenter_canvas_ = nullptr;
 };
 
 } // namespace demo_jni
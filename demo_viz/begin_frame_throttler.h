@@ -0,0 +1,178 @@
+#ifndef DEMO_DEMO_VIZ_BEGIN_FRAME_THROTTLER_H
+#define DEMO_DEMO_VIZ_BEGIN_FRAME_THROTTLER_H
+
+#include <string>
+
+#include "base/bind.h"
+#include "base/command_line.h"
+#include "base/logging.h"
+#include "base/macros.h"
+#include "base/time/time.h"
+#include "base/timer/timer.h"
+#include "base/trace_event/trace_event.h"
+#include "components/viz/common/frame_sinks/begin_frame_args.h"
+#include "services/viz/public/mojom/compositing/compositor_frame_sink.mojom.h"
+
+namespace demo {
+
+// 关闭按需请求 BeginFrame，用于对比开启前后的唤醒次数和 CPU 占用
+constexpr char kDisableBeginFrameThrottling[] =
+    "disable-begin-frame-throttling";
+
+constexpr base::TimeDelta kBeginFrameThrottlerReportInterval =
+    base::TimeDelta::FromSeconds(10);
+
+// 按需请求 BeginFrame。
+// client 调用 SetNeedsBeginFrame(true) 之后 viz 会以 vsync 的频率一直发送
+// OnBeginFrame，即使画面不变也会每秒唤醒 client 线程 60 次。
+// 这里连续 idle_frames_before_stop 次 BeginFrame 都没有产生新的 CF 时调用
+// SetNeedsBeginFrame(false)，内容变化时通过 Invalidate() 重新请求。
+// 每 10 秒输出一次唤醒次数，以及停止接收 BeginFrame 期间省下的唤醒次数和
+// CPU 时间（按空闲 BeginFrame 的平均线程 CPU 时间估算）。
+// 非线程安全，需要在 client 所在的线程中使用。
+class BeginFrameThrottler {
+ public:
+  // 停止之前多等几帧，避免连续输入时频繁地订阅/取消订阅，
+  // 也让 viz 有机会通过 OnBeginFrame 送回最近几帧的 presentation feedback
+  static constexpr int kDefaultIdleFramesBeforeStop = 3;
+
+  explicit BeginFrameThrottler(
+      const std::string& name,
+      int idle_frames_before_stop = kDefaultIdleFramesBeforeStop)
+      : name_(name),
+        idle_frames_before_stop_(idle_frames_before_stop),
+        enabled_(!base::CommandLine::ForCurrentProcess()->HasSwitch(
+            kDisableBeginFrameThrottling)) {}
+
+  // frame_sink 需要比 throttler 活得更久
+  void Bind(viz::mojom::CompositorFrameSink* frame_sink) {
+    frame_sink_ = frame_sink;
+    // 告诉 CompositorFrameSink 可以开始请求 CompositorFrame 了
+    SetNeedsBeginFrame(true);
+    report_timer_.Start(FROM_HERE, kBeginFrameThrottlerReportInterval,
+                        base::BindRepeating(&BeginFrameThrottler::Report,
+                                            base::Unretained(this)));
+  }
+
+  // 停止统计并解除和 frame_sink 的关联，之后 Invalidate() 不再起作用。
+  // 定时器在 Bind() 所在的线程中启动，需要在同一个线程中、frame_sink
+  // 销毁之前调用
+  void Unbind() {
+    report_timer_.Stop();
+    frame_sink_ = nullptr;
+  }
+
+  // 内容发生了变化，需要在下一次 BeginFrame 中提交 CF
+  void Invalidate() {
+    idle_frames_ = 0;
+    if (!frame_sink_ || needs_begin_frame_)
+      return;
+    ++resubscribes_;
+    SetNeedsBeginFrame(true);
+  }
+
+  // 在 OnBeginFrame 开始时调用
+  void WillHandleBeginFrame(const viz::BeginFrameArgs& args) {
+    ++wakeups_;
+    interval_ = args.interval;
+    if (base::ThreadTicks::IsSupported())
+      handle_start_ = base::ThreadTicks::Now();
+  }
+
+  // 在 OnBeginFrame 结束时调用，produced_frame 表示是否提交了 CF，
+  // keep_alive 表示虽然没有新内容但仍需要继续接收 BeginFrame，
+  // 例如还在等待已提交的 CF 的 presentation feedback
+  void DidHandleBeginFrame(bool produced_frame, bool keep_alive = false) {
+    base::TimeDelta cpu_time;
+    if (base::ThreadTicks::IsSupported())
+      cpu_time = base::ThreadTicks::Now() - handle_start_;
+    if (produced_frame) {
+      ++frames_;
+      idle_frames_ = 0;
+      return;
+    }
+    ++idle_wakeups_;
+    idle_cpu_time_ += cpu_time;
+    if (keep_alive) {
+      idle_frames_ = 0;
+      return;
+    }
+    if (enabled_ && frame_sink_ && needs_begin_frame_ &&
+        ++idle_frames_ >= idle_frames_before_stop_) {
+      SetNeedsBeginFrame(false);
+    }
+  }
+
+  bool needs_begin_frame() const { return needs_begin_frame_; }
+
+ private:
+  void SetNeedsBeginFrame(bool needs_begin_frame) {
+    TRACE_EVENT1("viz", "BeginFrameThrottler::SetNeedsBeginFrame",
+                 "needs_begin_frame", needs_begin_frame);
+    const base::TimeTicks now = base::TimeTicks::Now();
+    if (needs_begin_frame && !stopped_since_.is_null()) {
+      stopped_time_ += now - stopped_since_;
+      stopped_since_ = base::TimeTicks();
+    } else if (!needs_begin_frame) {
+      stopped_since_ = now;
+    }
+    needs_begin_frame_ = needs_begin_frame;
+    idle_frames_ = 0;
+    frame_sink_->SetNeedsBeginFrame(needs_begin_frame);
+  }
+
+  void Report() {
+    // 把还在进行中的停止时间计入本次统计
+    const base::TimeTicks now = base::TimeTicks::Now();
+    if (!stopped_since_.is_null()) {
+      stopped_time_ += now - stopped_since_;
+      stopped_since_ = now;
+    }
+    const int64_t skipped_wakeups =
+        interval_.is_zero() ? 0 : stopped_time_ / interval_;
+    const base::TimeDelta idle_cpu_per_wakeup =
+        idle_wakeups_ ? idle_cpu_time_ / idle_wakeups_ : base::TimeDelta();
+    LOG(INFO) << "BeginFrameThrottler[" << name_ << "]: wakeups=" << wakeups_
+              << " frames=" << frames_ << " idle_wakeups=" << idle_wakeups_
+              << " resubscribes=" << resubscribes_
+              << " stopped=" << stopped_time_.InMilliseconds() << "ms"
+              << " skipped_wakeups=" << skipped_wakeups
+              << " idle_cpu_per_wakeup="
+              << idle_cpu_per_wakeup.InMicrosecondsF() << "us"
+              << " cpu_saved="
+              << (idle_cpu_per_wakeup * skipped_wakeups).InMillisecondsF()
+              << "ms" << (enabled_ ? "" : " (throttling disabled)");
+    wakeups_ = 0;
+    frames_ = 0;
+    idle_wakeups_ = 0;
+    resubscribes_ = 0;
+    idle_cpu_time_ = base::TimeDelta();
+    stopped_time_ = base::TimeDelta();
+  }
+
+  const std::string name_;
+  const int idle_frames_before_stop_;
+  const bool enabled_;
+  viz::mojom::CompositorFrameSink* frame_sink_ = nullptr;
+  bool needs_begin_frame_ = false;
+  int idle_frames_ = 0;
+  base::TimeDelta interval_ = viz::BeginFrameArgs::DefaultInterval();
+  base::ThreadTicks handle_start_;
+  base::TimeTicks stopped_since_;
+
+  // 本次统计周期内的数据
+  int64_t wakeups_ = 0;
+  int64_t frames_ = 0;
+  int64_t idle_wakeups_ = 0;
+  int64_t resubscribes_ = 0;
+  base::TimeDelta idle_cpu_time_;
+  base::TimeDelta stopped_time_;
+
+  base::RepeatingTimer report_timer_;
+
+  DISALLOW_COPY_AND_ASSIGN(BeginFrameThrottler);
+};
+
+}  // namespace demo
+
+#endif  // DEMO_DEMO_VIZ_BEGIN_FRAME_THROTTLER_H
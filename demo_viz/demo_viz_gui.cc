@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cinttypes>
+#include <limits>
+
 #include "base/at_exit.h"
 #include "base/callback.h"
 #include "base/command_line.h"
@@ -6,19 +10,27 @@
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/memory/ptr_util.h"
+#include "base/memory/ref_counted.h"
 #include "base/message_loop/message_loop.h"
 #include "base/message_loop/message_pump_type.h"
 #include "base/path_service.h"
+#include "base/process/process_metrics.h"
 #include "base/power_monitor/power_monitor.h"
 #include "base/power_monitor/power_monitor_device_source.h"
 #include "base/rand_util.h"
 #include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/stringprintf.h"
+#include "base/synchronization/lock.h"
+#include "base/synchronization/waitable_event.h"
 #include "base/task/single_thread_task_executor.h"
 #include "base/task/thread_pool/thread_pool_instance.h"
 #include "base/test/task_environment.h"
 #include "base/test/test_discardable_memory_allocator.h"
 #include "base/test/test_timeouts.h"
 #include "base/threading/thread.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "base/timer/timer.h"
 #include "base/trace_event/trace_buffer.h"
 #include "build/build_config.h"
 #include "build/buildflag.h"
@@ -32,6 +44,7 @@
 #include "components/viz/common/quads/video_hole_draw_quad.h"
 #include "components/viz/common/resources/bitmap_allocation.h"
 #include "components/viz/common/resources/resource_format.h"
+#include "components/viz/common/switches.h"
 #include "components/viz/demo/host/demo_host.h"
 #include "components/viz/demo/service/demo_service.h"
 #include "components/viz/host/host_frame_sink_manager.h"
@@ -39,7 +52,11 @@
 #include "components/viz/service/display_embedder/server_shared_bitmap_manager.h"
 #include "components/viz/service/frame_sinks/frame_sink_manager_impl.h"
 #include "components/viz/service/main/viz_compositor_thread_runner_impl.h"
+#include "demo/common/latency_recorder.h"
 #include "demo/common/utils.h"
+#include "demo/demo_viz/begin_frame_throttler.h"
+#include "demo/demo_viz/frame_timing_reporter.h"
+#include "demo/demo_viz/shared_bitmap_pool.h"
 #include "mojo/core/embedder/embedder.h"
 #include "mojo/core/embedder/scoped_ipc_support.h"
 #include "mojo/public/cpp/bindings/pending_receiver.h"
@@ -89,6 +106,18 @@
 namespace demo {
 
 constexpr SkColor colors[] = {SK_ColorRED, SK_ColorGREEN, SK_ColorYELLOW};
+// quad 颜色变化的间隔，颜色不变时不需要提交新的 CF
+constexpr base::TimeDelta kAnimationInterval = base::TimeDelta::FromSeconds(1);
+// --windows=N 同时打开 N 个共享同一个 FrameSinkManager 的窗口
+constexpr char kWindows[] = "windows";
+// --display-scaling=N 逐个增加窗口，统计每个 Display 的开销
+constexpr char kDisplayScaling[] = "display-scaling";
+constexpr size_t kDefaultMaxDisplays = 8;
+constexpr base::TimeDelta kDisplayScalingStageDuration =
+    base::TimeDelta::FromSeconds(5);
+constexpr gfx::Size kWindowSize(800, 600);
+// 新窗口相对上一个窗口的偏移
+constexpr int kWindowOffset = 40;
 
 // Client 端
 // 在 Chromium 中 cc::LayerTreeFrameSink 的作用就相当于 viz 中的 client.
@@ -100,11 +129,24 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
       : frame_sink_id_(frame_sink_id),
         local_surface_id_(local_surface_id),
         bounds_(bounds),
-        thread_("Demo_" + frame_sink_id.ToString()) {
+        thread_("Demo_" + frame_sink_id.ToString()),
+        begin_frame_throttler_("LayerTreeFrameSink " +
+                               frame_sink_id.ToString()),
+        frame_timing_reporter_("LayerTreeFrameSink " +
+                               frame_sink_id.ToString()) {
     CHECK(thread_.Start());
   }
 
-  ~LayerTreeFrameSink() override {}
+  // 定时器和 mojo 的端点都绑定在 thread_ 上，需要先在 thread_ 中销毁，
+  // 然后才能停止线程
+  ~LayerTreeFrameSink() override {
+    base::WaitableEvent event;
+    thread_.task_runner()->PostTask(
+        FROM_HERE, base::BindOnce(&LayerTreeFrameSink::ShutdownOnThread,
+                                  base::Unretained(this), &event));
+    event.Wait();
+    thread_.Stop();
+  }
 
   // remote 和 associated_remote 只能一个有效.
   // remote 用于非 root 的 client, associated_remote 用于 root client.
@@ -136,9 +178,60 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     base::AutoLock lock(lock_);
     child_frame_sink_id_ = child_frame_sink_id;
     local_surface_id_allocator_.GenerateId();
+    SetNeedsFrameLocked();
     return local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation();
   }
 
+  // 为 child 分配新的 LocalSurfaceId，child 提交新的 CF 之前使用最近一次
+  // 激活的 surface 作为 fallback。连续 Resize 时上一次分配的 LocalSurfaceId
+  // 可能从来没有激活过，不能作为 fallback
+  viz::LocalSurfaceIdAllocation ResizeChild() {
+    base::AutoLock lock(lock_);
+    local_surface_id_allocator_.GenerateId();
+    SetNeedsFrameLocked();
+    return local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation();
+  }
+
+  // child 的 surface 第一次激活时由 host 调用，更新 fallback，
+  // 可以在任意线程中调用
+  void DidActivateChildSurface(const viz::SurfaceId& surface_id) {
+    base::AutoLock lock(lock_);
+    if (surface_id.frame_sink_id() != child_frame_sink_id_)
+      return;
+    if (!child_fallback_local_surface_id_.is_valid() ||
+        surface_id.local_surface_id().IsNewerThan(
+            child_fallback_local_surface_id_)) {
+      child_fallback_local_surface_id_ = surface_id.local_surface_id();
+    }
+  }
+
+  // 每个 BeginFrame 都提交 CF，用于压力测试，可以在任意线程中调用
+  void set_submit_every_frame(bool submit_every_frame) {
+    base::AutoLock lock(lock_);
+    submit_every_frame_ = submit_every_frame;
+    if (submit_every_frame_)
+      SetNeedsFrameLocked();
+  }
+
+  // 每一帧上屏之后在 client 线程中执行 callback，可以在任意线程中调用
+  void SetFramePresentedCallback(
+      FrameTimingReporter::FramePresentedCallback callback) {
+    thread_.task_runner()->PostTask(
+        FROM_HERE,
+        base::BindOnce(&FrameTimingReporter::set_frame_presented_callback,
+                       base::Unretained(&frame_timing_reporter_),
+                       std::move(callback)));
+  }
+
+  // 下一帧使用新的 LocalSurfaceId 和大小提交
+  void Resize(const viz::LocalSurfaceIdAllocation& local_surface_id,
+              const gfx::Rect& bounds) {
+    base::AutoLock lock(lock_);
+    local_surface_id_ = local_surface_id;
+    bounds_ = bounds;
+    SetNeedsFrameLocked();
+  }
+
  private:
   void BindOnThread(
       mojo::PendingReceiver<viz::mojom::CompositorFrameSinkClient> receiver,
@@ -151,10 +244,53 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     } else {
       frame_sink_remote_.Bind(std::move(remote));
     }
-    // 告诉 CompositorFrameSink 可以开始请求 CompositorFrame 了
-    GetCompositorFrameSinkPtr()->SetNeedsBeginFrame(true);
     client_resource_provider_ =
         std::make_unique<viz::ClientResourceProvider>(false);
+    shared_bitmap_pool_ = std::make_unique<SharedBitmapPool>(
+        GetCompositorFrameSinkPtr(), client_resource_provider_.get());
+    // 告诉 CompositorFrameSink 可以开始请求 CompositorFrame 了，
+    // 之后只有内容变化时才接收 BeginFrame
+    begin_frame_throttler_.Bind(GetCompositorFrameSinkPtr());
+    // 原来每 60 个 BeginFrame 换一次颜色，现在由定时器驱动
+    animation_timer_.Start(FROM_HERE, kAnimationInterval,
+                           base::BindRepeating(&LayerTreeFrameSink::Animate,
+                                               base::Unretained(this)));
+  }
+
+  void Animate() {
+    base::AutoLock lock(lock_);
+    ++animation_step_;
+    SetNeedsFrameLocked();
+  }
+
+  void ShutdownOnThread(base::WaitableEvent* event) {
+    DCHECK(thread_.task_runner()->BelongsToCurrentThread());
+    animation_timer_.Stop();
+    begin_frame_throttler_.Unbind();
+    // 之后不会再收到 OnBeginFrame 以及资源的归还
+    receiver_.reset();
+    // viz 还没有归还的资源以 lost 的状态释放回 pool，
+    // pool 需要通过 CompositorFrameSink 删除共享内存
+    if (client_resource_provider_)
+      client_resource_provider_->ShutdownAndReleaseAllResources();
+    shared_bitmap_pool_.reset();
+    client_resource_provider_.reset();
+    frame_sink_associated_remote_.reset();
+    frame_sink_remote_.reset();
+    event->Signal();
+  }
+
+  // 下一次 BeginFrame 时提交 CF，已经停止接收 BeginFrame 时重新请求
+  void SetNeedsFrameLocked() {
+    lock_.AssertAcquired();
+    needs_frame_ = true;
+    if (thread_.task_runner()->BelongsToCurrentThread()) {
+      begin_frame_throttler_.Invalidate();
+    } else {
+      thread_.task_runner()->PostTask(
+          FROM_HERE, base::BindOnce(&BeginFrameThrottler::Invalidate,
+                                    base::Unretained(&begin_frame_throttler_)));
+    }
   }
 
   viz::CompositorFrame CreateFrame(const ::viz::BeginFrameArgs& args) {
@@ -166,6 +302,12 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     frame.metadata.local_surface_id_allocation_time =
         local_surface_id_.allocation_time();
     frame.metadata.frame_token = ++frame_token_generator_;
+    // 引用了 child 新的 surface 时 viz 最多等待的帧数
+    frame.metadata.deadline = viz::FrameDeadline(
+        args.frame_time,
+        switches::GetDeadlineToSynchronizeSurfaces().value_or(
+            std::numeric_limits<uint32_t>::max()),
+        args.interval, false);
 
     const int kRenderPassId = 1;
     const gfx::Rect& output_rect = bounds_;
@@ -223,15 +365,15 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     canvas.drawCircle(
         30, 100, 150,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 1) % base::size(colors)])));
+            colors[(animation_step_ + 1) % base::size(colors)])));
     canvas.drawCircle(
         10, 50, 60,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 2) % base::size(colors)])));
+            colors[(animation_step_ + 2) % base::size(colors)])));
     canvas.drawCircle(
         180, 180, 50,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 3) % base::size(colors)])));
+            colors[(animation_step_ + 3) % base::size(colors)])));
 
     gfx::Size tile_size(200, 200);
     // 将 SkBitmap 中的数据转换为资源
@@ -276,15 +418,15 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     canvas.drawCircle(
         30, 100, 150,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 2) % base::size(colors)])));
+            colors[(animation_step_ + 2) % base::size(colors)])));
     canvas.drawCircle(
         10, 50, 60,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 3) % base::size(colors)])));
+            colors[(animation_step_ + 3) % base::size(colors)])));
     canvas.drawCircle(
         180, 180, 50,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 1) % base::size(colors)])));
+            colors[(animation_step_ + 1) % base::size(colors)])));
 
     gfx::Size tile_size(200, 200);
     // 将 SkBitmap 中的数据转换为资源
@@ -337,6 +479,11 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
         /*is_clipped=*/false, /*are_contents_opaque=*/false, /*opacity=*/1.f,
         /*blend_mode=*/SkBlendMode::kSrcOver, /*sorting_context_id=*/0);
 
+    base::Optional<viz::SurfaceId> fallback_surface_id;
+    if (child_fallback_local_surface_id_.is_valid()) {
+      fallback_surface_id = viz::SurfaceId(child_frame_sink_id_,
+                                           child_fallback_local_surface_id_);
+    }
     viz::SurfaceId child_surface_id(
         child_frame_sink_id_,
         local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation()
@@ -344,7 +491,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     auto* surface_quad =
         render_pass->CreateAndAppendDrawQuad<viz::SurfaceDrawQuad>();
     surface_quad->SetNew(quad_state, output_rect, output_rect,
-                         viz::SurfaceRange(base::nullopt, child_surface_id),
+                         viz::SurfaceRange(fallback_surface_id, child_surface_id),
                          SK_ColorDKGRAY, true);
   }
 
@@ -431,53 +578,64 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
         render_pass->CreateAndAppendDrawQuad<viz::SolidColorDrawQuad>();
     color_quad->SetNew(
         quad_state, output_rect, output_rect,
-        colors[(*frame_token_generator_ / 60) % base::size(colors)], false);
+        colors[animation_step_ % base::size(colors)], false);
   }
 
-  // 使用共享内存来传递资源到 viz
+  // 使用共享内存来传递资源到 viz，共享内存由 SharedBitmapPool 复用，
+  // 只有池中没有可用的共享内存时才会分配并通过 DidAllocateSharedBitmap 注册。
+  // 把资源存入 ClientResourceProvider 进行统一管理。
+  // 后续会使用 ClientResourceProvider::PrepareSendToParent
+  // 将已经存入的资源添加 到 CF 中。
   viz::ResourceId AllocateAndFillSoftwareResource(const gfx::Size& size,
                                                   const SkBitmap& source) {
-    viz::SharedBitmapId shared_bitmap_id = viz::SharedBitmap::GenerateId();
-    // 创建共享内存
-    base::MappedReadOnlyRegion shm =
-        viz::bitmap_allocation::AllocateSharedBitmap(size, viz::RGBA_8888);
-    base::WritableSharedMemoryMapping mapping = std::move(shm.mapping);
-
-    SkImageInfo info = SkImageInfo::MakeN32Premul(size.width(), size.height());
-    // 将 SkBitmap 中的像素数据拷贝到共享内存
-    source.readPixels(info, mapping.memory(), info.minRowBytes(), 0, 0);
-
-    // 将共享内存及与之对应的资源Id发送到 viz service 端
-    GetCompositorFrameSinkPtr()->DidAllocateSharedBitmap(std::move(shm.region),
-                                                         shared_bitmap_id);
+    return shared_bitmap_pool_->ImportBitmap(size, source);
+  }
 
-    // 把资源存入 ClientResourceProvider 进行统一管理。
-    // 后续会使用 ClientResourceProvider::PrepareSendToParent
-    // 将已经存入的资源添加 到 CF 中。
-    return client_resource_provider_->ImportResource(
-        viz::TransferableResource::MakeSoftware(shared_bitmap_id, size,
-                                                viz::RGBA_8888),
-        viz::SingleReleaseCallback::Create(base::DoNothing()));
+  // viz 归还资源之后将其从 ClientResourceProvider 中移除，
+  // 对应的共享内存会回到 SharedBitmapPool 中
+  void ReturnResources(const std::vector<::viz::ReturnedResource>& resources) {
+    client_resource_provider_->ReceiveReturnsFromParent(resources);
+    for (const auto& resource : resources)
+      client_resource_provider_->RemoveImportedResource(resource.id);
   }
 
   void DidReceiveCompositorFrameAck(
-      const std::vector<::viz::ReturnedResource>& resources) override {}
+      const std::vector<::viz::ReturnedResource>& resources) override {
+    ReturnResources(resources);
+  }
 
   void OnBeginFrame(
       const ::viz::BeginFrameArgs& args,
       const base::flat_map<uint32_t, ::viz::FrameTimingDetails>& details)
       override {
     base::AutoLock lock(lock_);
-    GetCompositorFrameSinkPtr()->SubmitCompositorFrame(
-        local_surface_id_.local_surface_id(), CreateFrame(args),
-        base::Optional<viz::HitTestRegionList>(),
-        /*trace_time=*/0);
+    begin_frame_throttler_.WillHandleBeginFrame(args);
+    // 之前提交的 CF 的上屏时间
+    frame_timing_reporter_.DidReceiveTimingDetails(details);
+    const bool produce_frame = needs_frame_ || submit_every_frame_;
+    if (produce_frame) {
+      needs_frame_ = false;
+      viz::CompositorFrame frame = CreateFrame(args);
+      const uint32_t frame_token = frame.metadata.frame_token;
+      GetCompositorFrameSinkPtr()->SubmitCompositorFrame(
+          local_surface_id_.local_surface_id(), std::move(frame),
+          base::Optional<viz::HitTestRegionList>(),
+          /*trace_time=*/0);
+      frame_timing_reporter_.DidSubmitFrame(frame_token, args);
+    } else {
+      GetCompositorFrameSinkPtr()->DidNotProduceFrame(
+          viz::BeginFrameAck(args, false));
+    }
+    // 连续几帧没有新内容之后停止接收 BeginFrame
+    begin_frame_throttler_.DidHandleBeginFrame(produce_frame);
   }
 
   void OnBeginFramePausedChanged(bool paused) override {}
 
   void ReclaimResources(
-      const std::vector<::viz::ReturnedResource>& resources) override {}
+      const std::vector<::viz::ReturnedResource>& resources) override {
+    ReturnResources(resources);
+  }
 
   viz::mojom::CompositorFrameSink* GetCompositorFrameSinkPtr() {
     if (frame_sink_associated_remote_.is_bound())
@@ -494,57 +652,124 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
   gfx::Rect bounds_;
   viz::ParentLocalSurfaceIdAllocator local_surface_id_allocator_;
   viz::FrameSinkId child_frame_sink_id_;
+  viz::LocalSurfaceId child_fallback_local_surface_id_;
   // 模拟每个 Client 都在独立的线程中生成 CF
   base::Thread thread_;
   viz::FrameTokenGenerator frame_token_generator_;
+  // quad 颜色的索引，由 animation_timer_ 递增
+  uint32_t animation_step_ = 0;
+  // 内容有变化，下一次 BeginFrame 需要提交 CF
+  bool needs_frame_ = true;
+  bool submit_every_frame_ = false;
   base::Lock lock_;
 
   std::unique_ptr<viz::ClientResourceProvider> client_resource_provider_;
+  std::unique_ptr<SharedBitmapPool> shared_bitmap_pool_;
+  // 只在 thread_ 中使用
+  BeginFrameThrottler begin_frame_throttler_;
+  FrameTimingReporter frame_timing_reporter_;
+  base::RepeatingTimer animation_timer_;
 };
 
 // Host 端
-// 在 Chromium 中，Compositor 实现了 HostFrameSinkClient 接口，这里模拟 Chromium
-// 中的命名。
-class Compositor : public viz::HostFrameSinkClient {
+// 所有窗口共享的 host 端状态，对应 Chromium 中 VizProcessTransportFactory 持有的
+// HostFrameSinkManager。多个窗口共用一个 FrameSinkManager，所有 Compositor
+// 都在 compositor_thread_ 中访问它。
+class FrameSinkHost {
  public:
-  Compositor(gfx::AcceleratedWidget widget,
-             gfx::Size size,
-             mojo::PendingReceiver<viz::mojom::FrameSinkManagerClient> client,
-             mojo::PendingRemote<viz::mojom::FrameSinkManager> manager)
-      : widget_(widget), size_(size), compositor_thread_("CompositorThread") {
+  FrameSinkHost(
+      mojo::PendingReceiver<viz::mojom::FrameSinkManagerClient> client,
+      mojo::PendingRemote<viz::mojom::FrameSinkManager> manager)
+      : compositor_thread_("CompositorThread") {
     CHECK(compositor_thread_.Start());
     compositor_thread_.task_runner()->PostTask(
         FROM_HERE,
-        base::BindOnce(&Compositor::InitializeOnThread, base::Unretained(this),
+        base::BindOnce(&FrameSinkHost::BindOnThread, base::Unretained(this),
                        std::move(client), std::move(manager)));
   }
 
+  scoped_refptr<base::SingleThreadTaskRunner> task_runner() {
+    return compositor_thread_.task_runner();
+  }
+
+  viz::HostFrameSinkManager* host_frame_sink_manager() {
+    DCHECK(compositor_thread_.task_runner()->BelongsToCurrentThread());
+    return &host_frame_sink_manager_;
+  }
+
+  viz::FrameSinkId NextFrameSinkId() {
+    DCHECK(compositor_thread_.task_runner()->BelongsToCurrentThread());
+    return frame_sink_id_allocator_.NextFrameSinkId();
+  }
+
+ private:
+  void BindOnThread(
+      mojo::PendingReceiver<viz::mojom::FrameSinkManagerClient> client,
+      mojo::PendingRemote<viz::mojom::FrameSinkManager> manager) {
+    host_frame_sink_manager_.BindAndSetManager(std::move(client), nullptr,
+                                               std::move(manager));
+  }
+
+  viz::HostFrameSinkManager host_frame_sink_manager_;
+  base::Thread compositor_thread_;
+  viz::FrameSinkIdAllocator frame_sink_id_allocator_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(FrameSinkHost);
+};
+
+// 每个窗口对应一个 Compositor，拥有自己的 root CompositorFrameSink 和 Display。
+// viz 为每个 root CompositorFrameSink 创建独立的 BeginFrameSource，
+// 因此每个 Display 按照自己的 vsync 调度。
+// 在 Chromium 中，Compositor 实现了 HostFrameSinkClient 接口，这里模拟 Chromium
+// 中的命名。
+class Compositor : public viz::HostFrameSinkClient {
+ public:
+  Compositor(FrameSinkHost* host, gfx::AcceleratedWidget widget, gfx::Size size)
+      : host_(host), widget_(widget), size_(size) {
+    host_->task_runner()->PostTask(
+        FROM_HERE, base::BindOnce(&Compositor::InitializeOnThread,
+                                  base::Unretained(this)));
+  }
+
   void Resize(gfx::Size size) {
-    // TODO:
+    host_->task_runner()->PostTask(
+        FROM_HERE, base::BindOnce(&Compositor::ResizeOnThread,
+                                  base::Unretained(this), size));
+  }
+
+  // root 和 child 每个 BeginFrame 都提交 CF，root 的每一帧上屏之后在 root
+  // client 的线程中执行 callback
+  void StartDisplayBenchmark(
+      FrameTimingReporter::FramePresentedCallback callback) {
+    host_->task_runner()->PostTask(
+        FROM_HERE,
+        base::BindOnce(&Compositor::StartDisplayBenchmarkOnThread,
+                       base::Unretained(this), std::move(callback)));
   }
 
   // Called when a CompositorFrame with a new SurfaceId activates for the first
   // time.
+  // child 的 surface 激活之后才能作为 fallback
   void OnFirstSurfaceActivation(
-      const viz::SurfaceInfo& surface_info) override {}
+      const viz::SurfaceInfo& surface_info) override {
+    if (root_client_)
+      root_client_->DidActivateChildSurface(surface_info.id());
+  }
 
   // Called when a CompositorFrame with a new frame token is provided.
   void OnFrameTokenChanged(uint32_t frame_token) override {}
 
  private:
-  void InitializeOnThread(
-      mojo::PendingReceiver<viz::mojom::FrameSinkManagerClient> client,
-      mojo::PendingRemote<viz::mojom::FrameSinkManager> manager) {
-    host_frame_sink_manager_.BindAndSetManager(std::move(client), nullptr,
-                                               std::move(manager));
+  void InitializeOnThread() {
     display_client_ = std::make_unique<viz::HostDisplayClient>(widget_);
+    viz::HostFrameSinkManager* host_frame_sink_manager =
+        host_->host_frame_sink_manager();
 
     // 创建 root client 的 FrameSinkId
-    viz::FrameSinkId root_frame_sink_id =
-        frame_sink_id_allocator_.NextFrameSinkId();
+    viz::FrameSinkId root_frame_sink_id = host_->NextFrameSinkId();
 
     // 注册 root client 的 FrameSinkId
-    host_frame_sink_manager_.RegisterFrameSinkId(
+    host_frame_sink_manager->RegisterFrameSinkId(
         root_frame_sink_id, this, viz::ReportFirstSurfaceActivation::kNo);
 
     mojo::PendingAssociatedRemote<viz::mojom::CompositorFrameSink>
@@ -571,7 +796,7 @@ class Compositor : public viz::HostFrameSinkClient {
     params->display_private = display_private_.BindNewEndpointAndPassReceiver();
     // CreateRendererSettings 里面有很多和渲染相关的设置,有些对于调试非常方便
     params->renderer_settings = viz::CreateRendererSettings();
-    host_frame_sink_manager_.CreateRootCompositorFrameSink(std::move(params));
+    host_frame_sink_manager->CreateRootCompositorFrameSink(std::move(params));
 
     display_private_->Resize(size_);
     display_private_->SetDisplayVisible(true);
@@ -586,16 +811,41 @@ class Compositor : public viz::HostFrameSinkClient {
     EmbedChildClient(root_frame_sink_id);
   }
 
+  // InitializeOnThread 先于它在 compositor 线程中执行，root_client_ 已经创建
+  void StartDisplayBenchmarkOnThread(
+      FrameTimingReporter::FramePresentedCallback callback) {
+    root_client_->SetFramePresentedCallback(std::move(callback));
+    root_client_->set_submit_every_frame(true);
+    child_client_->set_submit_every_frame(true);
+  }
+
+  // 分配新的 LocalSurfaceId 并同步调整 Display、root 和 child 的大小
+  void ResizeOnThread(gfx::Size size) {
+    if (size == size_ || !root_client_)
+      return;
+    TRACE_EVENT1("viz", "Compositor::Resize", "size", size.ToString());
+    size_ = size;
+    local_surface_id_allocator_.GenerateId();
+    display_private_->Resize(size_);
+    root_client_->Resize(
+        local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation(),
+        gfx::Rect(size_));
+    if (child_client_)
+      child_client_->Resize(root_client_->ResizeChild(), gfx::Rect(size_));
+  }
+
   void EmbedChildClient(viz::FrameSinkId parent_frame_sink_id) {
     // 创建 child 的 FrameSinkId
-    viz::FrameSinkId frame_sink_id = frame_sink_id_allocator_.NextFrameSinkId();
+    viz::FrameSinkId frame_sink_id = host_->NextFrameSinkId();
     // uint64_t rand = base::RandUint64();
     // viz::FrameSinkId frame_sink_id(rand >> 32, rand & 0xffffffff);
 
-    // 注册 root client 的 FrameSinkId
-    host_frame_sink_manager_.RegisterFrameSinkId(
-        frame_sink_id, this, viz::ReportFirstSurfaceActivation::kNo);
-    host_frame_sink_manager_.RegisterFrameSinkHierarchy(parent_frame_sink_id,
+    // 注册 child client 的 FrameSinkId
+    viz::HostFrameSinkManager* host_frame_sink_manager =
+        host_->host_frame_sink_manager();
+    host_frame_sink_manager->RegisterFrameSinkId(
+        frame_sink_id, this, viz::ReportFirstSurfaceActivation::kYes);
+    host_frame_sink_manager->RegisterFrameSinkHierarchy(parent_frame_sink_id,
                                                         frame_sink_id);
 
     mojo::PendingRemote<viz::mojom::CompositorFrameSink> frame_sink_remote;
@@ -605,7 +855,7 @@ class Compositor : public viz::HostFrameSinkClient {
     mojo::PendingRemote<viz::mojom::CompositorFrameSinkClient> client_remote;
     mojo::PendingReceiver<viz::mojom::CompositorFrameSinkClient>
         client_receiver = client_remote.InitWithNewPipeAndPassReceiver();
-    host_frame_sink_manager_.CreateCompositorFrameSink(
+    host_frame_sink_manager->CreateCompositorFrameSink(
         frame_sink_id, std::move(frame_sink_receiver),
         std::move(client_remote));
 
@@ -616,11 +866,9 @@ class Compositor : public viz::HostFrameSinkClient {
                         std::move(frame_sink_remote));
   }
 
+  FrameSinkHost* const host_;
   gfx::AcceleratedWidget widget_;
   gfx::Size size_;
-  viz::HostFrameSinkManager host_frame_sink_manager_;
-  base::Thread compositor_thread_;
-  viz::FrameSinkIdAllocator frame_sink_id_allocator_{0};
   viz::ParentLocalSurfaceIdAllocator local_surface_id_allocator_;
   std::unique_ptr<viz::HostDisplayClient> display_client_;
   mojo::AssociatedRemote<viz::mojom::DisplayPrivate> display_private_;
@@ -653,8 +901,10 @@ class GpuService {
 // compositor.
 class DemoVizWindow : public ui::PlatformWindowDelegate {
  public:
-  DemoVizWindow(base::OnceClosure close_closure)
-      : close_closure_(std::move(close_closure)) {}
+  DemoVizWindow(FrameSinkHost* frame_sink_host,
+                base::RepeatingClosure close_closure)
+      : frame_sink_host_(frame_sink_host),
+        close_closure_(std::move(close_closure)) {}
   ~DemoVizWindow() override = default;
 
   void Create(const gfx::Rect& bounds) {
@@ -664,6 +914,14 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
       InitializeDemo();
   }
 
+  // Compositor 在窗口的 gfx::AcceleratedWidget 可用之后才创建
+  void StartDisplayBenchmark(
+      FrameTimingReporter::FramePresentedCallback callback) {
+    frame_presented_callback_ = std::move(callback);
+    if (host_)
+      host_->StartDisplayBenchmark(frame_presented_callback_);
+  }
+
  private:
   std::unique_ptr<ui::PlatformWindow> CreatePlatformWindow(
       const gfx::Rect& bounds) {
@@ -685,35 +943,18 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
 
   void InitializeDemo() {
     DCHECK_NE(widget_, gfx::kNullAcceleratedWidget);
-    // We finally have a valid gfx::AcceleratedWidget. We can now start the
-    // actual process of setting up the viz host and the service.
-    // First, set up the mojo message-pipes that the host and the service will
-    // use to communicate with each other.
-    mojo::PendingRemote<viz::mojom::FrameSinkManager> frame_sink_manager;
-    mojo::PendingReceiver<viz::mojom::FrameSinkManager>
-        frame_sink_manager_receiver =
-            frame_sink_manager.InitWithNewPipeAndPassReceiver();
-    mojo::PendingRemote<viz::mojom::FrameSinkManagerClient>
-        frame_sink_manager_client;
-    mojo::PendingReceiver<viz::mojom::FrameSinkManagerClient>
-        frame_sink_manager_client_receiver =
-            frame_sink_manager_client.InitWithNewPipeAndPassReceiver();
-
-    // Next, create the host and the service, and pass them the right ends of
-    // the message-pipes.
+    // 所有窗口共享 DemoVizApp 中的 FrameSinkHost 和 GpuService，
+    // 每个窗口只创建自己的 root CompositorFrameSink
     host_ = std::make_unique<Compositor>(
-        widget_, platform_window_->GetBounds().size(),
-        std::move(frame_sink_manager_client_receiver),
-        std::move(frame_sink_manager));
-
-    service_ =
-        std::make_unique<GpuService>(std::move(frame_sink_manager_receiver),
-                                     std::move(frame_sink_manager_client));
+        frame_sink_host_, widget_, platform_window_->GetBounds().size());
+    if (frame_presented_callback_)
+      host_->StartDisplayBenchmark(frame_presented_callback_);
   }
 
   // ui::PlatformWindowDelegate:
   void OnBoundsChanged(const gfx::Rect& new_bounds) override {
-    host_->Resize(new_bounds.size());
+    if (host_)
+      host_->Resize(new_bounds.size());
   }
 
   void OnAcceleratedWidgetAvailable(gfx::AcceleratedWidget widget) override {
@@ -727,29 +968,184 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
   void OnCloseRequest() override {
     // TODO: Use a more robust exit method
     platform_window_->Close();
-    // service_.reset();
     // host_.reset();
   }
-  void OnClosed() override {
-    if (close_closure_)
-      std::move(close_closure_).Run();
-  }
+  void OnClosed() override { close_closure_.Run(); }
   void OnWindowStateChanged(ui::PlatformWindowState new_state) override {}
   void OnLostCapture() override {}
   void OnAcceleratedWidgetDestroyed() override {}
   void OnActivationChanged(bool active) override {}
   void OnMouseEnter() override {}
 
+  FrameSinkHost* const frame_sink_host_;
   std::unique_ptr<Compositor> host_;
-  std::unique_ptr<GpuService> service_;
 
   std::unique_ptr<ui::PlatformWindow> platform_window_;
-  gfx::AcceleratedWidget widget_;
-  base::OnceClosure close_closure_;
+  gfx::AcceleratedWidget widget_ = gfx::kNullAcceleratedWidget;
+  base::RepeatingClosure close_closure_;
+  FrameTimingReporter::FramePresentedCallback frame_presented_callback_;
 
   DISALLOW_COPY_AND_ASSIGN(DemoVizWindow);
 };
 
+// 汇总所有 Display 的 root 上屏数据，各个 root client 在自己的线程中调用
+// AddFrame
+class DisplayScalingStats
+    : public base::RefCountedThreadSafe<DisplayScalingStats> {
+ public:
+  DisplayScalingStats() = default;
+
+  void AddFrame(base::TimeDelta latency, int64_t dropped) {
+    base::AutoLock lock(lock_);
+    present_latency_.Add(latency);
+    ++frames_;
+    dropped_ += dropped;
+  }
+
+  // 格式: frames_per_display=59.8/s dropped=3 (0.1%) PresentLatency: ...
+  std::string TakeReport(size_t displays, base::TimeDelta duration) {
+    base::AutoLock lock(lock_);
+    const double fps =
+        frames_ / duration.InSecondsF() / std::max<size_t>(displays, 1);
+    const double dropped_percent =
+        frames_ + dropped_ ? 100.0 * dropped_ / (frames_ + dropped_) : 0;
+    std::string report = base::StringPrintf(
+        "frames_per_display=%.1f/s dropped=%" PRId64 " (%.1f%%) ", fps,
+        dropped_, dropped_percent);
+    report += present_latency_.ToString();
+    present_latency_.Reset();
+    frames_ = 0;
+    dropped_ = 0;
+    return report;
+  }
+
+ private:
+  friend class base::RefCountedThreadSafe<DisplayScalingStats>;
+  ~DisplayScalingStats() = default;
+
+  base::Lock lock_;
+  LatencyRecorder present_latency_{"PresentLatency"};
+  int64_t frames_ = 0;
+  int64_t dropped_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(DisplayScalingStats);
+};
+
+// 创建所有窗口共享的 FrameSinkHost 和 GpuService。
+// --windows=N 同时打开 N 个窗口，关闭任意一个窗口退出。
+// --display-scaling=N 每 kDisplayScalingStageDuration 增加一个窗口直到 N 个，
+// 所有 root 每一帧都提交 CF，每个阶段结束时输出每个 Display 的帧率、掉帧、
+// 上屏延迟以及进程的 CPU 占用，用于观察 Display 数量增加时
+// viz compositor 线程调度的开销。
+class DemoVizApp {
+ public:
+  explicit DemoVizApp(base::RepeatingClosure quit_closure)
+      : quit_closure_(std::move(quit_closure)),
+        process_metrics_(base::ProcessMetrics::CreateCurrentProcessMetrics()) {}
+
+  void Start() {
+    // Set up the mojo message-pipes that the host and the service will use to
+    // communicate with each other.
+    mojo::PendingRemote<viz::mojom::FrameSinkManager> frame_sink_manager;
+    mojo::PendingReceiver<viz::mojom::FrameSinkManager>
+        frame_sink_manager_receiver =
+            frame_sink_manager.InitWithNewPipeAndPassReceiver();
+    mojo::PendingRemote<viz::mojom::FrameSinkManagerClient>
+        frame_sink_manager_client;
+    mojo::PendingReceiver<viz::mojom::FrameSinkManagerClient>
+        frame_sink_manager_client_receiver =
+            frame_sink_manager_client.InitWithNewPipeAndPassReceiver();
+
+    // Next, create the host and the service, and pass them the right ends of
+    // the message-pipes.
+    frame_sink_host_ = std::make_unique<FrameSinkHost>(
+        std::move(frame_sink_manager_client_receiver),
+        std::move(frame_sink_manager));
+    service_ =
+        std::make_unique<GpuService>(std::move(frame_sink_manager_receiver),
+                                     std::move(frame_sink_manager_client));
+
+    const base::CommandLine* command_line =
+        base::CommandLine::ForCurrentProcess();
+    if (command_line->HasSwitch(kDisplayScaling)) {
+      if (!base::StringToSizeT(
+              command_line->GetSwitchValueASCII(kDisplayScaling),
+              &max_displays_) ||
+          !max_displays_) {
+        max_displays_ = kDefaultMaxDisplays;
+      }
+      stats_ = base::MakeRefCounted<DisplayScalingStats>();
+      StartDisplayScalingStage();
+      return;
+    }
+    size_t windows = 1;
+    if (command_line->HasSwitch(kWindows)) {
+      base::StringToSizeT(command_line->GetSwitchValueASCII(kWindows),
+                          &windows);
+    }
+    for (size_t i = 0; i < std::max<size_t>(windows, 1); ++i)
+      AddWindow();
+  }
+
+ private:
+  void AddWindow() {
+    const int offset = windows_.size() * kWindowOffset;
+    auto window =
+        std::make_unique<DemoVizWindow>(frame_sink_host_.get(), quit_closure_);
+    window->Create(gfx::Rect(gfx::Point(offset, offset), kWindowSize));
+    if (stats_) {
+      window->StartDisplayBenchmark(
+          base::BindRepeating(&DisplayScalingStats::AddFrame, stats_));
+    }
+    windows_.push_back(std::move(window));
+  }
+
+  void StartDisplayScalingStage() {
+    AddWindow();
+    // 丢弃上一阶段结束之后的数据
+    stats_->TakeReport(windows_.size(), kDisplayScalingStageDuration);
+    stage_start_time_ = base::TimeTicks::Now();
+    stage_start_cpu_ = process_metrics_->GetCumulativeCPUUsage();
+    base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+        FROM_HERE,
+        base::BindOnce(&DemoVizApp::EndDisplayScalingStage,
+                       base::Unretained(this)),
+        kDisplayScalingStageDuration);
+  }
+
+  void EndDisplayScalingStage() {
+    const base::TimeDelta elapsed = base::TimeTicks::Now() - stage_start_time_;
+    const base::TimeDelta cpu =
+        process_metrics_->GetCumulativeCPUUsage() - stage_start_cpu_;
+    const double cpu_percent =
+        100.0 * cpu.InMicrosecondsF() / elapsed.InMicrosecondsF();
+    // 使用软件合成，统计的是共享的 viz compositor 线程和 CPU 的争用，
+    // 不包括多个 Display 对 GPU 的争用
+    LOG(INFO) << "DisplayScaling: displays=" << windows_.size()
+              << " compositing=software "
+              << stats_->TakeReport(windows_.size(), elapsed)
+              << base::StringPrintf(" cpu=%.1f%% cpu_per_display=%.1f%%",
+                                    cpu_percent,
+                                    cpu_percent / windows_.size());
+    if (windows_.size() < max_displays_)
+      StartDisplayScalingStage();
+  }
+
+  base::RepeatingClosure quit_closure_;
+  std::unique_ptr<FrameSinkHost> frame_sink_host_;
+  std::unique_ptr<GpuService> service_;
+  // 需要先于 frame_sink_host_ 销毁
+  std::vector<std::unique_ptr<DemoVizWindow>> windows_;
+
+  std::unique_ptr<base::ProcessMetrics> process_metrics_;
+  scoped_refptr<DisplayScalingStats> stats_;
+  size_t max_displays_ = 0;
+  base::TimeTicks stage_start_time_;
+  base::TimeDelta stage_start_cpu_;
+
+  DISALLOW_COPY_AND_ASSIGN(DemoVizApp);
+};
+
 }  // namespace demo
 
 int main(int argc, char** argv) {
@@ -806,8 +1202,8 @@ int main(int argc, char** argv) {
 
   base::RunLoop run_loop;
 
-  demo::DemoVizWindow window(run_loop.QuitClosure());
-  window.Create(gfx::Rect(800, 600));
+  demo::DemoVizApp app(run_loop.QuitClosure());
+  app.Start();
 
   LOG(INFO) << "running...";
   run_loop.Run();
@@ -2,15 +2,20 @@
 #include "base/callback.h"
 #include "base/command_line.h"
 #include "base/files/file_path.h"
+#include "base/files/file_util.h"
 #include "base/i18n/icu_util.h"
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/memory/ptr_util.h"
+#include "base/memory/weak_ptr.h"
 #include "base/message_loop/message_loop.h"
 #include "base/message_loop/message_pump_type.h"
 #include "base/path_service.h"
 #include "base/power_monitor/power_monitor.h"
 #include "base/power_monitor/power_monitor_device_source.h"
+#include "base/process/launch.h"
+#include "base/process/process.h"
+#include "base/process/process_metrics.h"
 #include "base/rand_util.h"
 #include "base/run_loop.h"
 #include "base/synchronization/waitable_event.h"
@@ -20,6 +25,7 @@
 #include "base/test/test_discardable_memory_allocator.h"
 #include "base/test/test_timeouts.h"
 #include "base/threading/thread.h"
+#include "base/timer/timer.h"
 #include "base/trace_event/trace_buffer.h"
 #include "build/build_config.h"
 #include "build/buildflag.h"
@@ -49,6 +55,8 @@
 #include "components/viz/service/main/viz_main_impl.h"
 #include "content/public/common/content_switches.h"
 #include "demo/common/utils.h"
+#include "demo/demo_viz/frame_timing_reporter.h"
+#include "demo/demo_viz/ipc_cost_reporter.h"
 #include "gpu/command_buffer/client/gpu_memory_buffer_manager.h"
 #include "gpu/command_buffer/client/shared_image_interface.h"
 #include "gpu/command_buffer/common/shared_image_usage.h"
@@ -56,6 +64,7 @@
 #include "gpu/command_buffer/service/service_utils.h"
 #include "gpu/config/gpu_finch_features.h"
 #include "gpu/ipc/client/gpu_channel_host.h"
+#include "gpu/ipc/common/gpu_client_ids.h"
 #include "gpu/ipc/common/gpu_memory_buffer_support.h"
 #include "gpu/ipc/host/shader_disk_cache.h"
 #include "gpu/ipc/service/gpu_init.h"
@@ -68,9 +77,16 @@
 #include "mojo/public/cpp/bindings/generic_pending_receiver.h"
 #include "mojo/public/cpp/bindings/pending_receiver.h"
 #include "mojo/public/cpp/bindings/pending_remote.h"
+#include "mojo/public/cpp/platform/platform_channel.h"
+#include "mojo/public/cpp/system/invitation.h"
+#include "net/base/net_errors.h"
 #include "services/resource_coordinator/public/mojom/memory_instrumentation/constants.mojom-forward.h"
 #include "services/viz/privileged/mojom/viz_main.mojom.h"
 #include "services/viz/public/cpp/gpu/context_provider_command_buffer.h"
+#include "services/viz/public/mojom/compositing/begin_frame_args.mojom.h"
+#include "services/viz/public/mojom/compositing/compositor_frame.mojom.h"
+#include "services/viz/public/mojom/compositing/frame_timing_details.mojom.h"
+#include "services/viz/public/mojom/compositing/returned_resource.mojom.h"
 #include "third_party/skia/include/gpu/GrTypes.h"
 #include "ui/base/hit_test.h"
 #include "ui/base/ime/init/input_method_initializer.h"
@@ -120,6 +136,42 @@ namespace {
 constexpr SkColor colors[] = {SK_ColorRED, SK_ColorGREEN, SK_ColorYELLOW};
 // Global atomic to generate child process unique IDs.
 base::AtomicSequenceNumber g_unique_id;
+
+// 在单独的子进程中运行 VizMain，用于对比进程隔离带来的 IPC 开销
+constexpr char kVizProcess[] = "viz-process";
+// 子进程的 --type 参数
+constexpr char kVizProcessType[] = "viz";
+// host 和 viz 子进程之间传递 legacy IPC 通道的 message pipe 的名字
+constexpr char kVizChannelName[] = "viz channel";
+// 每帧额外序列化一次 CF 以统计它的字节数，开销和 CF 的大小成正比，默认关闭
+constexpr char kMeasureFrameBytes[] = "measure-frame-bytes";
+// host 退出时等待 viz 子进程退出的时间，超时则强制结束
+constexpr base::TimeDelta kVizProcessExitTimeout =
+    base::TimeDelta::FromSeconds(5);
+
+constexpr base::TimeDelta kProcessCpuReportInterval =
+    base::TimeDelta::FromSeconds(10);
+
+// shader 磁盘缓存的目录，默认为当前目录下的 kDefaultShaderCacheDir
+constexpr char kShaderCacheDir[] = "shader-cache-dir";
+// 启动前清空 shader 磁盘缓存，用于测量冷启动
+constexpr char kClearShaderCache[] = "clear-shader-cache";
+constexpr base::FilePath::CharType kDefaultShaderCacheDir[] =
+    FILE_PATH_LITERAL("demo_viz_gui_gpu_shader_cache");
+
+// 当前 viz 运行的位置，用于区分不同模式下的统计输出
+std::string VizLayoutName() {
+  return base::CommandLine::ForCurrentProcess()->HasSwitch(kVizProcess)
+             ? "viz-process"
+             : "in-process";
+}
+
+// mojom struct 序列化之后的大小，即作为消息参数时 payload 的大小
+template <typename MojomType, typename UserType>
+size_t SerializedSize(const UserType& value) {
+  UserType copy = value;
+  return MojomType::Serialize(&copy).size();
+}
 }  // namespace
 
 // Client 端
@@ -132,7 +184,14 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
       : frame_sink_id_(frame_sink_id),
         local_surface_id_(local_surface_id),
         bounds_(bounds),
-        thread_("Demo_" + frame_sink_id.ToString()) {
+        thread_("Demo_" + frame_sink_id.ToString()),
+        frame_timing_reporter_("LayerTreeFrameSink " +
+                               frame_sink_id.ToString() + " " +
+                               VizLayoutName()),
+        ipc_cost_reporter_("LayerTreeFrameSink " + frame_sink_id.ToString() +
+                           " " + VizLayoutName()),
+        measure_frame_bytes_(base::CommandLine::ForCurrentProcess()->HasSwitch(
+            kMeasureFrameBytes)) {
     CHECK(thread_.Start());
   }
 
@@ -177,6 +236,16 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     }
   }
 
+  // callback 在 client 线程中调用
+  void SetFramePresentedCallback(
+      FrameTimingReporter::FramePresentedCallback callback) {
+    thread_.task_runner()->PostTask(
+        FROM_HERE,
+        base::BindOnce(&FrameTimingReporter::set_frame_presented_callback,
+                       base::Unretained(&frame_timing_reporter_),
+                       std::move(callback)));
+  }
+
   viz::LocalSurfaceIdAllocation EmbedChild(
       const viz::FrameSinkId& child_frame_sink_id) {
     base::AutoLock lock(lock_);
@@ -513,6 +582,8 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     source.readPixels(info, mapping.memory(), info.minRowBytes(), 0, 0);
 
     // 将共享内存及与之对应的资源Id发送到 viz service 端
+    ipc_cost_reporter_.DidSendMessage();
+    ipc_cost_reporter_.DidTransferPixels(shm.region.GetSize());
     GetCompositorFrameSinkPtr()->DidAllocateSharedBitmap(std::move(shm.region),
                                                          shared_bitmap_id);
 
@@ -539,6 +610,11 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     gpu::Mailbox mailbox = sii->CreateSharedImage(
         format, size, color_space, gpu::SHARED_IMAGE_USAGE_DISPLAY, pixels);
     gpu::SyncToken sync_token = sii->GenVerifiedSyncToken();
+    // CreateSharedImage 和 GenVerifiedSyncToken 都通过 GPU channel 发送，
+    // 实际的消息数取决于 flush 的时机，只能估算；像素数据通过共享内存传递到 viz
+    ipc_cost_reporter_.DidSendEstimatedMessage();
+    ipc_cost_reporter_.DidSendEstimatedMessage();
+    ipc_cost_reporter_.DidTransferPixels(pixels.size());
 
     viz::TransferableResource gl_resource = viz::TransferableResource::MakeGL(
         mailbox, GL_LINEAR, GL_TEXTURE_2D, sync_token, size,
@@ -560,6 +636,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     DCHECK(context_provider);
     gpu::SharedImageInterface* sii = context_provider->SharedImageInterface();
     DCHECK(sii);
+    ipc_cost_reporter_.DidSendEstimatedMessage();
     sii->DestroySharedImage(sync_token, mailbox);
   }
 
@@ -568,6 +645,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     TRACE_EVENT1("viz", "LayerTreeFrameSink::DidReceiveCompositorFrameAck",
                  "size", resources.size());
     DLOG(INFO) << __FUNCTION__;
+    DidReceiveResources(resources);
     client_resource_provider_->ReceiveReturnsFromParent(resources);
     for (auto resource : resources) {
       client_resource_provider_->RemoveImportedResource(resource.id);
@@ -579,10 +657,30 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
       const base::flat_map<uint32_t, ::viz::FrameTimingDetails>& details)
       override {
     base::AutoLock lock(lock_);
+    size_t received_bytes = SerializedSize<viz::mojom::BeginFrameArgs>(args);
+    for (const auto& detail : details) {
+      received_bytes +=
+          SerializedSize<viz::mojom::FrameTimingDetails>(detail.second);
+    }
+    ipc_cost_reporter_.DidReceiveMessage(received_bytes);
+    // 之前提交的 CF 的上屏时间
+    frame_timing_reporter_.DidReceiveTimingDetails(details);
+
+    viz::CompositorFrame frame = CreateFrame(args);
+    const uint32_t frame_token = frame.metadata.frame_token;
+    // 额外序列化一次 CF 得到它作为消息参数的大小，在提交之前完成，
+    // 不计入提交到绘制的延迟，但会占用 client 线程，只在 --measure-frame-bytes
+    // 时进行，否则只统计消息数
+    ipc_cost_reporter_.DidSendMessage(
+        measure_frame_bytes_
+            ? viz::mojom::CompositorFrame::Serialize(&frame).size()
+            : 0);
     GetCompositorFrameSinkPtr()->SubmitCompositorFrame(
-        local_surface_id_.local_surface_id(), CreateFrame(args),
+        local_surface_id_.local_surface_id(), std::move(frame),
         base::Optional<viz::HitTestRegionList>(),
         /*trace_time=*/0);
+    frame_timing_reporter_.DidSubmitFrame(frame_token, args);
+    ipc_cost_reporter_.DidSubmitFrame();
   }
 
   void OnBeginFramePausedChanged(bool paused) override {
@@ -594,12 +692,21 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     TRACE_EVENT1("viz", "LayerTreeFrameSink::ReclaimResources", "size",
                  resources.size());
     DLOG(INFO) << __FUNCTION__;
+    DidReceiveResources(resources);
     client_resource_provider_->ReceiveReturnsFromParent(resources);
     for (auto resource : resources) {
       client_resource_provider_->RemoveImportedResource(resource.id);
     }
   }
 
+  void DidReceiveResources(
+      const std::vector<::viz::ReturnedResource>& resources) {
+    size_t bytes = 0;
+    for (const auto& resource : resources)
+      bytes += SerializedSize<viz::mojom::ReturnedResource>(resource);
+    ipc_cost_reporter_.DidReceiveMessage(bytes);
+  }
+
   viz::mojom::CompositorFrameSink* GetCompositorFrameSinkPtr() {
     if (frame_sink_associated_remote_.is_bound())
       return frame_sink_associated_remote_.get();
@@ -622,6 +729,9 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
   scoped_refptr<viz::ContextProvider> context_provider_;
 
   std::unique_ptr<viz::ClientResourceProvider> client_resource_provider_;
+  FrameTimingReporter frame_timing_reporter_;
+  IpcCostReporter ipc_cost_reporter_;
+  const bool measure_frame_bytes_;
 };
 
 // Host 端
@@ -655,6 +765,12 @@ class Compositor : public viz::HostFrameSinkClient {
     // TODO:
   }
 
+  // root client 的帧上屏之后调用,在 root client 的线程中
+  void SetFramePresentedCallback(
+      FrameTimingReporter::FramePresentedCallback callback) {
+    root_client_->SetFramePresentedCallback(std::move(callback));
+  }
+
   // Called when a CompositorFrame with a new SurfaceId activates for the first
   // time.
   void OnFirstSurfaceActivation(
@@ -764,27 +880,197 @@ class Compositor : public viz::HostFrameSinkClient {
   std::unique_ptr<LayerTreeFrameSink> child_client_;
 };
 
-// Service 端
-// 在 Chromium 中它运行于 GPU 进程,因此这里取名 GpuService
-class GpuService : public viz::GpuHostImpl::Delegate,
-                   public viz::VizMainImpl::Delegate,
-                   public IPC::Listener {
+// Viz 端
+// 在 Chromium 中对应 GPU 进程中的 GpuChildThread，创建 VizMainImpl 并通过
+// legacy IPC 通道接收 host 端请求的 VizMain 接口。
+// 默认和 host 运行在同一个进程中，使用 --viz-process 时运行在单独的子进程中，
+// 两种情况下 host 端和 client 端的代码完全相同。
+class GpuChild : public viz::VizMainImpl::Delegate, public IPC::Listener {
  public:
-  GpuService(mojo::PendingReceiver<viz::mojom::FrameSinkManager> receiver,
-             mojo::PendingRemote<viz::mojom::FrameSinkManagerClient> client,
-             Compositor* compositor)
+  // quit_closure 在 IPC 通道断开时调用，可以为空
+  GpuChild(mojo::ScopedMessagePipeHandle legacy_ipc_channel_handle,
+           base::OnceClosure quit_closure)
       : io_thread_("Demo_IOThread"),
         gpu_main_thread_("Demo_GPUThread"),
-        compositor_(compositor),
+        quit_closure_(std::move(quit_closure)),
         shutdown_event_(base::WaitableEvent::ResetPolicy::MANUAL,
                         base::WaitableEvent::InitialState::NOT_SIGNALED) {
     DCHECK(io_thread_.Start());
     DCHECK(gpu_main_thread_.Start());
     main_thread_runner_ = base::ThreadTaskRunnerHandle::Get();
-    InitIPCServer();
+    gpu_main_thread_.task_runner()->PostTask(
+        FROM_HERE, base::BindOnce(&GpuChild::InitIPCClient,
+                                  base::Unretained(this),
+                                  std::move(legacy_ipc_channel_handle)));
     gpu_main_thread_.task_runner()->PostTask(
         FROM_HERE,
-        base::BindOnce(&GpuService::InitVizMain, base::Unretained(this)));
+        base::BindOnce(&GpuChild::InitVizMain, base::Unretained(this)));
+  }
+
+ private:
+  void InitIPCClient(mojo::ScopedMessagePipeHandle legacy_ipc_channel_handle) {
+    client_channel_ =
+        IPC::SyncChannel::Create(this, io_thread_.task_runner(),
+                                 base::ThreadTaskRunnerHandle::Get(), nullptr);
+    // #if BUILDFLAG(IPC_MESSAGE_LOG_ENABLED)
+    //     if (!IsInBrowserProcess())
+    //       IPC::Logging::GetInstance()->SetIPCSender(this);
+    // #endif
+
+    client_channel_->Init(
+        IPC::ChannelMojo::CreateClientFactory(
+            std::move(legacy_ipc_channel_handle), io_thread_.task_runner(),
+            base::ThreadTaskRunnerHandle::Get()),
+        /*create_pipe_now=*/true);
+  }
+
+  void InitVizMain() {
+    auto gpu_init = std::make_unique<gpu::GpuInit>();
+    gpu_init->InitializeInProcess(base::CommandLine::ForCurrentProcess(),
+                                  GetGpuPreferencesFromCommandLine());
+    viz_main_ = std::make_unique<viz::VizMainImpl>(
+        this, CreateVizMainDependencies(), std::move(gpu_init));
+    viz_main_->gpu_service()->set_start_time(base::Time::Now());
+  }
+
+  viz::VizMainImpl::ExternalDependencies CreateVizMainDependencies() {
+    viz::VizMainImpl::ExternalDependencies deps;
+    deps.create_display_compositor = true;
+    // if (!base::PowerMonitor::IsInitialized()) {
+    //   deps.power_monitor_source =
+    //       std::make_unique<base::PowerMonitorDeviceSource>();
+    // }
+    // if (GetContentClient()->gpu()) {
+    // deps.sync_point_manager =
+    // GetContentClient()->gpu()->GetSyncPointManager();
+    // deps.shared_image_manager =
+    //     GetContentClient()->gpu()->GetSharedImageManager();
+    // deps.viz_compositor_thread_runner = runner_.get();
+    // }
+    // deps.shutdown_event = &shutdown_event_;
+    deps.io_thread_task_runner = io_thread_.task_runner();
+
+    // mojo::PendingRemote<ukm::mojom::UkmRecorderInterface> ukm_recorder;
+    // ChildThread::Get()->BindHostReceiver(
+    //     ukm_recorder.InitWithNewPipeAndPassReceiver());
+    // deps.ukm_recorder =
+    //     std::make_unique<ukm::MojoUkmRecorder>(std::move(ukm_recorder));
+    return deps;
+  }
+
+  const gpu::GpuPreferences GetGpuPreferencesFromCommandLine() {
+    DCHECK(base::CommandLine::InitializedForCurrentProcess());
+    const base::CommandLine* command_line =
+        base::CommandLine::ForCurrentProcess();
+    gpu::GpuPreferences gpu_preferences =
+        gpu::gles2::ParseGpuPreferences(command_line);
+    gpu_preferences.disable_accelerated_video_decode = false;
+    gpu_preferences.disable_accelerated_video_encode = false;
+#if defined(OS_WIN)
+    gpu_preferences.enable_low_latency_dxva = !false;
+    gpu_preferences.enable_zero_copy_dxgi_video = !false;
+    gpu_preferences.enable_nv12_dxgi_video = !false;
+#endif
+    gpu_preferences.disable_software_rasterizer = false;
+    gpu_preferences.log_gpu_control_list_decisions = false;
+    gpu_preferences.gpu_startup_dialog = false;
+    gpu_preferences.disable_gpu_watchdog = false;
+    gpu_preferences.gpu_sandbox_start_early = false;
+
+    gpu_preferences.enable_oop_rasterization = false;
+    gpu_preferences.disable_oop_rasterization = false;
+
+    gpu_preferences.enable_oop_rasterization_ddl = false;
+    gpu_preferences.enforce_vulkan_protected_memory = false;
+    gpu_preferences.disable_vulkan_fallback_to_gl_for_testing = false;
+
+#if defined(OS_MACOSX)
+    gpu_preferences.enable_metal =
+        base::FeatureList::IsEnabled(features::kMetal);
+#endif
+
+    gpu_preferences.enable_gpu_benchmarking_extension = false;
+
+    gpu_preferences.enable_android_surface_control = false;
+
+    // Some of these preferences are set or adjusted in
+    // GpuDataManagerImplPrivate::AppendGpuCommandLine.
+    return gpu_preferences;
+  }
+
+#pragma region viz::VizMainImpl::Delegate
+  // viz::VizMainImpl::Delegate:
+  void OnInitializationFailed() override { DLOG(INFO) << __FUNCTION__; }
+  void OnGpuServiceConnection(viz::GpuServiceImpl* gpu_service) override {
+    DLOG(INFO) << __FUNCTION__;
+  }
+  void PostCompositorThreadCreated(
+      base::SingleThreadTaskRunner* task_runner) override {
+    DLOG(INFO) << __FUNCTION__;
+  }
+  void QuitMainMessageLoop() override { DLOG(INFO) << __FUNCTION__; }
+#pragma endregion
+
+#pragma region IPC::Listener implementation
+  // IPC::Listener implementation:
+  bool OnMessageReceived(const IPC::Message& msg) override {
+    DLOG(INFO) << __FUNCTION__;
+    return true;
+  }
+  void OnAssociatedInterfaceRequest(
+      const std::string& interface_name,
+      mojo::ScopedInterfaceEndpointHandle handle) override {
+    DLOG(INFO) << __FUNCTION__;
+    if (interface_name == viz::VizMainImpl::Name_) {
+      gpu_main_thread_.task_runner()->PostTask(
+          FROM_HERE,
+          base::BindOnce(
+              [](viz::VizMainImpl* viz_main,
+                 mojo::ScopedInterfaceEndpointHandle handle) {
+                viz_main->BindAssociated(
+                    mojo::PendingAssociatedReceiver<viz::mojom::VizMain>(
+                        std::move(handle)));
+              },
+              viz_main_.get(), base::Passed(std::move(handle))));
+    }
+  }
+  void OnChannelConnected(int32_t peer_pid) override {
+    DLOG(INFO) << __FUNCTION__;
+  }
+  void OnChannelError() override {
+    DLOG(INFO) << __FUNCTION__;
+    // host 退出或者崩溃之后 viz 子进程也随之退出
+    if (quit_closure_)
+      main_thread_runner_->PostTask(FROM_HERE, std::move(quit_closure_));
+  }
+#pragma endregion
+
+  base::Thread io_thread_;
+  base::Thread gpu_main_thread_;
+  scoped_refptr<base::SingleThreadTaskRunner> main_thread_runner_;
+  base::OnceClosure quit_closure_;
+
+  std::unique_ptr<IPC::SyncChannel> client_channel_;
+  std::unique_ptr<viz::VizMainImpl> viz_main_;
+
+  base::WaitableEvent shutdown_event_;
+
+  DISALLOW_COPY_AND_ASSIGN(GpuChild);
+};
+
+// Service 端
+// 在 Chromium 中 viz 运行于 GPU 进程,因此这里取名 GpuService.
+// 它负责启动 GpuChild 并通过 GpuHostImpl 连接 FrameSinkManager,
+// 相当于 Chromium 中的 GpuProcessHost.
+class GpuService : public viz::GpuHostImpl::Delegate, public IPC::Listener {
+ public:
+  GpuService(mojo::PendingReceiver<viz::mojom::FrameSinkManager> receiver,
+             mojo::PendingRemote<viz::mojom::FrameSinkManagerClient> client,
+             Compositor* compositor)
+      : compositor_(compositor), gpu_client_id_(g_unique_id.GetNext() + 1) {
+    main_thread_runner_ = base::ThreadTaskRunnerHandle::Get();
+    InitShaderCache();
+    InitIPCServer();
     // TODO： 添加同步逻辑
     main_thread_runner_->PostDelayedTask(
         FROM_HERE,
@@ -794,12 +1080,140 @@ class GpuService : public viz::GpuHostImpl::Delegate,
         base::TimeDelta::FromSeconds(5));
   }
 
+  // --viz-process 时关闭 IPC 通道，子进程在 GpuChild::OnChannelError 中退出，
+  // 等待它退出以免留下孤儿进程
+  ~GpuService() override {
+    cpu_report_timer_.Stop();
+    if (!viz_process_.IsValid())
+      return;
+    viz_process_metrics_.reset();
+    gpu_host_.reset();
+    server_channel_.reset();
+    int exit_code = 0;
+    if (!viz_process_.WaitForExitWithTimeout(kVizProcessExitTimeout,
+                                             &exit_code)) {
+      LOG(WARNING) << "viz process did not exit, terminating pid="
+                   << viz_process_.Pid();
+      viz_process_.Terminate(/*exit_code=*/0, /*wait=*/true);
+      return;
+    }
+    LOG(INFO) << "viz process exited, exit_code=" << exit_code;
+  }
+
+  // 为三类 client 分别指定 shader 磁盘缓存的目录,并在启动时就开始读取:
+  //  - kInProcessCommandBufferClientId: Display 的 GLRenderer 使用的
+  //    in-process command buffer,对应 GPU 端的 MemoryProgramCache
+  //  - kGrShaderCacheClientId: SkiaRenderer 和 OOP-R 使用的 gpu::GrShaderCache
+  //  - gpu_client_id_: client 端的 ContextProvider
+  // 读取和 viz 的初始化同时进行,读到的 shader 先保存在内存中,
+  // GpuHostImpl 创建之后、连接 FrameSinkManager 之前一次性发送给 GPU,
+  // 保证第一帧绘制时 shader 已经在 GPU 端的缓存中.
+  // 新编译的 shader 由 GpuHostImpl::StoreShaderToDisk 写回同一个目录.
+  void InitShaderCache() {
+    const base::CommandLine* command_line =
+        base::CommandLine::ForCurrentProcess();
+    if (command_line->HasSwitch(switches::kDisableGpuShaderDiskCache))
+      return;
+    base::FilePath cache_dir =
+        command_line->GetSwitchValuePath(kShaderCacheDir);
+    if (cache_dir.empty())
+      cache_dir = base::FilePath(kDefaultShaderCacheDir);
+    if (command_line->HasSwitch(kClearShaderCache))
+      base::DeleteFile(cache_dir, /*recursive=*/true);
+
+    const struct {
+      int32_t client_id;
+      const char* dir_name;
+    } kShaderCaches[] = {
+        {gpu::kInProcessCommandBufferClientId, "GPUCache"},
+        {gpu::kGrShaderCacheClientId, "GrShaderCache"},
+        {gpu_client_id_, "ClientCache"},
+    };
+    for (const auto& cache : kShaderCaches) {
+      factory_instance_->SetCacheInfo(cache.client_id,
+                                      cache_dir.AppendASCII(cache.dir_name));
+      // 持有 ShaderDiskCache,GpuHostImpl 之后通过 Get() 拿到的是同一个实例,
+      // 不会重复读取
+      scoped_refptr<gpu::ShaderDiskCache> disk_cache =
+          factory_instance_->Get(cache.client_id);
+      if (!disk_cache)
+        continue;
+      disk_cache->set_shader_loaded_callback(
+          base::BindRepeating(&GpuService::OnShaderLoaded,
+                              weak_factory_.GetWeakPtr(), cache.client_id));
+      if (disk_cache->SetAvailableCallback(base::BindOnce(
+              &GpuService::OnShaderCacheAvailable, weak_factory_.GetWeakPtr(),
+              disk_cache)) == net::OK) {
+        OnShaderCacheAvailable(disk_cache, net::OK);
+      }
+      shader_caches_.push_back(std::move(disk_cache));
+    }
+    LOG(INFO) << "ShaderCache: " << cache_dir.value();
+  }
+
+  // 后端打开之后，缓存中的所有条目都会被读出来发送给 GPU。
+  // GpuHostImpl 为同一个 ShaderDiskCache 设置自己的 shader_loaded_callback，
+  // 替换掉 OnShaderLoaded，之后读到的 shader 由它直接转发，外部无法观察，
+  // 所以读取的 shader 数量按后端打开时的条目数统计
+  void OnShaderCacheAvailable(scoped_refptr<gpu::ShaderDiskCache> disk_cache,
+                              int result) {
+    const int32_t entries = disk_cache->Size();
+    if (result == net::OK && entries > 0)
+      loaded_shaders_ += entries;
+  }
+
+  // 只统计 GpuHostImpl 接管之前读到的 shader
+  void OnShaderLoaded(int32_t client_id,
+                      const std::string& key,
+                      const std::string& data) {
+    if (gpu_host_) {
+      gpu_host_->gpu_service()->LoadedShader(client_id, key, data);
+      return;
+    }
+    preloaded_shader_bytes_ += key.size() + data.size();
+    pending_shaders_.push_back({client_id, key, data});
+  }
+
+  void OnRootFramePresented() {
+    // 清除 callback 之前已经 post 的任务
+    if (first_frame_reported_)
+      return;
+    const base::TimeDelta elapsed =
+        base::TimeTicks::Now() - viz_host_init_time_;
+    if (first_frame_time_.is_zero())
+      first_frame_time_ = elapsed;
+    // 等到 client 使用 GPU 资源之后的第一帧,这一帧需要编译纹理相关的 shader
+    if (context_provider_time_.is_null())
+      return;
+    const char* cache_state = shader_caches_.empty() ? "disabled"
+                              : loaded_shaders_      ? "warm"
+                                                     : "cold";
+    LOG(INFO) << "TimeToFirstFrame: cache=" << cache_state
+              << " loaded_shaders=" << loaded_shaders_
+              << " preloaded_shaders=" << preloaded_shaders_ << " ("
+              << preloaded_shader_bytes_ / 1024 << "KB)"
+              << " first_frame=" << first_frame_time_.InMillisecondsF() << "ms"
+              << " first_gpu_resource_frame=" << elapsed.InMillisecondsF()
+              << "ms (since viz host init)";
+    first_frame_reported_ = true;
+    compositor_->SetFramePresentedCallback(
+        FrameTimingReporter::FramePresentedCallback());
+  }
+
   void InitIPCServer() {
-    mojo::PendingRemote<IPC::mojom::ChannelBootstrap> bootstrap;
-    auto bootstrap_receiver = bootstrap.InitWithNewPipeAndPassReceiver();
+    mojo::ScopedMessagePipeHandle server_handle;
+    if (base::CommandLine::ForCurrentProcess()->HasSwitch(kVizProcess)) {
+      server_handle = LaunchVizProcess();
+    } else {
+      mojo::PendingRemote<IPC::mojom::ChannelBootstrap> bootstrap;
+      auto bootstrap_receiver = bootstrap.InitWithNewPipeAndPassReceiver();
+      server_handle = bootstrap.PassPipe();
+      gpu_child_ = std::make_unique<GpuChild>(bootstrap_receiver.PassPipe(),
+                                              base::OnceClosure());
+    }
 
     server_channel_ = IPC::ChannelMojo::Create(
-        bootstrap.PassPipe(), IPC::Channel::MODE_SERVER, this,
+        std::move(server_handle), IPC::Channel::MODE_SERVER, this,
         base::ThreadTaskRunnerHandle::Get(),
         base::ThreadTaskRunnerHandle::Get(),
         mojo::internal::MessageQuotaChecker::MaybeCreate());
@@ -812,39 +1226,63 @@ class GpuService : public viz::GpuHostImpl::Delegate,
     IPC::Logging::GetInstance();
 #endif
 
-    gpu_main_thread_.task_runner()->PostTask(
-        FROM_HERE,
-        base::BindOnce(&GpuService::InitIPCClient, base::Unretained(this),
-                       base::Passed(std::move(bootstrap_receiver))));
-
     DCHECK(server_channel_->Connect());
-  }
 
-  void InitIPCClient(
-      mojo::PendingReceiver<IPC::mojom::ChannelBootstrap> bootstrap_receiver) {
-    mojo::PendingRemote<IPC::mojom::ChannelBootstrap> legacy_ipc_bootstrap;
-    mojo::ScopedMessagePipeHandle legacy_ipc_channel_handle =
-        legacy_ipc_bootstrap.InitWithNewPipeAndPassReceiver().PassPipe();
-    mojo::FusePipes(std::move(bootstrap_receiver),
-                    std::move(legacy_ipc_bootstrap));
-    client_channel_ =
-        IPC::SyncChannel::Create(this, io_thread_.task_runner(),
-                                 base::ThreadTaskRunnerHandle::Get(), nullptr);
-    // #if BUILDFLAG(IPC_MESSAGE_LOG_ENABLED)
-    //     if (!IsInBrowserProcess())
-    //       IPC::Logging::GetInstance()->SetIPCSender(this);
-    // #endif
+    cpu_report_timer_.Start(FROM_HERE, kProcessCpuReportInterval,
+                            base::BindRepeating(&GpuService::ReportProcessCpu,
+                                                base::Unretained(this)));
+  }
+
+  // 和 demo_mojo_multiple_process.cc 相同,通过 PlatformChannel 启动子进程,
+  // 并通过 invitation 传递一条 message pipe 作为 legacy IPC 通道.
+  // 返回 host 端的 pipe.
+  mojo::ScopedMessagePipeHandle LaunchVizProcess() {
+    mojo::PlatformChannel channel;
+    mojo::OutgoingInvitation invitation;
+    mojo::ScopedMessagePipeHandle pipe =
+        invitation.AttachMessagePipe(kVizChannelName);
+
+    base::LaunchOptions options;
+    // 保留当前进程的参数,使 --use-gl 等 gpu 相关的开关在子进程中同样生效
+    base::CommandLine command_line(*base::CommandLine::ForCurrentProcess());
+    command_line.AppendSwitchASCII(switches::kProcessType, kVizProcessType);
+    channel.PrepareToPassRemoteEndpoint(&options, &command_line);
+    viz_process_ = base::LaunchProcess(command_line, options);
+    channel.RemoteProcessLaunchAttempted();
+    CHECK(viz_process_.IsValid());
+    LOG(INFO) << "viz process launched, pid=" << viz_process_.Pid();
+
+    mojo::OutgoingInvitation::Send(
+        std::move(invitation), viz_process_.Handle(),
+        channel.TakeLocalEndpoint(),
+        base::BindRepeating(
+            [](const std::string& error) { LOG(ERROR) << error; }));
+#if !defined(OS_MACOSX)
+    viz_process_metrics_ =
+        base::ProcessMetrics::CreateProcessMetrics(viz_process_.Handle());
+#endif
+    return pipe;
+  }
 
-    client_channel_->Init(
-        IPC::ChannelMojo::CreateClientFactory(
-            std::move(legacy_ipc_channel_handle), io_thread_.task_runner(),
-            base::ThreadTaskRunnerHandle::Get()),
-        /*create_pipe_now=*/true);
+  // 进程内布局时 viz 的 CPU 占用包含在 host 中,进程外布局时分别统计
+  void ReportProcessCpu() {
+    const double host_cpu =
+        host_process_metrics_->GetPlatformIndependentCPUUsage();
+    if (viz_process_metrics_) {
+      LOG(INFO) << "ProcessCpu[viz-process]: host=" << host_cpu << "% viz="
+                << viz_process_metrics_->GetPlatformIndependentCPUUsage()
+                << "%";
+    } else {
+      LOG(INFO) << "ProcessCpu[in-process]: host+viz=" << host_cpu << "%";
+    }
   }
 
   void InitVizHost(
       mojo::PendingReceiver<viz::mojom::FrameSinkManager> receiver,
       mojo::PendingRemote<viz::mojom::FrameSinkManagerClient> client) {
+    // TimeToFirstFrame 从这里开始计时，包括 GpuHostImpl 的创建和预加载的
+    // shader 的发送，不包括构造函数中等待的 5 秒
+    viz_host_init_time_ = base::TimeTicks::Now();
     mojo::PendingAssociatedRemote<viz::mojom::VizMain> viz_main_pending_remote;
     server_channel_->GetAssociatedInterfaceSupport()
         ->GetRemoteAssociatedInterface(
@@ -864,24 +1302,32 @@ class GpuService : public viz::GpuHostImpl::Delegate,
     params.main_thread_task_runner = base::ThreadTaskRunnerHandle::Get();
     gpu_host_ = std::make_unique<viz::GpuHostImpl>(
         this, std::move(viz_main_pending_remote), std::move(params));
-    gpu_host_->SetProcessId(base::GetCurrentProcId());
+    gpu_host_->SetProcessId(viz_process_.IsValid() ? viz_process_.Pid()
+                                                    : base::GetCurrentProcId());
+    // 启动之后已经从磁盘读到的 shader 需要先于 Display 的创建到达 GPU
+    preloaded_shaders_ = pending_shaders_.size();
+    for (const auto& shader : pending_shaders_) {
+      gpu_host_->gpu_service()->LoadedShader(shader.client_id, shader.key,
+                                             shader.data);
+    }
+    pending_shaders_.clear();
+
+    compositor_->SetFramePresentedCallback(base::BindRepeating(
+        [](scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+           base::WeakPtr<GpuService> self, base::TimeDelta latency,
+           int64_t dropped) {
+          task_runner->PostTask(
+              FROM_HERE,
+              base::BindOnce(&GpuService::OnRootFramePresented, self));
+        },
+        main_thread_runner_, weak_factory_.GetWeakPtr()));
     gpu_host_->ConnectFrameSinkManager(std::move(receiver), std::move(client));
-    gpu_client_id_ = g_unique_id.GetNext() + 1;
     gpu_host_->EstablishGpuChannel(
         gpu_client_id_, memory_instrumentation::mojom::kServiceTracingProcessId,
         true,
         base::BindOnce(&GpuService::OnEstablishedOnIO, base::Unretained(this)));
   }
 
-  void InitVizMain() {
-    auto gpu_init = std::make_unique<gpu::GpuInit>();
-    gpu_init->InitializeInProcess(base::CommandLine::ForCurrentProcess(),
-                                  GetGpuPreferencesFromCommandLine());
-    viz_main_ = std::make_unique<viz::VizMainImpl>(
-        this, CreateVizMainDependencies(), std::move(gpu_init));
-    viz_main_->gpu_service()->set_start_time(base::Time::Now());
-  }
-
  private:
   void OnEstablishedOnIO(mojo::ScopedMessagePipeHandle channel_handle,
                          const gpu::GPUInfo& gpu_info,
@@ -916,6 +1362,7 @@ class GpuService : public viz::GpuHostImpl::Delegate,
         viz::command_buffer_metrics::ContextType::BROWSER_WORKER);
     compositor_->SetContextProvider(root_context_provider,
                                     child_context_provider);
+    context_provider_time_ = base::TimeTicks::Now();
   }
 
   gpu::GpuMemoryBufferManager* GetGpuMemoryBufferManager() {
@@ -970,71 +1417,6 @@ class GpuService : public viz::GpuHostImpl::Delegate,
         attributes, type);
   }
 
-  viz::VizMainImpl::ExternalDependencies CreateVizMainDependencies() {
-    viz::VizMainImpl::ExternalDependencies deps;
-    deps.create_display_compositor = true;
-    // if (!base::PowerMonitor::IsInitialized()) {
-    //   deps.power_monitor_source =
-    //       std::make_unique<base::PowerMonitorDeviceSource>();
-    // }
-    // if (GetContentClient()->gpu()) {
-    // deps.sync_point_manager =
-    // GetContentClient()->gpu()->GetSyncPointManager();
-    // deps.shared_image_manager =
-    //     GetContentClient()->gpu()->GetSharedImageManager();
-    // deps.viz_compositor_thread_runner = runner_.get();
-    // }
-    // deps.shutdown_event = &shutdown_event_;
-    deps.io_thread_task_runner = io_thread_.task_runner();
-
-    // mojo::PendingRemote<ukm::mojom::UkmRecorderInterface> ukm_recorder;
-    // ChildThread::Get()->BindHostReceiver(
-    //     ukm_recorder.InitWithNewPipeAndPassReceiver());
-    // deps.ukm_recorder =
-    //     std::make_unique<ukm::MojoUkmRecorder>(std::move(ukm_recorder));
-    return deps;
-  }
-
-  const gpu::GpuPreferences GetGpuPreferencesFromCommandLine() {
-    DCHECK(base::CommandLine::InitializedForCurrentProcess());
-    const base::CommandLine* command_line =
-        base::CommandLine::ForCurrentProcess();
-    gpu::GpuPreferences gpu_preferences =
-        gpu::gles2::ParseGpuPreferences(command_line);
-    gpu_preferences.disable_accelerated_video_decode = false;
-    gpu_preferences.disable_accelerated_video_encode = false;
-#if defined(OS_WIN)
-    gpu_preferences.enable_low_latency_dxva = !false;
-    gpu_preferences.enable_zero_copy_dxgi_video = !false;
-    gpu_preferences.enable_nv12_dxgi_video = !false;
-#endif
-    gpu_preferences.disable_software_rasterizer = false;
-    gpu_preferences.log_gpu_control_list_decisions = false;
-    gpu_preferences.gpu_startup_dialog = false;
-    gpu_preferences.disable_gpu_watchdog = false;
-    gpu_preferences.gpu_sandbox_start_early = false;
-
-    gpu_preferences.enable_oop_rasterization = false;
-    gpu_preferences.disable_oop_rasterization = false;
-
-    gpu_preferences.enable_oop_rasterization_ddl = false;
-    gpu_preferences.enforce_vulkan_protected_memory = false;
-    gpu_preferences.disable_vulkan_fallback_to_gl_for_testing = false;
-
-#if defined(OS_MACOSX)
-    gpu_preferences.enable_metal =
-        base::FeatureList::IsEnabled(features::kMetal);
-#endif
-
-    gpu_preferences.enable_gpu_benchmarking_extension = false;
-
-    gpu_preferences.enable_android_surface_control = false;
-
-    // Some of these preferences are set or adjusted in
-    // GpuDataManagerImplPrivate::AppendGpuCommandLine.
-    return gpu_preferences;
-  }
-
 #pragma region viz::GpuHostImpl::Delegate
   // viz::GpuHostImpl::Delegate:
   gpu::GPUInfo GetGPUInfo() const override {
@@ -1108,50 +1490,18 @@ class GpuService : public viz::GpuHostImpl::Delegate,
 #endif
 #pragma endregion
 
-#pragma region viz::VizMainImpl::Delegate
-  // viz::VizMainImpl::Delegate:
-  void OnInitializationFailed() override { DLOG(INFO) << __FUNCTION__; }
-  void OnGpuServiceConnection(viz::GpuServiceImpl* gpu_service) override {
-    DLOG(INFO) << __FUNCTION__;
-  }
-  void PostCompositorThreadCreated(
-      base::SingleThreadTaskRunner* task_runner) override {
-    DLOG(INFO) << __FUNCTION__;
-  }
-  void QuitMainMessageLoop() override { DLOG(INFO) << __FUNCTION__; }
-#pragma endregion
-
 #pragma region IPC::Listener implementation
   // IPC::Listener implementation:
   bool OnMessageReceived(const IPC::Message& msg) override {
     DLOG(INFO) << __FUNCTION__;
     return true;
   }
-  void OnAssociatedInterfaceRequest(
-      const std::string& interface_name,
-      mojo::ScopedInterfaceEndpointHandle handle) override {
-    DLOG(INFO) << __FUNCTION__;
-    if (interface_name == viz::VizMainImpl::Name_) {
-      gpu_main_thread_.task_runner()->PostTask(
-          FROM_HERE,
-          base::BindOnce(
-              [](viz::VizMainImpl* viz_main,
-                 mojo::ScopedInterfaceEndpointHandle handle) {
-                viz_main->BindAssociated(
-                    mojo::PendingAssociatedReceiver<viz::mojom::VizMain>(
-                        std::move(handle)));
-              },
-              viz_main_.get(), base::Passed(std::move(handle))));
-    }
-  }
   void OnChannelConnected(int32_t peer_pid) override {
-    DLOG(INFO) << __FUNCTION__;
+    DLOG(INFO) << __FUNCTION__ << " peer_pid=" << peer_pid;
   }
   void OnChannelError() override { DLOG(INFO) << __FUNCTION__; }
 #pragma endregion
 
-  base::Thread io_thread_;
-  base::Thread gpu_main_thread_;
   scoped_refptr<base::SingleThreadTaskRunner> main_thread_runner_;
   Compositor* compositor_;
 
@@ -1165,11 +1515,35 @@ class GpuService : public viz::GpuHostImpl::Delegate,
   gpu::GPUInfo gpu_info_;
   gpu::GpuFeatureInfo gpu_feature_info_;
 
-  // Gpu
-  std::unique_ptr<IPC::SyncChannel> client_channel_;
-  std::unique_ptr<viz::VizMainImpl> viz_main_;
+  // shader 磁盘缓存
+  struct PendingShader {
+    int32_t client_id;
+    std::string key;
+    std::string data;
+  };
+  std::vector<scoped_refptr<gpu::ShaderDiskCache>> shader_caches_;
+  // GpuHostImpl 创建之前从磁盘读到的 shader
+  std::vector<PendingShader> pending_shaders_;
+  size_t preloaded_shaders_ = 0;
+  size_t preloaded_shader_bytes_ = 0;
+  // 启动时缓存中的 shader 数量，包括 GpuHostImpl 读取并转发的
+  size_t loaded_shaders_ = 0;
+  base::TimeTicks viz_host_init_time_;
+  base::TimeTicks context_provider_time_;
+  base::TimeDelta first_frame_time_;
+  bool first_frame_reported_ = false;
 
-  base::WaitableEvent shutdown_event_;
+  // Gpu
+  // 进程内布局时有效
+  std::unique_ptr<GpuChild> gpu_child_;
+  // --viz-process 时有效
+  base::Process viz_process_;
+  std::unique_ptr<base::ProcessMetrics> viz_process_metrics_;
+  std::unique_ptr<base::ProcessMetrics> host_process_metrics_ =
+      base::ProcessMetrics::CreateCurrentProcessMetrics();
+  base::RepeatingTimer cpu_report_timer_;
+
+  base::WeakPtrFactory<GpuService> weak_factory_{this};
 };
 
 // DemoWindow creates the native window for the demo app. The native window
@@ -1274,6 +1648,48 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
   DISALLOW_COPY_AND_ASSIGN(DemoVizWindow);
 };
 
+// --viz-process 启动的子进程的入口,只运行 GpuChild
+int VizProcessMain() {
+  logging::SetLogPrefix("viz");
+  InitTrace("./trace_demo_viz_gui_gpu_viz.json");
+  StartTrace("viz,gpu,ipc,mojom,skia");
+  base::SingleThreadTaskExecutor main_task_executor(
+      base::MessagePumpType::DEFAULT);
+  base::ThreadPoolInstance::CreateAndStartWithDefaultParams("DemoVizProcess");
+
+  mojo::core::Init();
+  base::Thread mojo_thread("mojo");
+  mojo_thread.StartWithOptions(
+      base::Thread::Options(base::MessagePumpType::IO, 0));
+  auto ipc_support = std::make_unique<mojo::core::ScopedIPCSupport>(
+      mojo_thread.task_runner(),
+      mojo::core::ScopedIPCSupport::ShutdownPolicy::CLEAN);
+
+#if defined(USE_X11)
+  // viz 会在子进程中直接向 host 创建的窗口绘制
+  gfx::InitializeThreadedX11();
+  ui::SetDefaultX11ErrorHandlers();
+#endif
+
+  // 接收 host 发送的 invitation,取出 legacy IPC 通道
+  mojo::IncomingInvitation invitation = mojo::IncomingInvitation::Accept(
+      mojo::PlatformChannel::RecoverPassedEndpointFromCommandLine(
+          *base::CommandLine::ForCurrentProcess()));
+
+  base::RunLoop run_loop;
+  GpuChild gpu_child(invitation.ExtractMessagePipe(kVizChannelName),
+                     run_loop.QuitClosure());
+  LOG(INFO) << "viz process running...";
+  run_loop.Run();
+
+  {
+    base::RunLoop run_loop;
+    FlushTrace(run_loop.QuitClosure());
+    run_loop.Run();
+  }
+  return 0;
+}
+
 }  // namespace demo
 
 int main(int argc, char** argv) {
@@ -1283,6 +1699,10 @@ int main(int argc, char** argv) {
   base::CommandLine::Init(argc, argv);
   // 设置日志格式
   logging::SetLogItems(true, true, true, false);
+  if (base::CommandLine::ForCurrentProcess()->GetSwitchValueASCII(
+          switches::kProcessType) == demo::kVizProcessType) {
+    return demo::VizProcessMain();
+  }
   // 启动 Trace
   demo::InitTrace("./trace_demo_viz_gui_gpu.json");
   demo::StartTrace("viz,gpu,shell,ipc,mojom,skia");
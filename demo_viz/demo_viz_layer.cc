@@ -1,25 +1,52 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cmath>
+#include <limits>
+
 #include "base/at_exit.h"
+#include "base/atomic_sequence_num.h"
+#include "base/atomicops.h"
 #include "base/callback.h"
 #include "base/command_line.h"
+#include "base/containers/flat_map.h"
+#include "base/files/file.h"
 #include "base/files/file_path.h"
+#include "base/files/important_file_writer.h"
 #include "base/i18n/icu_util.h"
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/memory/ptr_util.h"
+#include "base/memory/read_only_shared_memory_region.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/weak_ptr.h"
 #include "base/message_loop/message_loop.h"
 #include "base/message_loop/message_pump_type.h"
+#include "base/metrics/histogram_base.h"
+#include "base/metrics/histogram_samples.h"
+#include "base/metrics/statistics_recorder.h"
+#include "base/optional.h"
 #include "base/path_service.h"
 #include "base/power_monitor/power_monitor.h"
 #include "base/power_monitor/power_monitor_device_source.h"
+#include "base/process/launch.h"
 #include "base/rand_util.h"
 #include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "base/strings/stringprintf.h"
+#include "base/synchronization/lock.h"
 #include "base/synchronization/waitable_event.h"
+#include "base/system/sys_info.h"
+#include "base/task/post_task.h"
 #include "base/task/single_thread_task_executor.h"
 #include "base/task/thread_pool/thread_pool_instance.h"
 #include "base/test/task_environment.h"
 #include "base/test/test_discardable_memory_allocator.h"
 #include "base/test/test_timeouts.h"
 #include "base/threading/thread.h"
+#include "base/threading/sequenced_task_runner_handle.h"
+#include "base/threading/thread_task_runner_handle.h"
+#include "base/timer/timer.h"
 #include "base/trace_event/trace_buffer.h"
 #include "build/build_config.h"
 #include "build/buildflag.h"
@@ -50,7 +77,13 @@
 #include "components/viz/service/main/viz_compositor_thread_runner_impl.h"
 #include "components/viz/service/main/viz_main_impl.h"
 #include "content/public/common/content_switches.h"
+#include "demo/common/latency_recorder.h"
 #include "demo/common/utils.h"
+#include "demo/demo_viz/begin_frame_throttler.h"
+#include "demo/demo_viz/frame_timing_reporter.h"
+#include "demo/demo_viz/shared_bitmap_pool.h"
+#include "demo/demo_viz/y4m_writer.h"
+#include "gpu/GLES2/gl2extchromium.h"
 #include "gpu/command_buffer/client/gles2_interface.h"
 #include "gpu/command_buffer/client/gpu_memory_buffer_manager.h"
 #include "gpu/command_buffer/client/shared_image_interface.h"
@@ -72,9 +105,16 @@
 #include "mojo/public/cpp/bindings/generic_pending_receiver.h"
 #include "mojo/public/cpp/bindings/pending_receiver.h"
 #include "mojo/public/cpp/bindings/pending_remote.h"
+#include "mojo/public/cpp/platform/platform_channel.h"
+#include "mojo/public/cpp/system/invitation.h"
+#include "mojo/public/cpp/system/message_pipe.h"
+#include "mojo/public/cpp/system/platform_handle.h"
+#include "mojo/public/cpp/system/simple_watcher.h"
 #include "services/resource_coordinator/public/mojom/memory_instrumentation/constants.mojom-forward.h"
 #include "services/viz/privileged/mojom/viz_main.mojom.h"
 #include "services/viz/public/cpp/gpu/context_provider_command_buffer.h"
+#include "third_party/libyuv/include/libyuv/convert.h"
+#include "third_party/skia/include/core/SkData.h"
 #include "third_party/skia/include/core/SkImageEncoder.h"
 #include "third_party/skia/include/core/SkStream.h"
 #include "third_party/skia/include/gpu/GrTypes.h"
@@ -128,34 +168,257 @@ bool g_use_gpu = true;
 namespace demo {
 namespace {
 constexpr SkColor colors[] = {SK_ColorRED, SK_ColorGREEN, SK_ColorYELLOW};
+// InkClient 默认只光栅化新增的线段，--ink-full-redraw 恢复为每次都清空画布
+// 并重绘整条路径，用于对比两者的性能
+constexpr char kInkFullRedraw[] = "ink-full-redraw";
+// InkClient 默认把两次 BeginFrame 之间收到的输入合并为一次绘制，
+// --ink-no-coalesce 恢复为每个输入事件单独 PostTask 绘制，用于对比；
+// --ink-predict 根据最近两个输入点的速度预测画面上屏时笔尖的位置
+constexpr char kInkNoCoalesce[] = "ink-no-coalesce";
+constexpr char kInkPredict[] = "ink-predict";
+// --client-benchmark 依次嵌入 1、16、256 个持续绘制的 InkClient，每个阶段
+// 运行 kClientBenchmarkStageDuration 之后输出 BeginFrame 到提交 CF 的延迟
+constexpr char kClientBenchmark[] = "client-benchmark";
+constexpr size_t kClientBenchmarkStages[] = {1, 16, 256};
+constexpr base::TimeDelta kClientBenchmarkStageDuration =
+    base::TimeDelta::FromSeconds(5);
+// benchmark 中的 client 按 16x16 的网格排列
+constexpr int kClientBenchmarkGrid = 16;
+// root client 中 quad 颜色变化的间隔，颜色不变时 root 不需要提交新的 CF
+constexpr base::TimeDelta kRootAnimationInterval =
+    base::TimeDelta::FromSeconds(1);
+// --resize-storm 启动后连续改变窗口大小，输出 Resize 到第一帧正确画面的延迟
+// 以及期间的掉帧数
+constexpr char kResizeStorm[] = "resize-storm";
+constexpr int kResizeStormSteps = 120;
+constexpr base::TimeDelta kResizeStormInterval =
+    base::TimeDelta::FromMilliseconds(16);
+// --surface-tree=<depth>,<fanout> 逐层构建嵌套的 FrameSink 树，每个节点嵌入
+// fanout 个子节点，每层运行 kSurfaceTreeStageDuration 之后输出该层 surface
+// 的首次激活延迟以及 SurfaceAggregator 的耗时
+constexpr char kSurfaceTree[] = "surface-tree";
+constexpr base::TimeDelta kSurfaceTreeStageDuration =
+    base::TimeDelta::FromSeconds(5);
+// 节点数量按指数增长，超过该值之后不再继续构建
+constexpr size_t kSurfaceTreeMaxNodes = 4096;
+// Display::DrawAndSwap 中记录的 SurfaceAggregator::Aggregate 耗时，
+// viz 运行在同一个进程中，可以直接从 StatisticsRecorder 中读取
+constexpr char kAggregateHistogram[] =
+    "Compositing.SurfaceAggregator.AggregateUs";
+// 回读（CopyOutputRequest）相关的命令行参数：
+// --readback-sink=file|shm|none  回读结果的去向，默认保存为 PNG 文件
+// --readback-max-in-flight=<k>   最多同时处理多少个回读请求，超出时跳过该帧
+constexpr char kReadbackSink[] = "readback-sink";
+constexpr char kReadbackMaxInFlight[] = "readback-max-in-flight";
+// --readback-area=x,y,w,h         只回读 render pass 中的一部分
+// --readback-scale=<n>            由 viz 缩小为 1/n 之后再回读，用于生成缩略图
+// --readback-format=rgba|i420     i420 时由 viz 转换为 I420 之后再回读
+// --readback-yuv-file=<path>      i420 的输出文件，.y4m 或 .yuv
+// --readback-compare-cpu          同时回读全分辨率 RGBA 结果并在 CPU 上缩小/
+//                                 转换为 I420，输出两种方式的对比
+constexpr char kReadbackArea[] = "readback-area";
+constexpr char kReadbackScale[] = "readback-scale";
+constexpr char kReadbackFormat[] = "readback-format";
+constexpr char kReadbackYuvFile[] = "readback-yuv-file";
+constexpr char kReadbackCompareCpu[] = "readback-compare-cpu";
+constexpr size_t kDefaultReadbackMaxInFlight = 2;
+// --readback-sink=shm 时自动启动的读取子进程的标记
+constexpr char kReadbackShmReader[] = "readback-shm-reader";
+constexpr char kReadbackShmPipeName[] = "demo_viz_layer_readback";
 // Global atomic to generate child process unique IDs.
 base::AtomicSequenceNumber g_unique_id;
 }  // namespace
 
+// Client 端共享的调度器。
+// 原来每个 client 都有自己的 base::Thread，client 数量多的时候线程数也随之增长，
+// 这里改为固定数量（CPU 核数）的线程，每个 FrameSink 按顺序分配到其中一个
+// 线程的 task runner 上，多个 FrameSink 共享同一个线程。
+// ContextProviderCommandBuffer 需要绑定在固定的线程上，所以没有使用
+// base::ThreadPool 的 SequencedTaskRunner。
+class ClientScheduler {
+ public:
+  ClientScheduler() {
+    const int num_threads = base::SysInfo::NumberOfProcessors();
+    for (int i = 0; i < num_threads; ++i) {
+      auto thread = std::make_unique<base::Thread>("Demo_Client" +
+                                                   base::NumberToString(i));
+      CHECK(thread->Start());
+      threads_.push_back(std::move(thread));
+    }
+  }
+
+  // 为一个 FrameSink 分配 task runner，该 FrameSink 的所有任务都在上面执行
+  scoped_refptr<base::SingleThreadTaskRunner> GetTaskRunnerForFrameSink() {
+    base::AutoLock lock(lock_);
+    scoped_refptr<base::SingleThreadTaskRunner> task_runner =
+        threads_[next_thread_]->task_runner();
+    next_thread_ = (next_thread_ + 1) % threads_.size();
+    return task_runner;
+  }
+
+  size_t num_threads() const { return threads_.size(); }
+
+  // 可以在任意线程中调用
+  void RecordBeginFrameToSubmit(base::TimeDelta latency) {
+    base::AutoLock lock(lock_);
+    begin_frame_to_submit_.Add(latency);
+  }
+
+  // 返回统计结果并清空
+  std::string TakeReport() {
+    base::AutoLock lock(lock_);
+    std::string report = begin_frame_to_submit_.ToString();
+    begin_frame_to_submit_.Reset();
+    return report;
+  }
+
+ private:
+  std::vector<std::unique_ptr<base::Thread>> threads_;
+  base::Lock lock_;
+  size_t next_thread_ = 0;
+  LatencyRecorder begin_frame_to_submit_{"BeginFrameToSubmit"};
+
+  DISALLOW_COPY_AND_ASSIGN(ClientScheduler);
+};
+
+// 统计一个 client 从输入事件到画面上屏的延迟，由 client 持有。
+// 在 client 线程中记录，退出时在主线程中读取报告，所以需要加锁。
+class InputLatencyRecorder {
+ public:
+  InputLatencyRecorder() = default;
+
+  void RecordInputToPresent(base::TimeDelta latency) {
+    base::AutoLock lock(lock_);
+    input_to_present_.Add(latency);
+  }
+
+  // 返回延迟统计及直方图，没有数据时返回空字符串
+  std::string GetReport() {
+    base::AutoLock lock(lock_);
+    if (!input_to_present_.count())
+      return std::string();
+    return input_to_present_.ToString() + "\n" +
+           input_to_present_.ToHistogramString(
+               base::TimeDelta::FromMilliseconds(4), 25);
+  }
+
+ private:
+  base::Lock lock_;
+  LatencyRecorder input_to_present_{"InputToPresent"};
+
+  DISALLOW_COPY_AND_ASSIGN(InputLatencyRecorder);
+};
+
+// 一次输入事件，用于统计从输入到上屏的延迟
+struct PendingInput {
+  // 平台事件的时间戳
+  base::TimeTicks time;
+  // trace 中串联各个阶段的 flow id
+  uint64_t flow_id;
+};
+
+// 合并高频输入事件。
+// 1000Hz 的鼠标每一帧会产生十几个移动事件，如果每个事件都 PostTask 到 client
+// 线程，大量任务会挤占 client 线程，而它们最终都出现在同一帧中。
+// 这里在 UI 线程中只把输入点放入队列，只有队列由空变为非空时才通知 client
+// 线程，client 线程在 OnBeginFrame 中一次取出所有的点进行绘制。
+// 可以在任意线程中调用。
+class InputCoalescer {
+ public:
+  struct Point {
+    gfx::Point location;
+    PendingInput input;
+  };
+
+  // 返回 true 表示队列原来为空，需要通知 client 线程
+  bool Push(const gfx::Point& location, const PendingInput& input) {
+    base::AutoLock lock(lock_);
+    ++events_received_;
+    points_.push_back({location, input});
+    return points_.size() == 1;
+  }
+
+  // 取出所有未处理的点，每次调用计为一次绘制
+  std::vector<Point> TakePoints() {
+    base::AutoLock lock(lock_);
+    std::vector<Point> points;
+    points.swap(points_);
+    if (!points.empty())
+      ++draws_performed_;
+    return points;
+  }
+
+  // 格式: events_received=1000 draws_performed=60 events_per_draw=16.67
+  std::string GetStats() {
+    base::AutoLock lock(lock_);
+    return base::StringPrintf(
+        "events_received=%" PRId64 " draws_performed=%" PRId64
+        " events_per_draw=%.2f",
+        events_received_, draws_performed_,
+        draws_performed_ ? static_cast<double>(events_received_) /
+                               draws_performed_
+                         : 0.0);
+  }
+
+  int64_t draws_performed() {
+    base::AutoLock lock(lock_);
+    return draws_performed_;
+  }
+
+ private:
+  base::Lock lock_;
+  std::vector<Point> points_;
+  int64_t events_received_ = 0;
+  int64_t draws_performed_ = 0;
+};
+
 class InkClient : public viz::mojom::CompositorFrameSinkClient,
                   public ui::PlatformEventObserver {
  public:
-  InkClient(const viz::FrameSinkId& frame_sink_id,
+  // animate 为 true 时不响应鼠标事件，每一帧都自动绘制一段线段，用于 benchmark
+  InkClient(ClientScheduler* scheduler,
+            const viz::FrameSinkId& frame_sink_id,
             const viz::LocalSurfaceIdAllocation& local_surface_id,
-            const gfx::Rect& bounds)
+            const gfx::Rect& bounds,
+            bool animate)
       : frame_sink_id_(frame_sink_id),
         local_surface_id_(local_surface_id),
         bounds_(bounds),
-        thread_("Demo_" + frame_sink_id.ToString()) {
-    CHECK(thread_.Start());
+        scheduler_(scheduler),
+        task_runner_(scheduler->GetTaskRunnerForFrameSink()),
+        incremental_(!base::CommandLine::ForCurrentProcess()->HasSwitch(
+            kInkFullRedraw)),
+        coalesce_(!base::CommandLine::ForCurrentProcess()->HasSwitch(
+            kInkNoCoalesce)),
+        predict_(base::CommandLine::ForCurrentProcess()->HasSwitch(
+            kInkPredict)),
+        animate_(animate),
+        begin_frame_throttler_("InkClient " + frame_sink_id.ToString()) {}
+  // 在主线程中析构。资源、mojo 连接以及 SharedImage 都只能在 client 线程中
+  // 访问，ClientScheduler 的线程此时还在运行，所以在 client 线程中完成清理
+  // 并等待它结束
+  ~InkClient() override {
+    if (!animate_)
+      ui::PlatformEventSource::GetInstance()->RemovePlatformEventObserver(this);
+    base::WaitableEvent event;
+    task_runner_->PostTask(FROM_HERE,
+                           base::BindOnce(&InkClient::ShutdownOnClientThread,
+                                          base::Unretained(this), &event));
+    event.Wait();
   }
-  ~InkClient() override {}
   void Bind(
       mojo::PendingReceiver<viz::mojom::CompositorFrameSinkClient> receiver,
       mojo::PendingRemote<viz::mojom::CompositorFrameSink> remote) {
-    if (thread_.task_runner()->BelongsToCurrentThread()) {
+    if (task_runner_->BelongsToCurrentThread()) {
       receiver_.Bind(std::move(receiver));
       frame_sink_remote_.Bind(std::move(remote));
 
-      // 告诉 CompositorFrameSink 可以开始请求 CompositorFrame 了
-      frame_sink_remote_->SetNeedsBeginFrame(true);
+      // 内容不变时停止接收 BeginFrame
+      begin_frame_throttler_.Bind(frame_sink_remote_.get());
       client_resource_provider_ =
           std::make_unique<viz::ClientResourceProvider>(false);
+      shared_bitmap_pool_ = std::make_unique<SharedBitmapPool>(
+          frame_sink_remote_.get(), client_resource_provider_.get());
 
       // 创建要渲染的内容到 SkBitmap 中
       bitmap_ = std::make_unique<SkBitmap>();
@@ -167,10 +430,20 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
       paint_.setColor(SK_ColorRED);
       paint_.setStyle(SkPaint::kStroke_Style);
       paint_.setStrokeWidth(5);
+      if (incremental_) {
+        // 每条线段单独绘制，使用圆头避免线段连接处出现缺口
+        paint_.setStrokeCap(SkPaint::kRound_Cap);
+      }
+      prediction_paint_ = paint_;
+      prediction_paint_.setStrokeCap(SkPaint::kRound_Cap);
+      prediction_paint_.setAlpha(0x80);
+      // 第一帧需要提交整个画面
+      frame_damage_ = gfx::Rect(bounds_.size());
       need_redraw_ = true;
     } else {
-      ui::PlatformEventSource::GetInstance()->AddPlatformEventObserver(this);
-      thread_.task_runner()->PostTask(
+      if (!animate_)
+        ui::PlatformEventSource::GetInstance()->AddPlatformEventObserver(this);
+      task_runner_->PostTask(
           FROM_HERE, base::BindOnce(&InkClient::Bind, base::Unretained(this),
                                     std::move(receiver), std::move(remote)));
     }
@@ -178,19 +451,90 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
 
   void SetContextProvider(
       scoped_refptr<viz::ContextProvider> context_provider) {
-    if (thread_.task_runner()->BelongsToCurrentThread()) {
+    if (task_runner_->BelongsToCurrentThread()) {
       LOG(INFO) << "SetContextProvider";
       context_provider_ = context_provider;
       DCHECK(context_provider->BindToCurrentThread() ==
              gpu::ContextResult::kSuccess);
     } else {
-      thread_.task_runner()->PostTask(
+      task_runner_->PostTask(
           FROM_HERE, base::BindOnce(&InkClient::SetContextProvider,
                                     base::Unretained(this), context_provider));
     }
   }
 
+  viz::FrameSinkId frame_sink_id() const { return frame_sink_id_; }
+
+  // 可以在任意线程中调用
+  std::string GetInputLatencyReport() {
+    return input_latency_recorder_.GetReport();
+  }
+
+  // 使用 parent 新分配的 LocalSurfaceId 提交新大小的 CF，
+  // 已经画好的内容会保留在新 bitmap 的左上角
+  void Resize(const viz::LocalSurfaceIdAllocation& local_surface_id,
+              const gfx::Rect& bounds) {
+    if (!task_runner_->BelongsToCurrentThread()) {
+      task_runner_->PostTask(
+          FROM_HERE, base::BindOnce(&InkClient::Resize, base::Unretained(this),
+                                    local_surface_id, bounds));
+      return;
+    }
+    TRACE_EVENT1("viz", "InkClient::Resize", "bounds", bounds.ToString());
+    local_surface_id_ = local_surface_id;
+    if (bounds.size() != bounds_.size()) {
+      // 预测的线段不能被拷贝到新的 bitmap 中
+      RestorePrediction();
+      auto bitmap = std::make_unique<SkBitmap>();
+      bitmap->allocPixels(bitmap_->info().makeWH(bounds.width(),
+                                                 bounds.height()));
+      bitmap->eraseColor(SK_ColorWHITE);
+      bitmap->writePixels(bitmap_->pixmap(), 0, 0);
+      bitmap_ = std::move(bitmap);
+      canvas_ = std::make_unique<SkCanvas>(*bitmap_);
+      // 大小不同的 SharedImage 不能再使用，空闲的直接销毁，
+      // 使用中的在 viz 归还时销毁
+      for (auto it = shared_images_.begin(); it != shared_images_.end();) {
+        if (!it->in_use) {
+          context_provider_->SharedImageInterface()->DestroySharedImage(
+              it->sync_token, it->mailbox);
+          it = shared_images_.erase(it);
+        } else {
+          ++it;
+        }
+      }
+    }
+    bounds_ = bounds;
+    frame_damage_ = gfx::Rect(bounds_.size());
+    need_redraw_ = true;
+    begin_frame_throttler_.Invalidate();
+  }
+
  private:
+  void ShutdownOnClientThread(base::WaitableEvent* event) {
+    DCHECK(task_runner_->BelongsToCurrentThread());
+    begin_frame_throttler_.Unbind();
+    // 之后不会再收到 OnBeginFrame 以及资源的归还
+    receiver_.reset();
+    // viz 还没有归还的 SharedImage 会以 is_lost 回调 OnSharedImageReleased，
+    // 在其中被销毁，剩下的都是 ring 中空闲的 SharedImage
+    if (client_resource_provider_)
+      client_resource_provider_->ShutdownAndReleaseAllResources();
+    if (context_provider_) {
+      gpu::SharedImageInterface* sii =
+          context_provider_->SharedImageInterface();
+      for (const auto& slot : shared_images_)
+        sii->DestroySharedImage(slot.sync_token, slot.mailbox);
+      shared_images_.clear();
+    }
+    // pool 需要通过 frame_sink_remote_ 删除共享内存
+    shared_bitmap_pool_.reset();
+    client_resource_provider_.reset();
+    frame_sink_remote_.reset();
+    context_provider_ = nullptr;
+    event->Signal();
+  }
+
   // This is called before the dispatcher receives the event.
   void WillProcessEvent(const ui::PlatformEvent& event) override {}
 
@@ -204,21 +548,154 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
       located_event = std::make_unique<ui::TouchEvent>(event);
     }
     if (located_event) {
-      thread_.task_runner()->PostTask(
-          FROM_HERE, base::BindOnce(&InkClient::Draw, base::Unretained(this),
-                                    located_event->location()));
+      // 使用 flow id 把输入事件和显示它的帧在 trace 中串联起来：
+      // DidProcessEvent -> Draw -> CreateFrame -> SubmitCompositorFrame
+      // -> Presented
+      static base::AtomicSequenceNumber input_sequence;
+      const uint64_t flow_id = input_sequence.GetNext() + 1;
+      TRACE_EVENT_WITH_FLOW0("viz", "InkClient::DidProcessEvent",
+                             TRACE_ID_LOCAL(flow_id),
+                             TRACE_EVENT_FLAG_FLOW_OUT);
+      PendingInput input{located_event->time_stamp(), flow_id};
+      if (!coalesce_) {
+        task_runner_->PostTask(
+            FROM_HERE, base::BindOnce(&InkClient::Draw, base::Unretained(this),
+                                      located_event->location(), input));
+        return;
+      }
+      if (input_coalescer_.Push(located_event->location(), input)) {
+        task_runner_->PostTask(FROM_HERE,
+                               base::BindOnce(&InkClient::OnInputAvailable,
+                                              base::Unretained(this)));
+      }
     }
   }
 
-  void Draw(const gfx::Point location) {
+  // 只需要请求 BeginFrame，输入点在 OnBeginFrame 中统一绘制
+  void OnInputAvailable() {
+    need_redraw_ = true;
+    begin_frame_throttler_.Invalidate();
+  }
+
+  // 绘制两次 BeginFrame 之间合并的所有输入点
+  void DrawCoalescedInput(const viz::BeginFrameArgs& args) {
+    std::vector<InputCoalescer::Point> points = input_coalescer_.TakePoints();
+    if (points.empty())
+      return;
+    TRACE_EVENT1("viz", "InkClient::DrawCoalescedInput", "points",
+                 points.size());
+    for (const auto& point : points) {
+      TRACE_EVENT_WITH_FLOW0(
+          "viz", "InkClient::Draw", TRACE_ID_LOCAL(point.input.flow_id),
+          TRACE_EVENT_FLAG_FLOW_IN | TRACE_EVENT_FLAG_FLOW_OUT);
+      DrawSegment(point.location);
+      pending_inputs_.push_back(point.input);
+      previous_input_ = last_input_;
+      last_input_ = point;
+    }
+    if (predict_ && previous_input_) {
+      // 预测到本帧大约上屏的时间（下一个 vsync）
+      const base::TimeDelta elapsed =
+          last_input_->input.time - previous_input_->input.time;
+      const base::TimeDelta horizon = std::min(
+          args.frame_time + args.interval - last_input_->input.time,
+          args.interval * 2);
+      if (elapsed > base::TimeDelta() && horizon > base::TimeDelta()) {
+        const double ratio =
+            horizon.InMicrosecondsF() / elapsed.InMicrosecondsF();
+        gfx::Vector2d delta =
+            last_input_->location - previous_input_->location;
+        gfx::Point predicted =
+            last_input_->location +
+            gfx::Vector2d(std::lround(delta.x() * ratio),
+                          std::lround(delta.y() * ratio));
+        DrawPrediction(last_input_->location, predicted);
+      }
+    }
+    const int64_t draws = input_coalescer_.draws_performed();
+    TRACE_COUNTER1("viz", "ink_coalesced_points", points.size());
+    if (draws % 300 == 0)
+      LOG(INFO) << "InputCoalescer: " << input_coalescer_.GetStats();
+  }
+
+  // 预测的线段只在本帧显示，画之前保存被覆盖的像素，下一个 BeginFrame
+  // 开始时恢复（即使没有新的输入），否则预测的线段会一直留在画面上
+  void DrawPrediction(const gfx::Point& from, const gfx::Point& to) {
+    gfx::Rect dirty_rect = GetSegmentDirtyRect(from, to);
+    if (dirty_rect.IsEmpty())
+      return;
+    TRACE_EVENT0("viz", "InkClient::DrawPrediction");
+    prediction_backup_.allocPixels(
+        bitmap_->info().makeWH(dirty_rect.width(), dirty_rect.height()));
+    bitmap_->readPixels(prediction_backup_.pixmap(), dirty_rect.x(),
+                        dirty_rect.y());
+    prediction_rect_ = dirty_rect;
+    AddDamage(dirty_rect);
+    canvas_->drawLine(from.x(), from.y(), to.x(), to.y(), prediction_paint_);
+  }
+
+  // 返回是否恢复了像素，恢复之后需要提交新的 CF
+  bool RestorePrediction() {
+    if (prediction_rect_.IsEmpty())
+      return false;
+    bitmap_->writePixels(prediction_backup_.pixmap(), prediction_rect_.x(),
+                         prediction_rect_.y());
+    AddDamage(prediction_rect_);
+    prediction_rect_ = gfx::Rect();
+    return true;
+  }
+
+  void Draw(const gfx::Point location, const PendingInput& input) {
+    TRACE_EVENT_WITH_FLOW0("viz", "InkClient::Draw",
+                           TRACE_ID_LOCAL(input.flow_id),
+                           TRACE_EVENT_FLAG_FLOW_IN | TRACE_EVENT_FLAG_FLOW_OUT);
+    DrawSegment(location);
+    pending_inputs_.push_back(input);
+    need_redraw_ = true;
+    begin_frame_throttler_.Invalidate();
+  }
+
+  // 线段的包围盒加上笔触的范围，限制在 bitmap 范围内。
+  // 和 demo_skia 的 SkiaCanvas::DrawNewPoints 一样，miter join 最多超出线段
+  // miter * strokeWidth / 2，圆头只超出 strokeWidth / 2，多留 1 个像素用于取整
+  gfx::Rect GetSegmentDirtyRect(const gfx::Point& from, const gfx::Point& to) {
+    gfx::Rect dirty_rect = gfx::BoundingRect(from, to);
+    const SkScalar half_width = paint_.getStrokeWidth() / 2;
+    const int stroke_outset =
+        std::ceil(std::max(paint_.getStrokeMiter() * half_width, half_width)) +
+        1;
+    dirty_rect.Inset(-stroke_outset, -stroke_outset);
+    dirty_rect.Intersect(gfx::Rect(bounds_.size()));
+    return dirty_rect;
+  }
+
+  void AddDamage(const gfx::Rect& dirty_rect) {
+    for (auto& shared_image : shared_images_)
+      shared_image.damage.Union(dirty_rect);
+    frame_damage_.Union(dirty_rect);
+  }
+
+  // 把到 location 的线段画到 bitmap 上并记录脏区域
+  void DrawSegment(const gfx::Point& location) {
     TRACE_EVENT1("viz", "LayerTreeFrameSink::Draw", "points_count",
                  path_.countPoints());
     TRACE_COUNTER1("viz", "points_count", path_.countPoints());
-    canvas_->clear(SK_ColorWHITE);
+    // 无论哪种模式都只有新增线段（以及与上一段的连接处）的像素会发生变化，
+    // 所以脏区域是新线段的包围盒加上笔触宽度
+    SkPoint last_point;
+    path_.getLastPt(&last_point);
+    AddDamage(GetSegmentDirtyRect(
+        gfx::Point(last_point.x(), last_point.y()), location));
+
     path_.lineTo(location.x(), location.y());
-    canvas_->drawPath(path_, paint_);
-    need_redraw_ = true;
-    frame_sink_remote_->SetNeedsBeginFrame(true);
+    if (incremental_) {
+      // 只把新线段画到持久的 bitmap 上，耗时与路径长度无关
+      canvas_->drawLine(last_point.x(), last_point.y(), location.x(),
+                        location.y(), paint_);
+    } else {
+      canvas_->clear(SK_ColorWHITE);
+      canvas_->drawPath(path_, paint_);
+    }
   }
 
   viz::CompositorFrame CreateFrame(const ::viz::BeginFrameArgs& args) {
@@ -233,15 +710,34 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
         local_surface_id_.allocation_time();
     frame.metadata.frame_token = ++frame_token_generator_;
     frame.metadata.send_frame_token_to_embedder = true;
+    // 本帧包含了上次提交之后的所有输入，等收到该 frame_token 的
+    // presentation feedback 之后再统计延迟
+    for (const auto& input : pending_inputs_) {
+      TRACE_EVENT_WITH_FLOW1(
+          "viz", "InkClient::CreateFrame", TRACE_ID_LOCAL(input.flow_id),
+          TRACE_EVENT_FLAG_FLOW_IN | TRACE_EVENT_FLAG_FLOW_OUT, "frame_token",
+          frame.metadata.frame_token);
+    }
+    if (!pending_inputs_.empty()) {
+      inputs_by_frame_token_[frame.metadata.frame_token] =
+          std::move(pending_inputs_);
+      pending_inputs_.clear();
+    }
 
     const int kRenderPassId = 1;
     const gfx::Rect& output_rect = bounds_;
-    const gfx::Rect& damage_rect = output_rect;
+    // 只有 Draw() 修改过的区域需要 viz 重新合成
+    gfx::Rect damage_rect = frame_damage_ + bounds_.OffsetFromOrigin();
+    damage_rect.Intersect(output_rect);
+    frame_damage_ = gfx::Rect();
     std::unique_ptr<viz::RenderPass> render_pass = viz::RenderPass::Create();
     render_pass->SetNew(kRenderPassId, output_rect, damage_rect,
                         gfx::Transform());
 
-    AppendTextureDrawQuad(frame, render_pass.get());
+    // benchmark 中新增的 client 没有 ContextProvider，硬件合成模式下
+    // 不能使用共享内存资源，只绘制纯色
+    if (context_provider_ || !g_use_gpu)
+      AppendTextureDrawQuad(frame, render_pass.get());
     AppendSolidColorDrawQuad(frame, render_pass.get());
 
     frame.render_pass_list.push_back(std::move(render_pass));
@@ -321,70 +817,135 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
     return CreateSoftwareResource(size, source);
   }
 
-  // 使用共享内存来传递资源到 viz
+  // 使用共享内存来传递资源到 viz，共享内存由 SharedBitmapPool 复用，
+  // 只有池中没有可用的共享内存时才会分配并通过 DidAllocateSharedBitmap 注册。
+  // 把资源存入 ClientResourceProvider 进行统一管理。
+  // 后续会使用 ClientResourceProvider::PrepareSendToParent
+  // 将已经存入的资源添加 到 CF 中。
   viz::ResourceId CreateSoftwareResource(const gfx::Size& size,
                                          const SkBitmap& source) {
     TRACE_EVENT0("viz", "LayerTreeFrameSink::CreateSoftwareResource");
-    viz::SharedBitmapId shared_bitmap_id = viz::SharedBitmap::GenerateId();
-    // 创建共享内存
-    base::MappedReadOnlyRegion shm =
-        viz::bitmap_allocation::AllocateSharedBitmap(size, viz::RGBA_8888);
-    base::WritableSharedMemoryMapping mapping = std::move(shm.mapping);
-
-    SkImageInfo info = SkImageInfo::MakeN32Premul(size.width(), size.height());
-    // 将 SkBitmap 中的像素数据拷贝到共享内存
-    source.readPixels(info, mapping.memory(), info.minRowBytes(), 0, 0);
-
-    // 将共享内存及与之对应的资源Id发送到 viz service 端
-    frame_sink_remote_->DidAllocateSharedBitmap(std::move(shm.region),
-                                                shared_bitmap_id);
-
-    // 把资源存入 ClientResourceProvider 进行统一管理。
-    // 后续会使用 ClientResourceProvider::PrepareSendToParent
-    // 将已经存入的资源添加 到 CF 中。
-    return client_resource_provider_->ImportResource(
-        viz::TransferableResource::MakeSoftware(shared_bitmap_id, size,
-                                                viz::RGBA_8888),
-        viz::SingleReleaseCallback::Create(base::DoNothing()));
-  }
+    return shared_bitmap_pool_->ImportBitmap(size, source);
+  }
+  // 每个 client 保留一个 SharedImage 的 ring，viz 归还之后重复使用，
+  // 只把 Draw() 修改过的区域上传到 SharedImage，不再每一帧创建和销毁 SharedImage
+  struct SharedImageSlot {
+    gpu::Mailbox mailbox;
+    // 创建 SharedImage 或者 viz 归还资源时的 SyncToken，更新之前需要等待
+    gpu::SyncToken sync_token;
+    // 上次上传之后 Draw() 修改过的区域
+    gfx::Rect damage;
+    gfx::Size size;
+    bool in_use = false;
+  };
+  static constexpr size_t kSharedImageRingSize = 3;
+
   viz::ResourceId CreateGpuResource(const gfx::Size& size,
                                     const SkBitmap& source) {
     TRACE_EVENT0("viz", "LayerTreeFrameSink::CreateGpuResource");
     DCHECK(context_provider_);
-    gpu::SharedImageInterface* sii = context_provider_->SharedImageInterface();
-    DCHECK(sii);
-
-    auto pixels =
-        base::make_span(static_cast<const uint8_t*>(source.getPixels()),
-                        source.computeByteSize());
     auto format = viz::RGBA_8888;
     auto color_space = gfx::ColorSpace();
-    gpu::Mailbox mailbox = sii->CreateSharedImage(
-        format, size, color_space, gpu::SHARED_IMAGE_USAGE_DISPLAY, pixels);
-    gpu::SyncToken sync_token = sii->GenVerifiedSyncToken();
+
+    size_t index = 0;
+    while (index < shared_images_.size() &&
+           (shared_images_[index].in_use || shared_images_[index].size != size))
+      ++index;
+    if (index == shared_images_.size()) {
+      // ring 中的 SharedImage 都还在 viz 中使用，创建一个新的
+      if (shared_images_.size() >= kSharedImageRingSize) {
+        LOG(WARNING) << "InkClient: all " << shared_images_.size()
+                     << " shared images are in use, growing the ring";
+      }
+      shared_images_.push_back(CreateSharedImageSlot(size, source));
+    } else {
+      UpdateSharedImage(&shared_images_[index], source);
+    }
+    SharedImageSlot& slot = shared_images_[index];
+    slot.in_use = true;
 
     viz::TransferableResource gl_resource = viz::TransferableResource::MakeGL(
-        mailbox, GL_LINEAR, GL_TEXTURE_2D, sync_token, size,
+        slot.mailbox, GL_LINEAR, GL_TEXTURE_2D, slot.sync_token, size,
         false /* is_overlay_candidate */);
     gl_resource.format = format;
     gl_resource.color_space = std::move(color_space);
     auto release_callback = viz::SingleReleaseCallback::Create(
-        base::BindOnce(&InkClient::DeleteSharedImage, base::Unretained(this),
-                       context_provider_, mailbox));
+        base::BindOnce(&InkClient::OnSharedImageReleased,
+                       base::Unretained(this), slot.mailbox));
 
     return client_resource_provider_->ImportResource(
         gl_resource, std::move(release_callback));
   }
 
-  void DeleteSharedImage(scoped_refptr<viz::ContextProvider> context_provider,
-                         gpu::Mailbox mailbox,
-                         const gpu::SyncToken& sync_token,
-                         bool is_lost) {
-    TRACE_EVENT0("viz", "LayerTreeFrameSink::DeleteSharedImage");
-    DCHECK(context_provider);
-    gpu::SharedImageInterface* sii = context_provider->SharedImageInterface();
+  SharedImageSlot CreateSharedImageSlot(const gfx::Size& size,
+                                        const SkBitmap& source) {
+    TRACE_EVENT0("viz", "InkClient::CreateSharedImageSlot");
+    gpu::SharedImageInterface* sii = context_provider_->SharedImageInterface();
     DCHECK(sii);
-    sii->DestroySharedImage(sync_token, mailbox);
+    auto pixels =
+        base::make_span(static_cast<const uint8_t*>(source.getPixels()),
+                        source.computeByteSize());
+    // 需要通过 GLES2 接口更新内容，所以要加上 SHARED_IMAGE_USAGE_GLES2
+    SharedImageSlot slot;
+    slot.mailbox = sii->CreateSharedImage(
+        viz::RGBA_8888, size, gfx::ColorSpace(),
+        gpu::SHARED_IMAGE_USAGE_DISPLAY | gpu::SHARED_IMAGE_USAGE_GLES2,
+        pixels);
+    slot.sync_token = sii->GenVerifiedSyncToken();
+    slot.size = size;
+    return slot;
+  }
+
+  // 只把 slot 过期的区域通过 TexSubImage2D 上传到已有的 SharedImage
+  void UpdateSharedImage(SharedImageSlot* slot, const SkBitmap& source) {
+    TRACE_EVENT1("viz", "InkClient::UpdateSharedImage", "damage",
+                 slot->damage.ToString());
+    if (slot->damage.IsEmpty())
+      return;
+    const gfx::Rect& damage = slot->damage;
+    // GLES2 的 TexSubImage2D 不支持 UNPACK_ROW_LENGTH，先把脏区域拷贝成连续内存
+    SkImageInfo info = SkImageInfo::Make(damage.width(), damage.height(),
+                                         kRGBA_8888_SkColorType,
+                                         kPremul_SkAlphaType);
+    std::vector<uint8_t> pixels(info.computeMinByteSize());
+    source.readPixels(info, pixels.data(), info.minRowBytes(), damage.x(),
+                      damage.y());
+
+    gpu::gles2::GLES2Interface* gl = context_provider_->ContextGL();
+    gl->WaitSyncTokenCHROMIUM(slot->sync_token.GetConstData());
+    GLuint texture =
+        gl->CreateAndTexStorage2DSharedImageCHROMIUM(slot->mailbox.name);
+    gl->BeginSharedImageAccessDirectCHROMIUM(
+        texture, GL_SHARED_IMAGE_ACCESS_MODE_READWRITE_CHROMIUM);
+    gl->BindTexture(GL_TEXTURE_2D, texture);
+    gl->TexSubImage2D(GL_TEXTURE_2D, 0, damage.x(), damage.y(), damage.width(),
+                      damage.height(), GL_RGBA, GL_UNSIGNED_BYTE,
+                      pixels.data());
+    gl->EndSharedImageAccessDirectCHROMIUM(texture);
+    gl->DeleteTextures(1, &texture);
+    gl->GenSyncTokenCHROMIUM(slot->sync_token.GetData());
+    slot->damage = gfx::Rect();
+  }
+
+  void OnSharedImageReleased(const gpu::Mailbox& mailbox,
+                             const gpu::SyncToken& sync_token,
+                             bool is_lost) {
+    TRACE_EVENT0("viz", "InkClient::OnSharedImageReleased");
+    auto it = std::find_if(shared_images_.begin(), shared_images_.end(),
+                           [&mailbox](const SharedImageSlot& slot) {
+                             return slot.mailbox == mailbox;
+                           });
+    DCHECK(it != shared_images_.end());
+    if (is_lost || shared_images_.size() > kSharedImageRingSize ||
+        it->size != bounds_.size()) {
+      // 丢失的、超出 ring 大小的或者 Resize 之前创建的 SharedImage 直接销毁
+      context_provider_->SharedImageInterface()->DestroySharedImage(
+          sync_token, mailbox);
+      shared_images_.erase(it);
+      return;
+    }
+    it->sync_token = sync_token;
+    it->in_use = false;
   }
 
   void OnBeginFrame(
@@ -392,16 +953,70 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
       const base::flat_map<uint32_t, ::viz::FrameTimingDetails>& details)
       override {
     TRACE_EVENT0("viz", "LayerTreeFrameSink::OnBeginFrame");
+    begin_frame_throttler_.WillHandleBeginFrame(args);
+    for (const auto& detail : details)
+      OnFramePresented(detail.first, detail.second);
+    if (RestorePrediction())
+      need_redraw_ = true;
+    if (coalesce_)
+      DrawCoalescedInput(args);
+    if (animate_) {
+      // 在 bounds 内来回画折线
+      const int step = *frame_token_generator_;
+      DrawSegment(gfx::Point(step * 7 % bounds_.width(),
+                             step * 13 % bounds_.height()));
+      need_redraw_ = true;
+    }
     if (need_redraw_) {
+      viz::CompositorFrame frame = CreateFrame(args);
+      auto it = inputs_by_frame_token_.find(frame.metadata.frame_token);
+      if (it != inputs_by_frame_token_.end()) {
+        for (const auto& input : it->second) {
+          TRACE_EVENT_WITH_FLOW0(
+              "viz", "InkClient::SubmitCompositorFrame",
+              TRACE_ID_LOCAL(input.flow_id),
+              TRACE_EVENT_FLAG_FLOW_IN | TRACE_EVENT_FLAG_FLOW_OUT);
+        }
+      }
       frame_sink_remote_->SubmitCompositorFrame(
-          local_surface_id_.local_surface_id(), CreateFrame(args),
+          local_surface_id_.local_surface_id(), std::move(frame),
           base::Optional<viz::HitTestRegionList>(),
           /*trace_time=*/0);
+      // frame_time 是 viz 发出 BeginFrame 的时间，共享线程繁忙时这个延迟会增加
+      scheduler_->RecordBeginFrameToSubmit(base::TimeTicks::Now() -
+                                           args.frame_time);
     } else {
       frame_sink_remote_->DidNotProduceFrame(viz::BeginFrameAck(args, false));
     }
+    // 连续几帧没有新内容之后停止接收 BeginFrame，直到下一次 Invalidate()，
+    // 还有输入等待上屏时继续接收，否则 OnBeginFrame 收不到对应的 timing details
+    begin_frame_throttler_.DidHandleBeginFrame(
+        need_redraw_, /*keep_alive=*/!inputs_by_frame_token_.empty());
     need_redraw_ = false;
-    // frame_sink_remote_->SetNeedsBeginFrame(false);
+  }
+
+  // 输入事件的延迟为事件的时间戳到包含它的帧上屏的时间。
+  // 被后面的帧取代而没有单独上屏的帧收不到 feedback，它们的输入随这一帧
+  // 一起上屏，所以 frame_token 不大于当前帧的记录都在这里统计并删除，
+  // 否则残留的记录会让 keep_alive 一直保持 BeginFrame
+  void OnFramePresented(uint32_t frame_token,
+                        const viz::FrameTimingDetails& details) {
+    auto end = inputs_by_frame_token_.upper_bound(frame_token);
+    if (end == inputs_by_frame_token_.begin())
+      return;
+    const gfx::PresentationFeedback& feedback = details.presentation_feedback;
+    for (auto it = inputs_by_frame_token_.begin(); it != end; ++it) {
+      for (const auto& input : it->second) {
+        TRACE_EVENT_WITH_FLOW2("viz", "InkClient::Presented",
+                               TRACE_ID_LOCAL(input.flow_id),
+                               TRACE_EVENT_FLAG_FLOW_IN, "frame_token",
+                               it->first, "failed", feedback.failed());
+        if (!feedback.failed())
+          input_latency_recorder_.RecordInputToPresent(feedback.timestamp -
+                                                       input.time);
+      }
+    }
+    inputs_by_frame_token_.erase(inputs_by_frame_token_.begin(), end);
   }
 
   void DidReceiveCompositorFrameAck(
@@ -433,8 +1048,10 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
   viz::FrameSinkId frame_sink_id_;
   viz::LocalSurfaceIdAllocation local_surface_id_;
   gfx::Rect bounds_;
-  // 模拟每个 Client 都在独立的线程中生成 CF
-  base::Thread thread_;
+  ClientScheduler* const scheduler_;
+  // 模拟每个 Client 都在独立的线程中生成 CF，多个 Client 共享 ClientScheduler
+  // 中的线程
+  scoped_refptr<base::SingleThreadTaskRunner> task_runner_;
 
   mojo::Receiver<viz::mojom::CompositorFrameSinkClient> receiver_{this};
   mojo::Remote<viz::mojom::CompositorFrameSink> frame_sink_remote_;
@@ -446,26 +1063,707 @@ class InkClient : public viz::mojom::CompositorFrameSinkClient,
   SkPath path_;
   SkPaint paint_;
   bool need_redraw_;
+  const bool incremental_;
+  const bool coalesce_;
+  const bool predict_;
+  const bool animate_;
+  InputCoalescer input_coalescer_;
+  // 最近两个真实的输入点，用于预测
+  base::Optional<InputCoalescer::Point> last_input_;
+  base::Optional<InputCoalescer::Point> previous_input_;
+  SkPaint prediction_paint_;
+  // 预测线段覆盖的区域及其原来的像素
+  gfx::Rect prediction_rect_;
+  SkBitmap prediction_backup_;
+  // 上次提交 CF 之后 Draw() 修改过的区域，位于 bitmap 坐标系
+  gfx::Rect frame_damage_;
+  std::vector<SharedImageSlot> shared_images_;
+  // 还没有提交的输入事件
+  std::vector<PendingInput> pending_inputs_;
+  // 已经提交、等待 presentation feedback 的输入事件
+  base::flat_map<uint32_t, std::vector<PendingInput>> inputs_by_frame_token_;
+  BeginFrameThrottler begin_frame_throttler_;
+  InputLatencyRecorder input_latency_recorder_;
 
   std::unique_ptr<viz::ClientResourceProvider> client_resource_provider_;
+  std::unique_ptr<SharedBitmapPool> shared_bitmap_pool_;
+};
+
+// 共享内存回读的消息格式，sink 和读取子进程之间通过一条 mojo message pipe
+// 传递。kRegion 消息会附带一个只读的 SharedBuffer handle。
+struct ReadbackShmMessage {
+  enum Type : uint32_t {
+    // 新分配的 region，之前的 region 不会再写入
+    kRegion,
+    // region 中已经写入了 frame_index 对应的帧
+    kFrame,
+  };
+  Type type;
+  int64_t frame_index;
+};
+
+// 把回读结果写入共享内存，并启动一个读取子进程，通过 message pipe 把只读的
+// region 以及每一帧的通知发送给它。
+// 共享内存的开头是 Header，sequence 为奇数时表示正在写入（seqlock）。
+// 析构时关闭 pipe，读取子进程随之退出。
+class SharedMemoryReadbackSink
+    : public base::RefCountedThreadSafe<SharedMemoryReadbackSink> {
+ public:
+  struct Header {
+    base::subtle::Atomic32 sequence;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+  };
+
+  SharedMemoryReadbackSink() {
+    mojo::PlatformChannel channel;
+    mojo::OutgoingInvitation invitation;
+    pipe_ = invitation.AttachMessagePipe(kReadbackShmPipeName);
+
+    base::LaunchOptions options;
+    base::CommandLine command_line(
+        base::CommandLine::ForCurrentProcess()->GetProgram());
+    command_line.AppendSwitch(kReadbackShmReader);
+    channel.PrepareToPassRemoteEndpoint(&options, &command_line);
+    reader_process_ = base::LaunchProcess(command_line, options);
+    channel.RemoteProcessLaunchAttempted();
+    mojo::OutgoingInvitation::Send(
+        std::move(invitation), reader_process_.Handle(),
+        channel.TakeLocalEndpoint(),
+        base::BindRepeating(
+            [](const std::string& error) { LOG(ERROR) << error; }));
+  }
+
+  // 在线程池中调用
+  void Write(int64_t frame_index, const SkBitmap& bitmap) {
+    TRACE_EVENT1("viz", "SharedMemoryReadbackSink::Write", "frame",
+                 frame_index);
+    base::AutoLock lock(lock_);
+    const size_t stride = bitmap.info().minRowBytes();
+    const size_t size = sizeof(Header) + stride * bitmap.height();
+    if (!shm_.IsValid() || shm_.mapping.size() < size) {
+      // 画面变大时重新分配，新的 region 发送给读取方之后旧的就不再使用
+      shm_ = base::ReadOnlySharedMemoryRegion::Create(size);
+      if (!shm_.IsValid()) {
+        LOG(ERROR) << "SharedMemoryReadbackSink: failed to allocate " << size;
+        return;
+      }
+      LOG(INFO) << "SharedMemoryReadbackSink: allocated " << size
+                << " bytes, guid=" << shm_.region.GetGUID();
+      MojoHandle handle =
+          mojo::WrapReadOnlySharedMemoryRegion(shm_.region.Duplicate())
+              .release()
+              .value();
+      SendMessage(ReadbackShmMessage::kRegion, frame_index, &handle, 1);
+    }
+    Header* header = shm_.mapping.GetMemoryAs<Header>();
+    base::subtle::NoBarrier_AtomicIncrement(&header->sequence, 1);
+    base::subtle::MemoryBarrier();
+    header->width = bitmap.width();
+    header->height = bitmap.height();
+    header->stride = stride;
+    bitmap.readPixels(bitmap.info(), header + 1, stride, 0, 0);
+    base::subtle::Barrier_AtomicIncrement(&header->sequence, 1);
+    SendMessage(ReadbackShmMessage::kFrame, frame_index, nullptr, 0);
+  }
+
+ private:
+  friend class base::RefCountedThreadSafe<SharedMemoryReadbackSink>;
+  ~SharedMemoryReadbackSink() = default;
+
+  // WriteMessageRaw 会接管 handles 的所有权
+  void SendMessage(ReadbackShmMessage::Type type,
+                   int64_t frame_index,
+                   const MojoHandle* handles,
+                   size_t num_handles) {
+    ReadbackShmMessage message = {};
+    message.type = type;
+    message.frame_index = frame_index;
+    MojoResult result = mojo::WriteMessageRaw(
+        pipe_.get(), &message, sizeof(message), handles, num_handles,
+        MOJO_WRITE_MESSAGE_FLAG_NONE);
+    if (result != MOJO_RESULT_OK)
+      LOG(ERROR) << "SharedMemoryReadbackSink: send failed: " << result;
+  }
+
+  base::Process reader_process_;
+  // message pipe 的 handle 可以在任意线程中使用
+  mojo::ScopedMessagePipeHandle pipe_;
+
+  base::Lock lock_;
+  base::MappedReadOnlyRegion shm_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryReadbackSink);
+};
+
+// --readback-sink=shm 的读取子进程，只读映射 sink 发送过来的 region，
+// 收到帧通知后按照 seqlock 的规则读取最新的一帧。实际项目中这里可以
+// 把画面交给编码器或者其他程序。sink 关闭 pipe 时调用 quit_closure 退出。
+class SharedMemoryReadbackReader {
+ public:
+  explicit SharedMemoryReadbackReader(base::OnceClosure quit_closure)
+      : watcher_(FROM_HERE, mojo::SimpleWatcher::ArmingPolicy::AUTOMATIC),
+        quit_closure_(std::move(quit_closure)) {
+    mojo::IncomingInvitation invitation = mojo::IncomingInvitation::Accept(
+        mojo::PlatformChannel::RecoverPassedEndpointFromCommandLine(
+            *base::CommandLine::ForCurrentProcess()));
+    pipe_ = invitation.ExtractMessagePipe(kReadbackShmPipeName);
+    watcher_.Watch(pipe_.get(), MOJO_HANDLE_SIGNAL_READABLE,
+                   base::BindRepeating(&SharedMemoryReadbackReader::OnReadable,
+                                       base::Unretained(this)));
+  }
+
+  ~SharedMemoryReadbackReader() {
+    LOG(INFO) << "SharedMemoryReadbackReader: read=" << frames_read_
+              << " torn=" << frames_torn_;
+  }
+
+ private:
+  using Header = SharedMemoryReadbackSink::Header;
+
+  void OnReadable(MojoResult result) {
+    if (result != MOJO_RESULT_OK) {
+      LOG(INFO) << "pipe closed. result= " << result;
+      watcher_.Cancel();
+      if (quit_closure_)
+        std::move(quit_closure_).Run();
+      return;
+    }
+    while (true) {
+      std::vector<uint8_t> data;
+      std::vector<mojo::ScopedHandle> handles;
+      if (mojo::ReadMessageRaw(pipe_.get(), &data, &handles,
+                               MOJO_READ_MESSAGE_FLAG_NONE) != MOJO_RESULT_OK ||
+          data.size() != sizeof(ReadbackShmMessage)) {
+        break;
+      }
+      const auto* message = reinterpret_cast<ReadbackShmMessage*>(data.data());
+      if (message->type == ReadbackShmMessage::kRegion && handles.size() == 1) {
+        base::ReadOnlySharedMemoryRegion region =
+            mojo::UnwrapReadOnlySharedMemoryRegion(
+                mojo::ScopedSharedBufferHandle::From(std::move(handles[0])));
+        mapping_ = region.Map();
+        DCHECK(mapping_.IsValid());
+        LOG(INFO) << "reader: mapped " << mapping_.size() << " bytes";
+      } else if (message->type == ReadbackShmMessage::kFrame) {
+        ReadFrame(message->frame_index);
+      }
+    }
+  }
+
+  // sink 可能正在写入下一帧，sequence 为奇数或者读取前后不一致时重试
+  void ReadFrame(int64_t frame_index) {
+    TRACE_EVENT1("viz", "SharedMemoryReadbackReader::ReadFrame", "frame",
+                 frame_index);
+    if (!mapping_.IsValid())
+      return;
+    const Header* header = mapping_.GetMemoryAs<Header>();
+    constexpr int kMaxRetries = 3;
+    for (int i = 0; i < kMaxRetries; ++i) {
+      const base::subtle::Atomic32 begin =
+          base::subtle::Acquire_Load(&header->sequence);
+      if (begin & 1)
+        continue;
+      const SkImageInfo info = SkImageInfo::Make(
+          header->width, header->height, kRGBA_8888_SkColorType,
+          kPremul_SkAlphaType);
+      SkPixmap pixmap(info, header + 1, header->stride);
+      // 这里只取画面中心的像素作为演示
+      const SkColor color =
+          pixmap.getColor(info.width() / 2, info.height() / 2);
+      base::subtle::MemoryBarrier();
+      if (base::subtle::NoBarrier_Load(&header->sequence) != begin)
+        continue;
+      ++frames_read_;
+      DLOG(INFO) << "reader: frame " << frame_index << " " << info.width()
+                 << "x" << info.height() << " color=" << std::hex << color;
+      return;
+    }
+    ++frames_torn_;
+  }
+
+  mojo::ScopedMessagePipeHandle pipe_;
+  mojo::SimpleWatcher watcher_;
+  base::OnceClosure quit_closure_;
+  base::ReadOnlySharedMemoryMapping mapping_;
+  int64_t frames_read_ = 0;
+  int64_t frames_torn_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryReadbackReader);
+};
+
+// I420 格式的回读结果，Y、U、V 三个平面连续存放，stride 等于各自的宽度
+struct I420Frame {
+  gfx::Size size;
+  // 发出回读请求时 BeginFrame 的 frame_time 和间隔，用于确定这一帧在视频中
+  // 的位置以及录制的帧率
+  base::TimeTicks frame_time;
+  base::TimeDelta interval;
+  std::vector<uint8_t> data;
+
+  int uv_width() const { return (size.width() + 1) / 2; }
+  int uv_height() const { return (size.height() + 1) / 2; }
+  uint8_t* y() { return data.data(); }
+  uint8_t* u() { return y() + size.GetArea(); }
+  uint8_t* v() { return u() + uv_width() * uv_height(); }
+
+  void Allocate(const gfx::Size& new_size) {
+    size = new_size;
+    data.resize(size.GetArea() + uv_width() * uv_height() * 2);
+  }
+};
+
+// 把 I420 回读结果写入 .y4m 文件，扩展名为 .yuv 时写入不带头部的原始数据，
+// 可以直接交给视频编码器或者 ffmpeg -f rawvideo -pix_fmt yuv420p 读取。
+// 多个 worker 可能乱序完成，晚于已写入帧的结果会被丢弃；
+// 画面大小需要保持不变，和第一帧大小不同的帧同样会被丢弃。
+// 管线饱和时跳过的帧用下一帧补齐，保证播放速度和录制时一致。
+class YuvFileReadbackSink
+    : public base::RefCountedThreadSafe<YuvFileReadbackSink> {
+ public:
+  explicit YuvFileReadbackSink(const base::FilePath& path)
+      : writer_(path, "YuvFileReadbackSink") {}
+
+  // 在线程池中调用。被节流或者管线饱和跳过的帧不一定只占一个 vsync，
+  // 所以帧在视频中的位置由 BeginFrame 的 frame_time 按第一帧的间隔换算，
+  // 而不是使用回读的帧序号
+  void Write(int64_t frame_index, const I420Frame& frame) {
+    TRACE_EVENT1("viz", "YuvFileReadbackSink::Write", "frame", frame_index);
+    base::AutoLock lock(lock_);
+    if (first_frame_time_.is_null()) {
+      first_frame_time_ = frame.frame_time;
+      interval_ = frame.interval;
+    }
+    int64_t position = 0;
+    if (!interval_.is_zero()) {
+      position = std::llround(
+          (frame.frame_time - first_frame_time_).InMicrosecondsF() /
+          interval_.InMicrosecondsF());
+    }
+    writer_.Write(position, frame.size, interval_, frame.data.data(),
+                  frame.data.size());
+  }
+
+ private:
+  friend class base::RefCountedThreadSafe<YuvFileReadbackSink>;
+  ~YuvFileReadbackSink() = default;
+
+  base::Lock lock_;
+  Y4mWriter writer_;
+  // 第一帧的 frame_time 和 BeginFrame 间隔，即视频的起点和帧率
+  base::TimeTicks first_frame_time_;
+  base::TimeDelta interval_;
+
+  DISALLOW_COPY_AND_ASSIGN(YuvFileReadbackSink);
+};
+
+// 基于 CopyOutputRequest 的异步回读管线。
+// 原来在 client 线程中同步编码 PNG，无法达到 60fps，并且会阻塞 CF 的生成。
+// - 同时最多有 max_in_flight 个回读（从发出请求到 sink 处理完毕），
+//   管线饱和时直接跳过该帧，不会阻塞 CF 的生成
+// - 结果的转换（AsSkBitmap）以及 sink 在线程池中执行
+// 只能在 client 线程中使用。
+class ReadbackPipeline {
+ public:
+  // 在线程池中调用，参数为帧序号和回读结果，可能会被并发调用
+  using Sink = base::RepeatingCallback<void(int64_t, const SkBitmap&)>;
+  // 同上，用于 I420 格式
+  using I420Sink = base::RepeatingCallback<void(int64_t, const I420Frame&)>;
+
+  // 回读的区域及缩放比例，用于生成缩略图。
+  // 由 viz 在 GPU 上完成裁剪和缩小之后再回读，传输的数据量为原来的
+  // 1/(scale_divisor^2)。
+  struct CopyParams {
+    // render pass 坐标系中的区域，为空时回读整个 render pass
+    gfx::Rect area;
+    // 缩小的倍数，例如 4 表示缩小为 1/4
+    int scale_divisor = 1;
+    // I420_PLANES 时由 viz 在 GPU 上完成颜色空间转换，回读的数据量为 RGBA 的
+    // 3/8，需要使用 I420Sink
+    viz::CopyOutputResult::Format format =
+        viz::CopyOutputResult::Format::RGBA_BITMAP;
+    // 同时回读一份全分辨率的 RGBA 结果，并在 CPU 上缩小以及使用 libyuv
+    // 转换为 I420，用于对比两种方式的开销
+    bool compare_with_cpu = false;
+  };
+
+  ReadbackPipeline(size_t max_in_flight, const CopyParams& params, Sink sink)
+      : ReadbackPipeline(max_in_flight, params) {
+    DCHECK_EQ(params_.format, viz::CopyOutputResult::Format::RGBA_BITMAP);
+    sink_ = std::move(sink);
+  }
+
+  ReadbackPipeline(size_t max_in_flight,
+                   const CopyParams& params,
+                   I420Sink i420_sink)
+      : ReadbackPipeline(max_in_flight, params) {
+    DCHECK_EQ(params_.format, viz::CopyOutputResult::Format::I420_PLANES);
+    i420_sink_ = std::move(i420_sink);
+  }
+
+  // 根据命令行参数创建，--readback-sink=none 时返回 nullptr
+  static std::unique_ptr<ReadbackPipeline> CreateFromCommandLine() {
+    const base::CommandLine* command_line =
+        base::CommandLine::ForCurrentProcess();
+    std::string sink_name = command_line->GetSwitchValueASCII(kReadbackSink);
+    size_t max_in_flight = kDefaultReadbackMaxInFlight;
+    if (command_line->HasSwitch(kReadbackMaxInFlight)) {
+      base::StringToSizeT(
+          command_line->GetSwitchValueASCII(kReadbackMaxInFlight),
+          &max_in_flight);
+    }
+    CopyParams params;
+    if (command_line->HasSwitch(kReadbackArea)) {
+      std::string value = command_line->GetSwitchValueASCII(kReadbackArea);
+      std::vector<int> values;
+      for (const auto& piece : base::SplitStringPiece(
+               value, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+        int number = 0;
+        if (base::StringToInt(piece, &number))
+          values.push_back(number);
+      }
+      if (values.size() == 4)
+        params.area = gfx::Rect(values[0], values[1], values[2], values[3]);
+      else
+        LOG(ERROR) << "Invalid --" << kReadbackArea << "=" << value;
+    }
+    if (command_line->HasSwitch(kReadbackScale)) {
+      base::StringToInt(command_line->GetSwitchValueASCII(kReadbackScale),
+                        &params.scale_divisor);
+    }
+    params.compare_with_cpu = command_line->HasSwitch(kReadbackCompareCpu);
+    const bool i420 =
+        command_line->GetSwitchValueASCII(kReadbackFormat) == "i420";
+    if (i420)
+      params.format = viz::CopyOutputResult::Format::I420_PLANES;
+
+    Sink sink;
+    if (sink_name == "none") {
+      return nullptr;
+    } else if (i420) {
+      // I420 只支持写入文件，和 --readback-sink=shm 一起使用时 main 中
+      // 已经报错退出
+      DCHECK_NE(sink_name, "shm");
+      base::FilePath path = command_line->GetSwitchValuePath(kReadbackYuvFile);
+      if (path.empty()) {
+        base::PathService::Get(base::BasePathKey::DIR_EXE, &path);
+        path = path.AppendASCII("result_demo_viz_layer.y4m");
+      }
+      LOG(INFO) << "ReadbackPipeline: format=i420 file=" << path
+                << " max_in_flight=" << max_in_flight
+                << " scale=1/" << params.scale_divisor;
+      return std::make_unique<ReadbackPipeline>(
+          max_in_flight, params,
+          base::BindRepeating(
+              &YuvFileReadbackSink::Write,
+              base::MakeRefCounted<YuvFileReadbackSink>(path)));
+    } else if (sink_name == "shm") {
+      sink = base::BindRepeating(
+          &SharedMemoryReadbackSink::Write,
+          base::MakeRefCounted<SharedMemoryReadbackSink>());
+    } else {
+      base::FilePath path;
+      base::PathService::Get(base::BasePathKey::DIR_EXE, &path);
+      sink = CreateFileSink(path.AppendASCII("result_demo_viz_layer.png"));
+    }
+    LOG(INFO) << "ReadbackPipeline: sink="
+              << (sink_name.empty() ? "file" : sink_name)
+              << " max_in_flight=" << max_in_flight
+              << " area=" << params.area.ToString()
+              << " scale=1/" << params.scale_divisor;
+    return std::make_unique<ReadbackPipeline>(max_in_flight, params,
+                                              std::move(sink));
+  }
+
+  // 编码为 PNG 并原子地替换 path，多个 worker 同时写入也不会得到损坏的文件
+  static Sink CreateFileSink(const base::FilePath& path) {
+    return base::BindRepeating(
+        [](const base::FilePath& path, int64_t frame_index,
+           const SkBitmap& bitmap) {
+          TRACE_EVENT1("viz", "ReadbackPipeline::FileSink", "frame",
+                       frame_index);
+          SkDynamicMemoryWStream stream;
+          if (!SkEncodeImage(&stream, bitmap.pixmap(),
+                             SkEncodedImageFormat::kPNG, 0)) {
+            LOG(ERROR) << "ReadbackPipeline: failed to encode frame "
+                       << frame_index;
+            return;
+          }
+          sk_sp<SkData> data = stream.detachAsData();
+          base::ImportantFileWriter::WriteFileAtomically(
+              path, base::StringPiece(static_cast<const char*>(data->data()),
+                                      data->size()));
+          DLOG(INFO) << "ReadbackPipeline: save frame " << frame_index
+                     << " to: " << path;
+        },
+        path);
+  }
+
+  // 管线没有饱和时给 render_pass 添加一个 CopyOutputRequest，
+  // args 为当前的 BeginFrame，它的 frame_time 和间隔随请求一起传给 sink，
+  // 回读是异步完成的，不能在结果返回时再读取当前的值
+  bool MaybeRequestCopy(viz::RenderPass* render_pass,
+                        const viz::BeginFrameArgs& args) {
+    const int64_t frame_index = next_frame_index_++;
+    if (in_flight_ >= max_in_flight_) {
+      ++skipped_;
+      TRACE_EVENT_INSTANT1("viz", "ReadbackPipeline::Skip",
+                           TRACE_EVENT_SCOPE_THREAD, "frame", frame_index);
+      return false;
+    }
+    ++in_flight_;
+    TRACE_COUNTER1("viz", "readback_in_flight", in_flight_);
+    render_pass->copy_requests.push_back(CreateRequest(
+        frame_index, args, params_.scale_divisor, /*cpu_path=*/false));
+    // 对比用的请求不受 max_in_flight 的限制，结果也不交给 sink
+    if (params_.compare_with_cpu && NeedsCpuPath()) {
+      render_pass->copy_requests.push_back(
+          CreateRequest(frame_index, args, 1, /*cpu_path=*/true));
+    }
+    return true;
+  }
+
+ private:
+  ReadbackPipeline(size_t max_in_flight, const CopyParams& params)
+      : max_in_flight_(std::max<size_t>(max_in_flight, 1)),
+        params_(params),
+        worker_task_runner_(base::CreateTaskRunner(
+            {base::ThreadPool(), base::MayBlock(),
+             base::TaskPriority::USER_VISIBLE,
+             base::TaskShutdownBehavior::SKIP_ON_SHUTDOWN})) {
+    params_.scale_divisor = std::max(params_.scale_divisor, 1);
+  }
+
+  bool NeedsCpuPath() const {
+    return params_.scale_divisor > 1 ||
+           params_.format == viz::CopyOutputResult::Format::I420_PLANES;
+  }
+
+  // 统计某种回读方式的传输量以及从发出请求到得到最终 bitmap 的耗时
+  struct Stats {
+    explicit Stats(const std::string& name) : latency(name) {}
+    LatencyRecorder latency;
+    int64_t bytes = 0;
+  };
+
+  std::unique_ptr<viz::CopyOutputRequest> CreateRequest(
+      int64_t frame_index,
+      const viz::BeginFrameArgs& args,
+      int scale_divisor,
+      bool cpu_path) {
+    // 使用Bitmap方式获取该 render_pass 渲染的结果，
+    // Texture 方式已经在2020.7.23日被移除，详见：
+    // https://bugs.chromium.org/p/chromium/issues/detail?id=1044594
+    auto request = std::make_unique<viz::CopyOutputRequest>(
+        cpu_path ? viz::CopyOutputResult::Format::RGBA_BITMAP  // RGBA_TEXTURE
+                 : params_.format,
+        cpu_path ? base::BindOnce(&ReadbackPipeline::OnFullResult,
+                                  weak_factory_.GetWeakPtr(), frame_index,
+                                  base::TimeTicks::Now())
+                 : base::BindOnce(&ReadbackPipeline::OnResult,
+                                  weak_factory_.GetWeakPtr(), frame_index,
+                                  args.frame_time, args.interval,
+                                  base::TimeTicks::Now()));
+    request->set_result_task_runner(base::SequencedTaskRunnerHandle::Get());
+    if (!params_.area.IsEmpty())
+      request->set_area(params_.area);
+    if (scale_divisor > 1) {
+      // 由 viz 在 GPU 上缩小之后再回读，result_selection 需要使用缩放之后的
+      // 坐标，否则回读的仍然是整个区域
+      request->SetUniformScaleRatio(scale_divisor, 1);
+      if (!params_.area.IsEmpty()) {
+        request->set_result_selection(viz::copy_output::ComputeResultRect(
+            params_.area, request->scale_from(), request->scale_to()));
+      }
+    }
+    return request;
+  }
+
+  void OnResult(int64_t frame_index,
+                base::TimeTicks frame_time,
+                base::TimeDelta interval,
+                base::TimeTicks request_time,
+                std::unique_ptr<viz::CopyOutputResult> result) {
+    TRACE_EVENT1("viz", "ReadbackPipeline::OnResult", "frame", frame_index);
+    if (result->IsEmpty()) {
+      OnSinkDone(request_time, 0);
+      return;
+    }
+    if (result->format() == viz::CopyOutputResult::Format::I420_PLANES) {
+      I420Frame frame;
+      frame.Allocate(result->size());
+      frame.frame_time = frame_time;
+      frame.interval = interval;
+      const int64_t bytes = frame.data.size();
+      worker_task_runner_->PostTaskAndReply(
+          FROM_HERE,
+          base::BindOnce(
+              [](const I420Sink& sink, int64_t frame_index, I420Frame frame,
+                 std::unique_ptr<viz::CopyOutputResult> result) {
+                TRACE_EVENT1("viz", "ReadbackPipeline::ReadI420AndSink",
+                             "frame", frame_index);
+                if (!result->ReadI420Planes(frame.y(), frame.size.width(),
+                                            frame.u(), frame.uv_width(),
+                                            frame.v(), frame.uv_width())) {
+                  LOG(ERROR) << "ReadbackPipeline: ReadI420Planes failed";
+                  return;
+                }
+                sink.Run(frame_index, frame);
+              },
+              i420_sink_, frame_index, std::move(frame), std::move(result)),
+          base::BindOnce(&ReadbackPipeline::OnSinkDone,
+                         weak_factory_.GetWeakPtr(), request_time, bytes));
+      return;
+    }
+    const int64_t bytes = result->size().GetArea() * 4;
+    worker_task_runner_->PostTaskAndReply(
+        FROM_HERE,
+        base::BindOnce(
+            [](const Sink& sink, int64_t frame_index,
+               std::unique_ptr<viz::CopyOutputResult> result) {
+              TRACE_EVENT1("viz", "ReadbackPipeline::ConvertAndSink", "frame",
+                           frame_index);
+              sink.Run(frame_index, result->AsSkBitmap());
+            },
+            sink_, frame_index, std::move(result)),
+        base::BindOnce(&ReadbackPipeline::OnSinkDone,
+                       weak_factory_.GetWeakPtr(), request_time, bytes));
+  }
+
+  // 全分辨率回读 RGBA 之后在 CPU 上缩小到和 OnResult 相同的大小，
+  // I420 模式下再使用 libyuv 转换，只用于统计
+  void OnFullResult(int64_t frame_index,
+                    base::TimeTicks request_time,
+                    std::unique_ptr<viz::CopyOutputResult> result) {
+    TRACE_EVENT1("viz", "ReadbackPipeline::OnFullResult", "frame",
+                 frame_index);
+    if (result->IsEmpty())
+      return;
+    const int64_t bytes = result->size().GetArea() * 4;
+    const int scale_divisor = params_.scale_divisor;
+    const bool i420 =
+        params_.format == viz::CopyOutputResult::Format::I420_PLANES;
+    worker_task_runner_->PostTaskAndReply(
+        FROM_HERE,
+        base::BindOnce(
+            [](int scale_divisor, bool i420,
+               std::unique_ptr<viz::CopyOutputResult> result) {
+              TRACE_EVENT0("viz", "ReadbackPipeline::CpuPath");
+              SkBitmap bitmap = result->AsSkBitmap();
+              if (scale_divisor > 1) {
+                SkBitmap scaled;
+                scaled.allocPixels(bitmap.info().makeWH(
+                    std::max(bitmap.width() / scale_divisor, 1),
+                    std::max(bitmap.height() / scale_divisor, 1)));
+                bitmap.pixmap().scalePixels(scaled.pixmap(),
+                                            kLow_SkFilterQuality);
+                bitmap = scaled;
+              }
+              if (i420) {
+                I420Frame frame;
+                frame.Allocate(gfx::Size(bitmap.width(), bitmap.height()));
+                // libyuv 的 ARGB 对应内存中的 BGRA 字节序，ABGR 对应 RGBA
+                auto convert = bitmap.colorType() == kBGRA_8888_SkColorType
+                                   ? libyuv::ARGBToI420
+                                   : libyuv::ABGRToI420;
+                convert(static_cast<const uint8_t*>(bitmap.getPixels()),
+                        bitmap.rowBytes(), frame.y(), frame.size.width(),
+                        frame.u(), frame.uv_width(), frame.v(),
+                        frame.uv_width(), frame.size.width(),
+                        frame.size.height());
+              }
+            },
+            scale_divisor, i420, std::move(result)),
+        base::BindOnce(&ReadbackPipeline::OnCpuResizeDone,
+                       weak_factory_.GetWeakPtr(), request_time, bytes));
+  }
+
+  void OnCpuResizeDone(base::TimeTicks request_time, int64_t bytes) {
+    full_stats_.latency.Add(base::TimeTicks::Now() - request_time);
+    full_stats_.bytes += bytes;
+  }
+
+  void OnSinkDone(base::TimeTicks request_time, int64_t bytes) {
+    --in_flight_;
+    ++completed_;
+    scaled_stats_.latency.Add(base::TimeTicks::Now() - request_time);
+    scaled_stats_.bytes += bytes;
+    TRACE_COUNTER1("viz", "readback_in_flight", in_flight_);
+    if (completed_ % 100 == 0)
+      ReportStats();
+  }
+
+  void ReportStats() {
+    LOG(INFO) << "ReadbackPipeline: completed=" << completed_
+              << " skipped=" << skipped_;
+    auto log_stats = [](const Stats& stats) {
+      if (!stats.latency.count())
+        return;
+      LOG(INFO) << "ReadbackPipeline: " << stats.latency.ToString()
+                << " bytes/readback=" << stats.bytes / stats.latency.count();
+    };
+    log_stats(scaled_stats_);
+    log_stats(full_stats_);
+    if (scaled_stats_.latency.count() && full_stats_.latency.count()) {
+      LOG(INFO) << "ReadbackPipeline: saved "
+                << (full_stats_.latency.Mean() - scaled_stats_.latency.Mean())
+                       .InMillisecondsF()
+                << "ms and "
+                << full_stats_.bytes / full_stats_.latency.count() -
+                       scaled_stats_.bytes / scaled_stats_.latency.count()
+                << " bytes per readback compared with cpu path";
+    }
+    scaled_stats_ = Stats(scaled_stats_.latency.name());
+    full_stats_ = Stats(full_stats_.latency.name());
+  }
+
+  const size_t max_in_flight_;
+  CopyParams params_;
+  Sink sink_;
+  I420Sink i420_sink_;
+  scoped_refptr<base::TaskRunner> worker_task_runner_;
+  size_t in_flight_ = 0;
+  int64_t next_frame_index_ = 0;
+  int64_t completed_ = 0;
+  int64_t skipped_ = 0;
+  Stats scaled_stats_{"gpu_readback"};
+  Stats full_stats_{"full_rgba_readback+cpu"};
+
+  base::WeakPtrFactory<ReadbackPipeline> weak_factory_{this};
+
+  DISALLOW_COPY_AND_ASSIGN(ReadbackPipeline);
 };
 
 // Client 端
 // 类似 Chromium 中的 *LayerTreeFrameSink 的作用.
 class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
  public:
-  LayerTreeFrameSink(const viz::FrameSinkId& frame_sink_id,
+  LayerTreeFrameSink(ClientScheduler* scheduler,
+                     const viz::FrameSinkId& frame_sink_id,
                      const viz::LocalSurfaceIdAllocation& local_surface_id,
                      const gfx::Rect& bounds)
       : frame_sink_id_(frame_sink_id),
         local_surface_id_(local_surface_id),
         bounds_(bounds),
-        thread_("Demo_" + frame_sink_id.ToString()) {
-    CHECK(thread_.Start());
+        task_runner_(scheduler->GetTaskRunnerForFrameSink()),
+        // parent 引用 child 新的 LocalSurfaceId 时 viz 最多等待的帧数，
+        // 没有限制时一直等待 child 提交新的 surface
+        deadline_in_frames_(switches::GetDeadlineToSynchronizeSurfaces().value_or(
+            std::numeric_limits<uint32_t>::max())),
+        begin_frame_throttler_("LayerTreeFrameSink " +
+                               frame_sink_id.ToString()) {}
+
+  // 定时器、回读的 WeakPtr 和 mojo 的端点都绑定在 task_runner_ 的线程上，
+  // 需要在该线程中销毁
+  ~LayerTreeFrameSink() override {
+    base::WaitableEvent event;
+    task_runner_->PostTask(
+        FROM_HERE, base::BindOnce(&LayerTreeFrameSink::ShutdownOnThread,
+                                  base::Unretained(this), &event));
+    event.Wait();
   }
 
-  ~LayerTreeFrameSink() override {}
-
   // remote 和 associated_remote 只能一个有效.
   // remote 用于非 root 的 client, associated_remote 用于 root client.
   // 这表示 root client 提交 CF 的过程需要和 FSM 的调用进行同步,而其他 client
@@ -474,7 +1772,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
       mojo::PendingReceiver<viz::mojom::CompositorFrameSinkClient> receiver,
       mojo::PendingAssociatedRemote<viz::mojom::CompositorFrameSink>
           associated_remote) {
-    thread_.task_runner()->PostTask(
+    task_runner_->PostTask(
         FROM_HERE,
         base::BindOnce(&LayerTreeFrameSink::BindOnThread,
                        base::Unretained(this), std::move(receiver),
@@ -484,7 +1782,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
   void Bind(
       mojo::PendingReceiver<viz::mojom::CompositorFrameSinkClient> receiver,
       mojo::PendingRemote<viz::mojom::CompositorFrameSink> remote) {
-    thread_.task_runner()->PostTask(
+    task_runner_->PostTask(
         FROM_HERE,
         base::BindOnce(&LayerTreeFrameSink::BindOnThread,
                        base::Unretained(this), std::move(receiver),
@@ -493,13 +1791,15 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
 
   void SetContextProvider(
       scoped_refptr<viz::ContextProvider> context_provider) {
-    if (thread_.task_runner()->BelongsToCurrentThread()) {
+    if (task_runner_->BelongsToCurrentThread()) {
       LOG(INFO) << "SetContextProvider";
+      base::AutoLock lock(lock_);
       context_provider_ = context_provider;
       DCHECK(context_provider->BindToCurrentThread() ==
              gpu::ContextResult::kSuccess);
+      SetNeedsFrameLocked();
     } else {
-      thread_.task_runner()->PostTask(
+      task_runner_->PostTask(
           FROM_HERE, base::BindOnce(&LayerTreeFrameSink::SetContextProvider,
                                     base::Unretained(this), context_provider));
     }
@@ -507,12 +1807,89 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
 
   viz::FrameSinkId frame_sink_id() { return frame_sink_id_; }
 
+  // 可以在任意线程中调用
+  void set_submit_every_frame(bool submit_every_frame) {
+    base::AutoLock lock(lock_);
+    submit_every_frame_ = submit_every_frame;
+    if (submit_every_frame_)
+      SetNeedsFrameLocked();
+  }
+
+  // rect 为 child 在 root 中的位置，可以嵌入多个 child
   viz::LocalSurfaceIdAllocation EmbedChild(
+      const viz::FrameSinkId& child_frame_sink_id,
+      const gfx::Rect& rect) {
+    base::AutoLock lock(lock_);
+    local_surface_id_allocator_.GenerateId();
+    viz::LocalSurfaceIdAllocation allocation =
+        local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation();
+    children_.push_back({child_frame_sink_id, allocation.local_surface_id(),
+                         viz::LocalSurfaceId(), rect});
+    SetNeedsFrameLocked();
+    return allocation;
+  }
+
+  // 为 child 分配新的 LocalSurfaceId，child 使用它提交新大小的 CF 之前，
+  // parent 的 CF 会等待最多 GetDeadlineToSynchronizeSurfaces 帧，超时后显示
+  // fallback，即 child 最近一次激活的 surface。连续 Resize 时上一次分配的
+  // LocalSurfaceId 可能从来没有激活过，不能作为 fallback
+  viz::LocalSurfaceIdAllocation ResizeChild(
       const viz::FrameSinkId& child_frame_sink_id) {
     base::AutoLock lock(lock_);
-    child_frame_sink_id_ = child_frame_sink_id;
     local_surface_id_allocator_.GenerateId();
-    return local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation();
+    viz::LocalSurfaceIdAllocation allocation =
+        local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation();
+    for (auto& child : children_) {
+      if (child.frame_sink_id == child_frame_sink_id)
+        child.local_surface_id = allocation.local_surface_id();
+    }
+    SetNeedsFrameLocked();
+    return allocation;
+  }
+
+  // child 的 surface 第一次激活时由 host 调用，更新 fallback，
+  // 可以在任意线程中调用
+  void DidActivateChildSurface(const viz::SurfaceId& surface_id) {
+    base::AutoLock lock(lock_);
+    for (auto& child : children_) {
+      if (child.frame_sink_id != surface_id.frame_sink_id())
+        continue;
+      if (!child.fallback_local_surface_id.is_valid() ||
+          surface_id.local_surface_id().IsNewerThan(
+              child.fallback_local_surface_id)) {
+        child.fallback_local_surface_id = surface_id.local_surface_id();
+      }
+    }
+  }
+
+  // root 使用 host 分配的新 LocalSurfaceId，下一次 BeginFrame 时提交新大小的 CF
+  void Resize(const viz::LocalSurfaceIdAllocation& local_surface_id,
+              const gfx::Rect& bounds) {
+    base::AutoLock lock(lock_);
+    local_surface_id_ = local_surface_id;
+    bounds_ = bounds;
+    SetNeedsFrameLocked();
+  }
+
+  // 下一次提交的 CF 上屏时在 callback_task_runner 上执行 callback，
+  // 参数为上屏的时间
+  void RequestPresentationCallback(
+      base::OnceCallback<void(base::TimeTicks)> callback,
+      scoped_refptr<base::SequencedTaskRunner> callback_task_runner) {
+    base::AutoLock lock(lock_);
+    presentation_callbacks_.push_back(
+        {0, std::move(callback), std::move(callback_task_runner)});
+    SetNeedsFrameLocked();
+  }
+
+  // 每一帧上屏时在 task_runner 上执行 observer，参数为上屏的时间和
+  // BeginFrame 的间隔，用于统计掉帧
+  void SetPresentationObserver(
+      base::RepeatingCallback<void(base::TimeTicks, base::TimeDelta)> observer,
+      scoped_refptr<base::SequencedTaskRunner> task_runner) {
+    base::AutoLock lock(lock_);
+    presentation_observer_ = std::move(observer);
+    presentation_observer_task_runner_ = std::move(task_runner);
   }
 
  private:
@@ -524,13 +1901,66 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     receiver_.Bind(std::move(receiver));
     if (associated_remote) {
       frame_sink_associated_remote_.Bind(std::move(associated_remote));
+      // 只统计和回读 root client，surface tree 中的节点太多，每个节点都回读
+      // 会启动多个 sink（shm 模式下每个都会启动一个读取子进程）并写同一个文件
+      frame_timing_reporter_ = std::make_unique<FrameTimingReporter>(
+          "LayerTreeFrameSink " + frame_sink_id_.ToString());
+      if (g_use_gpu)
+        readback_pipeline_ = ReadbackPipeline::CreateFromCommandLine();
     } else {
       frame_sink_remote_.Bind(std::move(remote));
     }
-    // 告诉 CompositorFrameSink 可以开始请求 CompositorFrame 了
-    GetCompositorFrameSinkPtr()->SetNeedsBeginFrame(true);
     client_resource_provider_ =
         std::make_unique<viz::ClientResourceProvider>(false);
+    shared_bitmap_pool_ = std::make_unique<SharedBitmapPool>(
+        GetCompositorFrameSinkPtr(), client_resource_provider_.get());
+    // 告诉 CompositorFrameSink 可以开始请求 CompositorFrame 了，
+    // 内容不变时停止接收 BeginFrame，颜色由定时器驱动变化
+    begin_frame_throttler_.Bind(GetCompositorFrameSinkPtr());
+    animation_timer_.Start(FROM_HERE, kRootAnimationInterval,
+                           base::BindRepeating(&LayerTreeFrameSink::Animate,
+                                               base::Unretained(this)));
+  }
+
+  void Animate() {
+    base::AutoLock lock(lock_);
+    ++animation_step_;
+    SetNeedsFrameLocked();
+  }
+
+  void ShutdownOnThread(base::WaitableEvent* event) {
+    DCHECK(task_runner_->BelongsToCurrentThread());
+    animation_timer_.Stop();
+    begin_frame_throttler_.Unbind();
+    // 之后不会再收到 OnBeginFrame、回读结果以及资源的归还
+    receiver_.reset();
+    readback_pipeline_.reset();
+    // viz 还没有归还的资源以 lost 的状态释放回 pool，
+    // pool 需要通过 CompositorFrameSink 删除共享内存
+    if (client_resource_provider_)
+      client_resource_provider_->ShutdownAndReleaseAllResources();
+    shared_bitmap_pool_.reset();
+    client_resource_provider_.reset();
+    frame_sink_associated_remote_.reset();
+    frame_sink_remote_.reset();
+    {
+      base::AutoLock lock(lock_);
+      context_provider_ = nullptr;
+    }
+    event->Signal();
+  }
+
+  // 下一次 BeginFrame 时提交 CF，没有在接收 BeginFrame 时重新请求
+  void SetNeedsFrameLocked() {
+    lock_.AssertAcquired();
+    needs_frame_ = true;
+    if (task_runner_->BelongsToCurrentThread()) {
+      begin_frame_throttler_.Invalidate();
+    } else {
+      task_runner_->PostTask(
+          FROM_HERE, base::BindOnce(&BeginFrameThrottler::Invalidate,
+                                    base::Unretained(&begin_frame_throttler_)));
+    }
   }
 
   viz::CompositorFrame CreateFrame(const ::viz::BeginFrameArgs& args) {
@@ -545,6 +1975,9 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
         local_surface_id_.allocation_time();
     frame.metadata.frame_token = *frame_token_generator_;
     frame.metadata.send_frame_token_to_embedder = true;
+    // child Resize 之后 viz 等待 child 提交新的 surface，超时之后使用 fallback
+    frame.metadata.deadline = viz::FrameDeadline(
+        args.frame_time, deadline_in_frames_, args.interval, false);
 
     const int kRenderPassId = 1;
     const gfx::Rect& output_rect = bounds_;
@@ -555,9 +1988,8 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
 
     AppendDebugBorderDrawQuad(frame, render_pass.get());
 
-    if (child_frame_sink_id_.is_valid()) {
-      AppendSurfaceDrawQuad(frame, render_pass.get());
-    }
+    for (const auto& child : children_)
+      AppendSurfaceDrawQuad(child, render_pass.get());
     if (context_provider_) {
       AppendTileDrawQuad(frame, render_pass.get());
       AppendTextureDrawQuad(frame, render_pass.get());
@@ -567,39 +1999,14 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     AppendSolidColorDrawQuad(frame, render_pass.get());
 
     // SoftwareOutputDeviceX11 不支持离屏渲染
-    if (g_use_gpu) {
-      // 使用Bitmap方式获取该 render_pass 渲染的结果，
-      // Texture 方式已经在2020.7.23日被移除，详见：
-      // https://bugs.chromium.org/p/chromium/issues/detail?id=1044594
-      auto request = std::make_unique<viz::CopyOutputRequest>(
-          viz::CopyOutputResult::Format::RGBA_BITMAP,  // RGBA_TEXTURE
-          base::BindOnce(&LayerTreeFrameSink::OnGetOutputResult,
-                         base::Unretained(this)));
-      request->set_result_task_runner(base::SequencedTaskRunnerHandle::Get());
-      render_pass->copy_requests.push_back(std::move(request));
-    }
+    if (readback_pipeline_)
+      readback_pipeline_->MaybeRequestCopy(render_pass.get(), args);
 
     frame.render_pass_list.push_back(std::move(render_pass));
 
     return frame;
   }
 
-  // 这里也可以改为渲染在其他窗口中，但是无法达到60fps
-  void OnGetOutputResult(std::unique_ptr<viz::CopyOutputResult> result) {
-    TRACE_EVENT0("viz", "LayerTreeFrameSink::OnGetOutputResult");
-    DCHECK(!result->IsEmpty());
-    // 保存渲染结果到图片文件
-    constexpr char filename[] = "result_demo_viz_layer.png";
-    base::FilePath path;
-    DCHECK(base::PathService::Get(base::BasePathKey::DIR_EXE, &path));
-    path = path.AppendASCII(filename);
-
-    SkFILEWStream stream(path.value().c_str());
-    DCHECK(SkEncodeImage(&stream, result->AsSkBitmap().pixmap(),
-                         SkEncodedImageFormat::kPNG, 0));
-    DLOG(INFO) << "OnGetOutputResult: save the frame to: " << path;
-  }
-
   void AppendDebugBorderDrawQuad(viz::CompositorFrame& frame,
                                  viz::RenderPass* render_pass) {
     TRACE_EVENT0("viz", "LayerTreeFrameSink::AppendDebugBorderDrawQuad");
@@ -636,15 +2043,15 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     canvas.drawCircle(
         30, 100, 150,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 1) % base::size(colors)])));
+            colors[(animation_step_ + 1) % base::size(colors)])));
     canvas.drawCircle(
         10, 50, 60,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 2) % base::size(colors)])));
+            colors[(animation_step_ + 2) % base::size(colors)])));
     canvas.drawCircle(
         180, 180, 50,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 3) % base::size(colors)])));
+            colors[(animation_step_ + 3) % base::size(colors)])));
 
     gfx::Size tile_size(200, 200);
     // 将 SkBitmap 中的数据转换为资源
@@ -690,15 +2097,15 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     canvas.drawCircle(
         30, 100, 150,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 2) % base::size(colors)])));
+            colors[(animation_step_ + 2) % base::size(colors)])));
     canvas.drawCircle(
         10, 50, 60,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 3) % base::size(colors)])));
+            colors[(animation_step_ + 3) % base::size(colors)])));
     canvas.drawCircle(
         180, 180, 50,
         SkPaint(SkColor4f::FromColor(
-            colors[(*frame_token_generator_ / 60 + 1) % base::size(colors)])));
+            colors[(animation_step_ + 1) % base::size(colors)])));
 
     gfx::Size tile_size(200, 200);
     // 将 SkBitmap 中的数据转换为资源
@@ -734,12 +2141,20 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
         {resource}, &frame.resource_list, (viz::RasterContextProvider*)nullptr);
   }
 
-  void AppendSurfaceDrawQuad(viz::CompositorFrame& frame,
+  struct EmbeddedChild {
+    viz::FrameSinkId frame_sink_id;
+    viz::LocalSurfaceId local_surface_id;
+    // child 最近一次激活的 LocalSurfaceId，child 提交新的 CF 之前使用它来显示
+    viz::LocalSurfaceId fallback_local_surface_id;
+    gfx::Rect rect;
+  };
+
+  void AppendSurfaceDrawQuad(const EmbeddedChild& child,
                              viz::RenderPass* render_pass) {
     TRACE_EVENT0("viz", "LayerTreeFrameSink::AppendSurfaceDrawQuad");
-    gfx::Rect output_rect{0, 0, 200, 200};
+    gfx::Rect output_rect(child.rect.size());
     gfx::Transform transform;
-    transform.Translate(350, 350);
+    transform.Translate(child.rect.x(), child.rect.y());
 
     auto* quad_state = render_pass->CreateAndAppendSharedQuadState();
     quad_state->SetAll(
@@ -751,14 +2166,18 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
         /*is_clipped=*/false, /*are_contents_opaque=*/false, /*opacity=*/1.f,
         /*blend_mode=*/SkBlendMode::kSrcOver, /*sorting_context_id=*/0);
 
-    viz::SurfaceId child_surface_id(
-        child_frame_sink_id_,
-        local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation()
-            .local_surface_id());
+    viz::SurfaceId child_surface_id(child.frame_sink_id,
+                                    child.local_surface_id);
+    base::Optional<viz::SurfaceId> fallback_surface_id;
+    if (child.fallback_local_surface_id.is_valid()) {
+      fallback_surface_id = viz::SurfaceId(child.frame_sink_id,
+                                           child.fallback_local_surface_id);
+    }
     auto* surface_quad =
         render_pass->CreateAndAppendDrawQuad<viz::SurfaceDrawQuad>();
     surface_quad->SetNew(quad_state, output_rect, output_rect,
-                         viz::SurfaceRange(base::nullopt, child_surface_id),
+                         viz::SurfaceRange(fallback_surface_id,
+                                           child_surface_id),
                          SK_ColorDKGRAY, true);
   }
 
@@ -827,7 +2246,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
   // 演示 SolidColorDrawQuad 的使用
   void AppendSolidColorDrawQuad(viz::CompositorFrame& frame,
                                 viz::RenderPass* render_pass) {
-    auto color = colors[(*frame_token_generator_ / 60) % base::size(colors)];
+    auto color = colors[animation_step_ % base::size(colors)];
     TRACE_EVENT1("viz", "LayerTreeFrameSink::AppendSolidColorDrawQuad", "color",
                  color);
     gfx::Rect output_rect = bounds_;
@@ -849,7 +2268,7 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
         render_pass->CreateAndAppendDrawQuad<viz::SolidColorDrawQuad>();
     color_quad->SetNew(
         quad_state, output_rect, output_rect,
-        colors[(*frame_token_generator_ / 60) % base::size(colors)], false);
+        colors[animation_step_ % base::size(colors)], false);
   }
 
   viz::ResourceId CreateResource(const gfx::Size& size,
@@ -860,31 +2279,15 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
     return CreateSoftwareResource(size, source);
   }
 
-  // 使用共享内存来传递资源到 viz
+  // 使用共享内存来传递资源到 viz，共享内存由 SharedBitmapPool 复用，
+  // 只有池中没有可用的共享内存时才会分配并通过 DidAllocateSharedBitmap 注册。
+  // 把资源存入 ClientResourceProvider 进行统一管理。
+  // 后续会使用 ClientResourceProvider::PrepareSendToParent
+  // 将已经存入的资源添加 到 CF 中。
   viz::ResourceId CreateSoftwareResource(const gfx::Size& size,
                                          const SkBitmap& source) {
     TRACE_EVENT0("viz", "LayerTreeFrameSink::CreateSoftwareResource");
-    viz::SharedBitmapId shared_bitmap_id = viz::SharedBitmap::GenerateId();
-    // 创建共享内存
-    base::MappedReadOnlyRegion shm =
-        viz::bitmap_allocation::AllocateSharedBitmap(size, viz::RGBA_8888);
-    base::WritableSharedMemoryMapping mapping = std::move(shm.mapping);
-
-    SkImageInfo info = SkImageInfo::MakeN32Premul(size.width(), size.height());
-    // 将 SkBitmap 中的像素数据拷贝到共享内存
-    source.readPixels(info, mapping.memory(), info.minRowBytes(), 0, 0);
-
-    // 将共享内存及与之对应的资源Id发送到 viz service 端
-    GetCompositorFrameSinkPtr()->DidAllocateSharedBitmap(std::move(shm.region),
-                                                         shared_bitmap_id);
-
-    // 把资源存入 ClientResourceProvider 进行统一管理。
-    // 后续会使用 ClientResourceProvider::PrepareSendToParent
-    // 将已经存入的资源添加 到 CF 中。
-    return client_resource_provider_->ImportResource(
-        viz::TransferableResource::MakeSoftware(shared_bitmap_id, size,
-                                                viz::RGBA_8888),
-        viz::SingleReleaseCallback::Create(base::DoNothing()));
+    return shared_bitmap_pool_->ImportBitmap(size, source);
   }
 
   viz::ResourceId CreateGpuResource(const gfx::Size& size,
@@ -946,16 +2349,59 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
       const base::flat_map<uint32_t, ::viz::FrameTimingDetails>& details)
       override {
     base::AutoLock lock(lock_);
-    // 每 60fps 刷新一帧
-    if (++frame_token_generator_ % 60 == 1) {
+    begin_frame_throttler_.WillHandleBeginFrame(args);
+    for (const auto& detail : details)
+      OnFramePresented(detail.first, detail.second, args.interval);
+    if (frame_timing_reporter_)
+      frame_timing_reporter_->DidReceiveTimingDetails(details);
+    // 只有内容变化时才提交，surface tree 中的节点以及 Resize 期间每一帧都提交
+    const bool produce_frame = submit_every_frame_ || needs_frame_;
+    if (produce_frame) {
+      needs_frame_ = false;
+      ++frame_token_generator_;
+      viz::CompositorFrame frame = CreateFrame(args);
+      const uint32_t frame_token = frame.metadata.frame_token;
+      for (auto& callback : presentation_callbacks_) {
+        if (!callback.frame_token)
+          callback.frame_token = frame_token;
+      }
       GetCompositorFrameSinkPtr()->SubmitCompositorFrame(
-          local_surface_id_.local_surface_id(), CreateFrame(args),
+          local_surface_id_.local_surface_id(), std::move(frame),
           base::Optional<viz::HitTestRegionList>(),
           /*trace_time=*/0);
+      if (frame_timing_reporter_)
+        frame_timing_reporter_->DidSubmitFrame(frame_token, args);
     } else {
       GetCompositorFrameSinkPtr()->DidNotProduceFrame(
           viz::BeginFrameAck(args, false));
     }
+    // 还有等待上屏的 callback 时继续接收 BeginFrame 以便收到 feedback
+    begin_frame_throttler_.DidHandleBeginFrame(
+        produce_frame, /*keep_alive=*/!presentation_callbacks_.empty());
+  }
+
+  void OnFramePresented(uint32_t frame_token,
+                        const viz::FrameTimingDetails& details,
+                        base::TimeDelta interval) {
+    const gfx::PresentationFeedback& feedback = details.presentation_feedback;
+    if (feedback.failed())
+      return;
+    if (presentation_observer_) {
+      presentation_observer_task_runner_->PostTask(
+          FROM_HERE, base::BindOnce(presentation_observer_, feedback.timestamp,
+                                    interval));
+    }
+    for (auto it = presentation_callbacks_.begin();
+         it != presentation_callbacks_.end();) {
+      if (it->frame_token && it->frame_token <= frame_token) {
+        it->task_runner->PostTask(
+            FROM_HERE,
+            base::BindOnce(std::move(it->callback), feedback.timestamp));
+        it = presentation_callbacks_.erase(it);
+      } else {
+        ++it;
+      }
+    }
   }
 
   void OnBeginFramePausedChanged(bool paused) override {
@@ -987,14 +2433,39 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
   viz::LocalSurfaceIdAllocation local_surface_id_;
   gfx::Rect bounds_;
   viz::ParentLocalSurfaceIdAllocator local_surface_id_allocator_;
-  viz::FrameSinkId child_frame_sink_id_;
-  // 模拟每个 Client 都在独立的线程中生成 CF
-  base::Thread thread_;
+  std::vector<EmbeddedChild> children_;
+  // 模拟每个 Client 都在独立的线程中生成 CF，多个 Client 共享 ClientScheduler
+  // 中的线程
+  scoped_refptr<base::SingleThreadTaskRunner> task_runner_;
   viz::FrameTokenGenerator frame_token_generator_;
+  // quad 颜色的索引，由 animation_timer_ 递增
+  uint32_t animation_step_ = 0;
   base::Lock lock_;
   scoped_refptr<viz::ContextProvider> context_provider_;
 
   std::unique_ptr<viz::ClientResourceProvider> client_resource_provider_;
+  std::unique_ptr<SharedBitmapPool> shared_bitmap_pool_;
+  // 仅 GPU 模式下对 root render pass 进行回读
+  std::unique_ptr<ReadbackPipeline> readback_pipeline_;
+  bool submit_every_frame_ = false;
+  // 内容有变化，下一次 BeginFrame 需要提交 CF，第一帧总是需要提交
+  bool needs_frame_ = true;
+  const uint32_t deadline_in_frames_;
+  struct PresentationCallback {
+    // 0 表示还没有提交对应的 CF
+    uint32_t frame_token;
+    base::OnceCallback<void(base::TimeTicks)> callback;
+    scoped_refptr<base::SequencedTaskRunner> task_runner;
+  };
+  std::vector<PresentationCallback> presentation_callbacks_;
+  base::RepeatingCallback<void(base::TimeTicks, base::TimeDelta)>
+      presentation_observer_;
+  scoped_refptr<base::SequencedTaskRunner> presentation_observer_task_runner_;
+  // 只在 task_runner_ 线程中使用
+  BeginFrameThrottler begin_frame_throttler_;
+  base::RepeatingTimer animation_timer_;
+  // 只有 root client 创建
+  std::unique_ptr<FrameTimingReporter> frame_timing_reporter_;
 };
 
 // Host 端
@@ -1021,20 +2492,112 @@ class Compositor : public viz::HostFrameSinkClient {
       scoped_refptr<viz::ContextProvider> root_context_provider,
       scoped_refptr<viz::ContextProvider> child_context_provider) {
     root_client_->SetContextProvider(root_context_provider);
-    child_client_->SetContextProvider(child_context_provider);
+    // ContextProvider 只能绑定到一个线程，所以只给第一个 child 使用
+    if (!child_clients_.empty())
+      child_clients_.front()->SetContextProvider(child_context_provider);
   }
 
+  // 为 root 和所有 child 分配新的 LocalSurfaceId 并调整 Display 的大小。
+  // 和窗口一样大的 child 会跟随窗口改变大小，其他 child 只更新 LocalSurfaceId。
+  // 所有 child 的新 surface 都激活之后，root 提交的下一帧即为第一帧正确的画面。
   void Resize(gfx::Size size) {
-    // TODO:
+    if (size == size_ || !root_client_)
+      return;
+    TRACE_EVENT1("viz", "Compositor::Resize", "size", size.ToString());
+    const gfx::Size old_size = size_;
+    size_ = size;
+    resize_start_ = base::TimeTicks::Now();
+    ++resize_sequence_;
+    ++resize_count_;
+
+    local_surface_id_allocator_.GenerateId();
+    display_private_->Resize(size_);
+    root_client_->Resize(
+        local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation(),
+        gfx::Rect(size_));
+
+    pending_resize_children_.clear();
+    for (size_t i = 0; i < child_clients_.size(); ++i) {
+      if (child_bounds_[i].size() == old_size)
+        child_bounds_[i].set_size(size_);
+      InkClient* child = child_clients_[i].get();
+      viz::LocalSurfaceIdAllocation allocation =
+          root_client_->ResizeChild(child->frame_sink_id());
+      child->Resize(allocation, child_bounds_[i]);
+      pending_resize_children_[child->frame_sink_id()] =
+          allocation.local_surface_id();
+    }
+    if (pending_resize_children_.empty())
+      RequestFirstCorrectFrame();
+  }
+
+  // --resize-storm 期间统计 root 的掉帧情况
+  void BeginResizeStorm() {
+    if (!root_client_)
+      return;
+    in_resize_storm_ = true;
+    last_root_present_time_ = base::TimeTicks();
+    presented_frames_ = 0;
+    janky_frames_ = 0;
+    resize_count_ = 0;
+    superseded_resizes_ = 0;
+    time_to_first_correct_frame_.Reset();
+    // 每一帧都提交才能统计出掉帧
+    root_client_->set_submit_every_frame(true);
+    root_client_->SetPresentationObserver(
+        base::BindRepeating(&Compositor::OnRootFramePresented,
+                            weak_factory_.GetWeakPtr()),
+        base::ThreadTaskRunnerHandle::Get());
+  }
+
+  void EndResizeStorm() {
+    in_resize_storm_ = false;
+    if (root_client_ && tree_levels_.empty())
+      root_client_->set_submit_every_frame(false);
+    LOG(INFO) << "ResizeStorm: resizes=" << resize_count_
+              << " superseded=" << superseded_resizes_
+              << " presented_frames=" << presented_frames_
+              << " janky_frames=" << janky_frames_ << " "
+              << time_to_first_correct_frame_.ToString();
   }
 
   gfx::AcceleratedWidget widget() { return widget_; }
 
+  // 退出时输出每个 InkClient 从输入事件到画面上屏的延迟直方图
+  void LogInputLatencyReport() {
+    for (const auto& client : child_clients_) {
+      std::string report = client->GetInputLatencyReport();
+      if (!report.empty()) {
+        LOG(INFO) << "InputLatency(" << client->frame_sink_id().ToString()
+                  << "): " << report;
+      }
+    }
+  }
+
   // Called when a CompositorFrame with a new SurfaceId activates for the first
   // time.
   void OnFirstSurfaceActivation(
       const viz::SurfaceInfo& surface_info) override {
     DLOG(INFO) << __FUNCTION__;
+    auto parent = surface_parents_.find(surface_info.id().frame_sink_id());
+    if (parent != surface_parents_.end())
+      parent->second->DidActivateChildSurface(surface_info.id());
+    auto pending = pending_resize_children_.find(
+        surface_info.id().frame_sink_id());
+    if (pending != pending_resize_children_.end() &&
+        pending->second == surface_info.id().local_surface_id()) {
+      pending_resize_children_.erase(pending);
+      if (pending_resize_children_.empty())
+        RequestFirstCorrectFrame();
+    }
+    // 从 parent 分配 LocalSurfaceId 到该 surface 第一次激活的延迟
+    auto it = tree_embed_times_.find(surface_info.id().frame_sink_id());
+    if (it == tree_embed_times_.end())
+      return;
+    const size_t level = it->second.first;
+    if (level < tree_activation_.size())
+      tree_activation_[level].Add(base::TimeTicks::Now() - it->second.second);
+    tree_embed_times_.erase(it);
   }
 
   // Called when a CompositorFrame with a new frame token is provided.
@@ -1092,23 +2655,216 @@ class Compositor : public viz::HostFrameSinkClient {
 
     local_surface_id_allocator_.GenerateId();
     root_client_ = std::make_unique<LayerTreeFrameSink>(
-        root_frame_sink_id,
+        &scheduler_, root_frame_sink_id,
         local_surface_id_allocator_.GetCurrentLocalSurfaceIdAllocation(),
         gfx::Rect(size_));
     root_client_->Bind(std::move(root_client_receiver),
                        std::move(frame_sink_remote));
-    EmbedChildClient(root_frame_sink_id);
+    if (base::CommandLine::ForCurrentProcess()->HasSwitch(kClientBenchmark)) {
+      RunClientBenchmarkStage(0);
+    } else if (base::CommandLine::ForCurrentProcess()->HasSwitch(
+                   kSurfaceTree)) {
+      StartSurfaceTree();
+    } else {
+      // child 的内容和窗口一样大，只显示其中 200x200 的区域
+      EmbedChildClient(root_frame_sink_id, gfx::Rect(size_),
+                       gfx::Rect(350, 350, 200, 200), /*animate=*/false);
+    }
+  }
+
+  // 添加 kClientBenchmarkStages[stage] 个持续绘制的 client，运行一段时间后
+  // 输出上一个阶段的统计结果并进入下一个阶段
+  void RunClientBenchmarkStage(size_t stage) {
+    if (stage > 0) {
+      LOG(INFO) << "ClientBenchmark: clients=" << child_clients_.size()
+                << " threads=" << scheduler_.num_threads() << " "
+                << scheduler_.TakeReport();
+    }
+    if (stage == base::size(kClientBenchmarkStages))
+      return;
+
+    const gfx::Size cell(std::max(1, size_.width() / kClientBenchmarkGrid),
+                         std::max(1, size_.height() / kClientBenchmarkGrid));
+    while (child_clients_.size() < kClientBenchmarkStages[stage]) {
+      const int index = child_clients_.size();
+      gfx::Rect rect(gfx::Point(index % kClientBenchmarkGrid * cell.width(),
+                                index / kClientBenchmarkGrid * cell.height()),
+                     cell);
+      EmbedChildClient(root_client_->frame_sink_id(), gfx::Rect(cell), rect,
+                       /*animate=*/true);
+    }
+    // 丢弃添加 client 过程中的数据
+    scheduler_.TakeReport();
+    base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+        FROM_HERE,
+        base::BindOnce(&Compositor::RunClientBenchmarkStage,
+                       base::Unretained(this), stage + 1),
+        kClientBenchmarkStageDuration);
+  }
+
+  void RequestFirstCorrectFrame() {
+    root_client_->RequestPresentationCallback(
+        base::BindOnce(&Compositor::OnFirstCorrectFramePresented,
+                       weak_factory_.GetWeakPtr(), resize_sequence_,
+                       resize_start_),
+        base::ThreadTaskRunnerHandle::Get());
+  }
+
+  void OnFirstCorrectFramePresented(int64_t sequence,
+                                    base::TimeTicks resize_start,
+                                    base::TimeTicks presentation_time) {
+    // 还没有显示正确的画面就又发生了 Resize
+    if (sequence != resize_sequence_) {
+      ++superseded_resizes_;
+      return;
+    }
+    TRACE_EVENT_INSTANT0("viz", "Compositor::FirstCorrectFrame",
+                         TRACE_EVENT_SCOPE_THREAD);
+    time_to_first_correct_frame_.Add(presentation_time - resize_start);
+  }
+
+  // 两次上屏的间隔超过 1.5 个 BeginFrame 间隔即认为掉帧
+  void OnRootFramePresented(base::TimeTicks presentation_time,
+                            base::TimeDelta interval) {
+    if (!in_resize_storm_)
+      return;
+    const base::TimeDelta jank_threshold = interval * 3 / 2;
+    if (!last_root_present_time_.is_null() &&
+        presentation_time - last_root_present_time_ > jank_threshold) {
+      ++janky_frames_;
+    }
+    ++presented_frames_;
+    last_root_present_time_ = presentation_time;
+  }
+
+  void StartSurfaceTree() {
+    std::string value =
+        base::CommandLine::ForCurrentProcess()->GetSwitchValueASCII(
+            kSurfaceTree);
+    std::vector<std::string> parts = base::SplitString(
+        value, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    if (parts.size() != 2 || !base::StringToSizeT(parts[0], &tree_depth_) ||
+        !base::StringToSizeT(parts[1], &tree_fanout_) || !tree_fanout_) {
+      LOG(ERROR) << "Invalid --" << kSurfaceTree << "=" << value
+                 << ", expected <depth>,<fanout>";
+      return;
+    }
+    root_client_->set_submit_every_frame(true);
+    tree_levels_.push_back({{root_client_.get(), size_}});
+    tree_activation_.emplace_back("SurfaceActivation");
+    RunSurfaceTreeStage();
+  }
+
+  // 输出上一层的统计结果，然后为最深一层的每个节点嵌入 fanout 个子节点
+  void RunSurfaceTreeStage() {
+    const size_t depth = tree_levels_.size() - 1;
+    if (depth > 0) {
+      size_t nodes = 0;
+      for (const auto& level : tree_levels_)
+        nodes += level.size();
+      std::string aggregate = "aggregate: not recorded";
+      if (base::HistogramBase* histogram =
+              base::StatisticsRecorder::FindHistogram(kAggregateHistogram)) {
+        std::unique_ptr<base::HistogramSamples> samples =
+            histogram->SnapshotDelta();
+        if (samples->TotalCount()) {
+          aggregate = base::StringPrintf(
+              "aggregate: n=%d mean=%.3fms", samples->TotalCount(),
+              samples->sum() / 1000.0 / samples->TotalCount());
+        }
+      }
+      LOG(INFO) << "SurfaceTree: depth=" << depth << " fanout=" << tree_fanout_
+                << " nodes=" << nodes << " "
+                << tree_activation_[depth].ToString() << " " << aggregate;
+    } else if (base::HistogramBase* histogram =
+                   base::StatisticsRecorder::FindHistogram(
+                       kAggregateHistogram)) {
+      // 丢弃构建之前的数据
+      histogram->SnapshotDelta();
+    }
+    if (depth == tree_depth_)
+      return;
+
+    const auto& parents = tree_levels_.back();
+    if (parents.size() * tree_fanout_ > kSurfaceTreeMaxNodes) {
+      LOG(WARNING) << "SurfaceTree: stop at depth " << depth << ", more than "
+                   << kSurfaceTreeMaxNodes << " nodes in the next level";
+      return;
+    }
+    // 子节点在 parent 中按网格排列，四周留出 2px 以便看到嵌套关系
+    const int columns = std::ceil(std::sqrt(tree_fanout_));
+    const int rows = (tree_fanout_ + columns - 1) / columns;
+    std::vector<SurfaceTreeNode> children;
+    tree_activation_.emplace_back("SurfaceActivation");
+    for (const auto& parent : parents) {
+      const gfx::Size cell(std::max(1, parent.size.width() / columns),
+                           std::max(1, parent.size.height() / rows));
+      for (size_t i = 0; i < tree_fanout_; ++i) {
+        gfx::Rect rect(gfx::Point(i % columns * cell.width(),
+                                  i / columns * cell.height()),
+                       cell);
+        rect.Inset(2, 2);
+        if (rect.IsEmpty())
+          rect.set_size(gfx::Size(1, 1));
+        children.push_back(
+            {EmbedTreeNode(parent.sink, rect, depth + 1), rect.size()});
+      }
+    }
+    tree_levels_.push_back(std::move(children));
+    base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+        FROM_HERE,
+        base::BindOnce(&Compositor::RunSurfaceTreeStage,
+                       base::Unretained(this)),
+        kSurfaceTreeStageDuration);
   }
 
-  void EmbedChildClient(viz::FrameSinkId parent_frame_sink_id) {
+  // 嵌入一个 surface tree 节点，每个节点由 ClientScheduler 分配到其中一个线程
+  LayerTreeFrameSink* EmbedTreeNode(LayerTreeFrameSink* parent,
+                                    const gfx::Rect& rect,
+                                    size_t level) {
+    viz::FrameSinkId frame_sink_id = frame_sink_id_allocator_.NextFrameSinkId();
+    host_frame_sink_manager_.RegisterFrameSinkId(
+        frame_sink_id, this, viz::ReportFirstSurfaceActivation::kYes);
+    host_frame_sink_manager_.RegisterFrameSinkHierarchy(parent->frame_sink_id(),
+                                                        frame_sink_id);
+
+    mojo::PendingRemote<viz::mojom::CompositorFrameSink> frame_sink_remote;
+    auto frame_sink_receiver =
+        frame_sink_remote.InitWithNewPipeAndPassReceiver();
+    mojo::PendingRemote<viz::mojom::CompositorFrameSinkClient> client_remote;
+    mojo::PendingReceiver<viz::mojom::CompositorFrameSinkClient>
+        client_receiver = client_remote.InitWithNewPipeAndPassReceiver();
+    host_frame_sink_manager_.CreateCompositorFrameSink(
+        frame_sink_id, std::move(frame_sink_receiver),
+        std::move(client_remote));
+
+    tree_embed_times_[frame_sink_id] = {level, base::TimeTicks::Now()};
+    auto local_surface_id = parent->EmbedChild(frame_sink_id, rect);
+    surface_parents_[frame_sink_id] = parent;
+    auto node = std::make_unique<LayerTreeFrameSink>(
+        &scheduler_, frame_sink_id, local_surface_id,
+        gfx::Rect(rect.size()));
+    node->set_submit_every_frame(true);
+    node->Bind(std::move(client_receiver), std::move(frame_sink_remote));
+    LayerTreeFrameSink* result = node.get();
+    tree_nodes_.push_back(std::move(node));
+    return result;
+  }
+
+  // bounds 为 child 自身的大小，rect 为 child 在 root 中的位置
+  void EmbedChildClient(viz::FrameSinkId parent_frame_sink_id,
+                        const gfx::Rect& bounds,
+                        const gfx::Rect& rect,
+                        bool animate) {
     // 创建 child 的 FrameSinkId
     viz::FrameSinkId frame_sink_id = frame_sink_id_allocator_.NextFrameSinkId();
     // uint64_t rand = base::RandUint64();
     // viz::FrameSinkId frame_sink_id(rand >> 32, rand & 0xffffffff);
 
-    // 注册 child client 的 FrameSinkId
+    // 注册 child client 的 FrameSinkId，Resize 时需要知道 child 的新 surface
+    // 何时激活
     host_frame_sink_manager_.RegisterFrameSinkId(
-        frame_sink_id, this, viz::ReportFirstSurfaceActivation::kNo);
+        frame_sink_id, this, viz::ReportFirstSurfaceActivation::kYes);
     host_frame_sink_manager_.RegisterFrameSinkHierarchy(parent_frame_sink_id,
                                                         frame_sink_id);
 
@@ -1123,11 +2879,15 @@ class Compositor : public viz::HostFrameSinkClient {
         frame_sink_id, std::move(frame_sink_receiver),
         std::move(client_remote));
 
-    auto child_local_surface_id = root_client_->EmbedChild(frame_sink_id);
-    child_client_ = std::make_unique<InkClient>(
-        frame_sink_id, child_local_surface_id, gfx::Rect(size_));
-    child_client_->Bind(std::move(client_receiver),
-                        std::move(frame_sink_remote));
+    auto child_local_surface_id =
+        root_client_->EmbedChild(frame_sink_id, rect);
+    surface_parents_[frame_sink_id] = root_client_.get();
+    auto child_client = std::make_unique<InkClient>(
+        &scheduler_, frame_sink_id, child_local_surface_id, bounds, animate);
+    child_client->Bind(std::move(client_receiver),
+                       std::move(frame_sink_remote));
+    child_clients_.push_back(std::move(child_client));
+    child_bounds_.push_back(bounds);
   }
 
   gfx::AcceleratedWidget widget_;
@@ -1138,9 +2898,47 @@ class Compositor : public viz::HostFrameSinkClient {
   viz::ParentLocalSurfaceIdAllocator local_surface_id_allocator_;
   std::unique_ptr<viz::HostDisplayClient> display_client_;
   mojo::AssociatedRemote<viz::mojom::DisplayPrivate> display_private_;
+  // 需要比所有 client 活得更久
+  ClientScheduler scheduler_;
   std::unique_ptr<LayerTreeFrameSink> root_client_;
-  std::unique_ptr<InkClient> child_client_;
+  std::vector<std::unique_ptr<InkClient>> child_clients_;
   scoped_refptr<viz::ContextProvider> main_context_provider_;
+
+  // --surface-tree 相关的状态，只在主线程中访问
+  struct SurfaceTreeNode {
+    LayerTreeFrameSink* sink;
+    gfx::Size size;
+  };
+  size_t tree_depth_ = 0;
+  size_t tree_fanout_ = 0;
+  std::vector<std::unique_ptr<LayerTreeFrameSink>> tree_nodes_;
+  // tree_levels_[0] 为 root
+  std::vector<std::vector<SurfaceTreeNode>> tree_levels_;
+  // 每一层 surface 的首次激活延迟
+  std::vector<LatencyRecorder> tree_activation_;
+  // 尚未激活的节点的层级及嵌入时间
+  base::flat_map<viz::FrameSinkId, std::pair<size_t, base::TimeTicks>>
+      tree_embed_times_;
+
+  // Resize 相关的状态，只在主线程中访问
+  // child_clients_ 中每个 child 自身的大小
+  std::vector<gfx::Rect> child_bounds_;
+  // 还没有使用新 LocalSurfaceId 提交 CF 的 child
+  base::flat_map<viz::FrameSinkId, viz::LocalSurfaceId>
+      pending_resize_children_;
+  // 每个被嵌入的 frame sink 的 parent，surface 激活时更新 parent 中的 fallback
+  base::flat_map<viz::FrameSinkId, LayerTreeFrameSink*> surface_parents_;
+  base::TimeTicks resize_start_;
+  int64_t resize_sequence_ = 0;
+  int64_t resize_count_ = 0;
+  int64_t superseded_resizes_ = 0;
+  LatencyRecorder time_to_first_correct_frame_{"TimeToFirstCorrectFrame"};
+  bool in_resize_storm_ = false;
+  base::TimeTicks last_root_present_time_;
+  int64_t presented_frames_ = 0;
+  int64_t janky_frames_ = 0;
+
+  base::WeakPtrFactory<Compositor> weak_factory_{this};
 };
 
 // Service 端
@@ -1600,11 +3398,56 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
     service_ = std::make_unique<GpuService>(
         std::move(frame_sink_manager_receiver),
         std::move(frame_sink_manager_client), host_.get());
+
+    if (base::CommandLine::ForCurrentProcess()->HasSwitch(kResizeStorm)) {
+      // 等待第一帧显示之后再开始
+      base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+          FROM_HERE,
+          base::BindOnce(&DemoVizWindow::StartResizeStorm,
+                         weak_factory_.GetWeakPtr()),
+          base::TimeDelta::FromSeconds(2));
+    }
+  }
+
+  // 每 16ms 改变一次窗口大小，模拟用户拖动窗口边框
+  void StartResizeStorm() {
+    storm_origin_bounds_ = platform_window_->GetBounds();
+    resize_storm_step_ = 0;
+    host_->BeginResizeStorm();
+    ResizeStormStep();
+  }
+
+  void ResizeStormStep() {
+    if (resize_storm_step_ == kResizeStormSteps) {
+      platform_window_->SetBounds(storm_origin_bounds_);
+      // 等待最后几次 Resize 的画面上屏
+      base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+          FROM_HERE,
+          base::BindOnce(&Compositor::EndResizeStorm,
+                         base::Unretained(host_.get())),
+          base::TimeDelta::FromSeconds(1));
+      return;
+    }
+    // 宽高在原始大小的基础上按 ±25% 来回变化
+    const int phase = resize_storm_step_ % 20;
+    const int offset = phase < 10 ? phase : 20 - phase;
+    gfx::Rect bounds = storm_origin_bounds_;
+    bounds.set_size(gfx::Size(
+        storm_origin_bounds_.width() * (75 + offset * 5) / 100,
+        storm_origin_bounds_.height() * (75 + offset * 5) / 100));
+    platform_window_->SetBounds(bounds);
+    ++resize_storm_step_;
+    base::ThreadTaskRunnerHandle::Get()->PostDelayedTask(
+        FROM_HERE,
+        base::BindOnce(&DemoVizWindow::ResizeStormStep,
+                       weak_factory_.GetWeakPtr()),
+        kResizeStormInterval);
   }
 
   // ui::PlatformWindowDelegate:
   void OnBoundsChanged(const gfx::Rect& new_bounds) override {
-    host_->Resize(new_bounds.size());
+    if (host_)
+      host_->Resize(new_bounds.size());
   }
 
   void OnAcceleratedWidgetAvailable(gfx::AcceleratedWidget widget) override {
@@ -1622,6 +3465,8 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
     // host_.reset();
   }
   void OnClosed() override {
+    if (host_)
+      host_->LogInputLatencyReport();
     if (close_closure_)
       std::move(close_closure_).Run();
   }
@@ -1638,6 +3483,11 @@ class DemoVizWindow : public ui::PlatformWindowDelegate {
   gfx::AcceleratedWidget widget_;
   base::OnceClosure close_closure_;
 
+  gfx::Rect storm_origin_bounds_;
+  int resize_storm_step_ = 0;
+
+  base::WeakPtrFactory<DemoVizWindow> weak_factory_{this};
+
   DISALLOW_COPY_AND_ASSIGN(DemoVizWindow);
 };
 
@@ -1650,10 +3500,25 @@ int main(int argc, char** argv) {
   base::CommandLine::Init(argc, argv);
   // 设置日志格式
   logging::SetLogItems(true, true, true, false);
+  // I420 回读只能写入文件，不能静默地忽略 --readback-sink=shm
+  if (base::CommandLine::ForCurrentProcess()->GetSwitchValueASCII(
+          demo::kReadbackFormat) == "i420" &&
+      base::CommandLine::ForCurrentProcess()->GetSwitchValueASCII(
+          demo::kReadbackSink) == "shm") {
+    LOG(ERROR) << "--readback-format=i420 can not be used with "
+                  "--readback-sink=shm";
+    return 1;
+  }
+  // --readback-sink=shm 启动的读取子进程，不能和主进程写同一个 trace 文件
+  const bool is_readback_reader =
+      base::CommandLine::ForCurrentProcess()->HasSwitch(
+          demo::kReadbackShmReader);
   // 启动 Trace
-  demo::InitTrace("./trace_demo_viz_layer.json");
-  demo::StartTrace(
-      "viz,gpu,shell,ipc,mojom,skia,disabled-by-default-toplevel.flow");
+  if (!is_readback_reader) {
+    demo::InitTrace("./trace_demo_viz_layer.json");
+    demo::StartTrace(
+        "viz,gpu,shell,ipc,mojom,skia,disabled-by-default-toplevel.flow");
+  }
   // 创建主消息循环，等价于 MessagLoop
   base::SingleThreadTaskExecutor main_task_executor(base::MessagePumpType::UI);
   // 初始化线程池，会创建新的线程，在新的线程中会创建新消息循环MessageLoop
@@ -1698,6 +3563,13 @@ int main(int argc, char** argv) {
 
   base::RunLoop run_loop;
 
+  if (is_readback_reader) {
+    logging::SetLogPrefix("readback-reader");
+    demo::SharedMemoryReadbackReader reader(run_loop.QuitClosure());
+    run_loop.Run();
+    return 0;
+  }
+
   auto use_gl = base::CommandLine::ForCurrentProcess()->GetSwitchValueASCII(
       switches::kUseGL);
   g_use_gpu = use_gl != gl::kGLImplementationSwiftShaderForWebGLName &&
@@ -5,7 +5,7 @@
  * 需要先在src中应用 0001 号 patch，否则无法看到效果。
  *  cd src
  *  git am
- * demo/patches/0001-demo_viz_layer_offscreen-add-GetOffscreenTextureId.patch
+ * demo/patches/0001-viz-export-offscreen-textures-through-DisplayClient.patch
  */
 
 #include "base/at_exit.h"
@@ -51,6 +51,7 @@
 #include "components/viz/demo/host/demo_host.h"
 #include "components/viz/demo/service/demo_service.h"
 #include "components/viz/host/gpu_host_impl.h"
+#include "components/viz/host/host_display_client.h"
 #include "components/viz/host/host_frame_sink_manager.h"
 #include "components/viz/host/host_gpu_memory_buffer_manager.h"
 #include "components/viz/host/renderer_settings_creation.h"
@@ -991,6 +992,41 @@ class LayerTreeFrameSink : public viz::mojom::CompositorFrameSinkClient {
   std::unique_ptr<viz::ClientResourceProvider> client_resource_provider_;
 };
 
+// 接收 viz 离屏渲染的结果。
+// SkiaOutputDeviceOffscreen 每次 SwapBuffers 之后通过 DisplayClient 把刚刚画完
+// 的 texture 和对应的 GL fence 发送过来，不需要轮询。
+// 绘制完成之后通过 callback 把 texture 还给 viz，在此之前 viz 不会再向这个
+// texture 绘制，也不会删除它。
+class OffscreenDisplayClient : public viz::HostDisplayClient {
+ public:
+  OffscreenDisplayClient() : viz::HostDisplayClient(/*widget_*/ 0) {}
+
+#ifdef VIZ_DISPLAY_CLIENT_OFFSCREEN_TEXTURE
+  void DidSwapOffscreenTexture(
+      uint32_t texture_id,
+      uint64_t gl_fence,
+      const gfx::Size& size,
+      DidSwapOffscreenTextureCallback callback) override {
+    TRACE_EVENT1("viz", "OffscreenDisplayClient::DidSwapOffscreenTexture",
+                 "texture_id", texture_id);
+    // Redraw 在 GPU 线程执行，mojo 的 reply 需要回到当前线程调用
+    auto release_callback = base::BindOnce(
+        [](scoped_refptr<base::SingleThreadTaskRunner> task_runner,
+           DidSwapOffscreenTextureCallback callback, uint64_t release_fence) {
+          task_runner->PostTask(
+              FROM_HERE, base::BindOnce(std::move(callback), release_fence));
+        },
+        base::ThreadTaskRunnerHandle::Get(), std::move(callback));
+    Redraw(texture_id, gl_fence, size, std::move(release_callback));
+  }
+#else
+#pragma message "PATCH NOT APPLIED: demo/patches/0001-*.patch"
+#endif  // VIZ_DISPLAY_CLIENT_OFFSCREEN_TEXTURE
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(OffscreenDisplayClient);
+};
+
 // Host 端
 // 在 Chromium 中，Compositor 实现了 HostFrameSinkClient 接口，这里模拟 Chromium
 // 中的命名。
@@ -1039,8 +1075,8 @@ class Compositor : public viz::HostFrameSinkClient {
   void OnFrameTokenChanged(uint32_t frame_token) override {
     TRACE_EVENT0("viz", "Compositor::OnFrameTokenChanged");
     // DLOG(INFO) << __FUNCTION__;
-    // 直接从 SkiaOutputDeviceOffscreen 获取底层Texture进行渲染，性能较好
-    Redraw();
+    // 直接从 SkiaOutputDeviceOffscreen 获取底层Texture进行渲染，性能较好，
+    // 由 OffscreenDisplayClient 在每次 SwapBuffers 之后驱动
     return;
     // 使用 CopyOutput 接口获取最终的渲染画面，性能不佳
     if (g_use_gpu) {
@@ -1068,7 +1104,7 @@ class Compositor : public viz::HostFrameSinkClient {
       mojo::PendingRemote<viz::mojom::FrameSinkManager> manager) {
     host_frame_sink_manager_.BindAndSetManager(std::move(client), nullptr,
                                                std::move(manager));
-    display_client_ = std::make_unique<viz::HostDisplayClient>(/*widget_*/ 0);
+    display_client_ = std::make_unique<OffscreenDisplayClient>();
 
     // 创建 root client 的 FrameSinkId
     viz::FrameSinkId root_frame_sink_id =
@@ -1216,7 +1252,7 @@ class Compositor : public viz::HostFrameSinkClient {
   // base::Thread compositor_thread_;
   viz::FrameSinkIdAllocator frame_sink_id_allocator_{0};
   viz::ParentLocalSurfaceIdAllocator local_surface_id_allocator_;
-  std::unique_ptr<viz::HostDisplayClient> display_client_;
+  std::unique_ptr<OffscreenDisplayClient> display_client_;
   mojo::AssociatedRemote<viz::mojom::DisplayPrivate> display_private_;
   std::unique_ptr<LayerTreeFrameSink> root_client_;
   std::unique_ptr<InkClient> child_client_;
@@ -84,13 +84,18 @@ void InitHostMain(gfx::AcceleratedWidget widget,
   g_gl_surface->SwapBuffers(base::DoNothing());
 }
 
-void Redraw() {
+void Redraw(uint32_t texture_id,
+            uint64_t gl_fence,
+            const gfx::Size& size,
+            ReleaseTextureCallback release_callback) {
   if (!g_gpu_task_runner->BelongsToCurrentThread()) {
-    g_gpu_task_runner->PostTask(FROM_HERE, base::BindOnce(&Redraw));
+    g_gpu_task_runner->PostTask(
+        FROM_HERE, base::BindOnce(&Redraw, texture_id, gl_fence, size,
+                                  std::move(release_callback)));
     return;
   }
 
-  TRACE_EVENT0("viz", "Redraw");
+  TRACE_EVENT1("viz", "Redraw", "texture_id", texture_id);
 #ifndef GL_RGBA8
 #define GL_RGBA8 0x8058
 #endif
@@ -116,24 +121,28 @@ void Redraw() {
       gr_context, backendRT, kTopLeft_GrSurfaceOrigin, kRGBA_8888_SkColorType,
       nullptr, &props);
   auto* canvas = skSurface->getCanvas();
-  static unsigned int i = 0;
-  canvas->clear(SK_ColorYELLOW + i++);
+  // texture 覆盖整个窗口时直接使用 kSrc 绘制，不需要先清空整个窗口
+  if (size.width() < g_size_.width() || size.height() < g_size_.height())
+    canvas->clear(SK_ColorYELLOW);
 
-#ifdef VIZ_GETOFFSCREENTEXTUREID
-  auto texture_id = viz::GetOffscreenTextureId();
-  if (texture_id) {
-    GrGLTextureInfo textureInfo = {GR_GL_TEXTURE_2D, texture_id, GR_GL_RGBA8};
-    GrBackendTexture backendTexture(g_size_.width(), g_size_.height(),
-                                    GrMipMapped::kNo, textureInfo);
-    sk_sp<SkImage> image = SkImage::MakeFromTexture(
-        canvas->getGrContext(), backendTexture, kBottomLeft_GrSurfaceOrigin,
-        kRGBA_8888_SkColorType, kPremul_SkAlphaType, nullptr);
-    canvas->drawImage(image, 0, 0);
-  }
-#else
-#pragma message "PATCH NOT APPLIED: demo/patches/0001-*.patch"
-#endif // VIZ_GETOFFSCREENTEXTUREID
+  // 等待 viz 在 texture 上的绘制完成，这是 GPU 端的等待，不会阻塞当前线程。
+  // fence 由 viz 在 texture 被归还之后删除
+  if (gl_fence)
+    glWaitSync(reinterpret_cast<GLsync>(gl_fence), 0, GL_TIMEOUT_IGNORED);
+  GrGLTextureInfo textureInfo = {GR_GL_TEXTURE_2D, texture_id, GR_GL_RGBA8};
+  GrBackendTexture backendTexture(size.width(), size.height(),
+                                  GrMipMapped::kNo, textureInfo);
+  sk_sp<SkImage> image = SkImage::MakeFromTexture(
+      canvas->getGrContext(), backendTexture, kBottomLeft_GrSurfaceOrigin,
+      kRGBA_8888_SkColorType, kPremul_SkAlphaType, nullptr);
+  SkPaint paint;
+  paint.setBlendMode(SkBlendMode::kSrc);
+  canvas->drawImage(image, 0, 0, &paint);
 
   skSurface->flush();
+  // viz 在下一次向这个 texture 绘制之前等待这个 fence，保证读取已经完成
+  GLsync release_fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  glFlush();
+  std::move(release_callback).Run(reinterpret_cast<uint64_t>(release_fence));
   g_gl_surface->SwapBuffers(base::DoNothing());
 }
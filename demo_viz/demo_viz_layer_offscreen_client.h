@@ -1,6 +1,7 @@
 #ifndef DEMO_DEMO_VIZ_DEMO_VIZ_LAYER_OFFSCREEN_CLIENT_H
 #define DEMO_DEMO_VIZ_DEMO_VIZ_LAYER_OFFSCREEN_CLIENT_H
 
+#include "base/callback.h"
 #include "gpu/command_buffer/service/shared_context_state.h"
 #include "gpu/config/gpu_preferences.h"
 #include "ui/gfx/geometry/size.h"
@@ -12,6 +13,16 @@ void InitHostMain(gfx::AcceleratedWidget widget,
                   gfx::Size size,
                   viz::GpuServiceImpl* gpu_service);
 
-void Redraw();
+// 参数为读取 texture 之后创建的 GLsync，所有权转移给 viz
+using ReleaseTextureCallback = base::OnceCallback<void(uint64_t release_fence)>;
+
+// 把 viz 离屏渲染的 texture 绘制到窗口中，可以在任意线程调用。
+// texture_id 和 gl_fence 来自 DisplayClient::DidSwapOffscreenTexture，
+// 和 InitHostMain 创建的 GL context 处于同一个 share group。gl_fence 属于 viz，
+// 这里只等待不删除。绘制完成之后在 GPU 线程调用 release_callback 归还 texture。
+void Redraw(uint32_t texture_id,
+            uint64_t gl_fence,
+            const gfx::Size& size,
+            ReleaseTextureCallback release_callback);
 
 #endif  // DEMO_DEMO_VIZ_DEMO_VIZ_LAYER_OFFSCREEN_CLIENT_H
\ No newline at end of file
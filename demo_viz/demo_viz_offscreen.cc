@@ -1,44 +1,86 @@
+#include <algorithm>
+#include <cmath>
+
 #include "base/at_exit.h"
+#include "base/atomicops.h"
+#include "base/barrier_closure.h"
 #include "base/callback.h"
 #include "base/command_line.h"
+#include "base/files/file.h"
 #include "base/files/file_path.h"
+#include "base/files/file_util.h"
 #include "base/i18n/icu_util.h"
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/memory/ptr_util.h"
 #include "base/message_loop/message_loop.h"
 #include "base/message_loop/message_pump_type.h"
+#include "base/metrics/histogram_base.h"
+#include "base/metrics/histogram_samples.h"
+#include "base/metrics/statistics_recorder.h"
+#include "base/memory/read_only_shared_memory_region.h"
+#include "base/numerics/ranges.h"
 #include "base/path_service.h"
 #include "base/power_monitor/power_monitor.h"
 #include "base/power_monitor/power_monitor_device_source.h"
+#include "base/process/launch.h"
 #include "base/run_loop.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/strings/string_split.h"
+#include "base/strings/stringprintf.h"
+#include "base/system/sys_info.h"
+#include "base/task/post_task.h"
 #include "base/task/single_thread_task_executor.h"
 #include "base/task/thread_pool/thread_pool_instance.h"
 #include "base/test/task_environment.h"
 #include "base/test/test_discardable_memory_allocator.h"
 #include "base/test/test_timeouts.h"
+#include "base/synchronization/waitable_event.h"
 #include "base/threading/thread.h"
+#include "base/threading/thread_task_runner_handle.h"
 #include "build/build_config.h"
 #include "build/buildflag.h"
+#include "cc/paint/display_item_list.h"
+#include "cc/paint/paint_flags.h"
+#include "cc/paint/paint_op_buffer.h"
+#include "components/viz/common/quads/picture_draw_quad.h"
+#include "components/viz/common/quads/render_pass_draw_quad.h"
 #include "components/viz/common/quads/solid_color_draw_quad.h"
+#include "components/viz/common/quads/texture_draw_quad.h"
+#include "components/viz/common/quads/tile_draw_quad.h"
+#include "components/viz/common/resources/bitmap_allocation.h"
+#include "components/viz/common/resources/shared_bitmap.h"
 #include "components/viz/demo/host/demo_host.h"
 #include "components/viz/demo/service/demo_service.h"
 #include "components/viz/host/host_frame_sink_manager.h"
 #include "components/viz/host/renderer_settings_creation.h"
+#include "components/viz/common/frame_sinks/begin_frame_source.h"
 #include "components/viz/service/display/display.h"
 #include "components/viz/service/display/software_output_device.h"
 #include "components/viz/service/display_embedder/output_surface_provider.h"
 #include "components/viz/service/display_embedder/server_shared_bitmap_manager.h"
+#include "components/viz/service/display_embedder/skia_output_surface_dependency_impl.h"
+#include "components/viz/service/display_embedder/skia_output_surface_impl.h"
 #include "components/viz/service/display_embedder/software_output_surface.h"
 #include "components/viz/service/frame_sinks/frame_sink_manager_impl.h"
 #include "components/viz/service/main/viz_compositor_thread_runner_impl.h"
+#include "components/viz/test/test_gpu_service_holder.h"
+#include "demo/common/latency_recorder.h"
+#include "demo/demo_viz/y4m_writer.h"
 #include "mojo/core/embedder/embedder.h"
 #include "mojo/core/embedder/scoped_ipc_support.h"
 #include "mojo/public/cpp/bindings/pending_receiver.h"
 #include "mojo/public/cpp/bindings/pending_remote.h"
+#include "mojo/public/cpp/platform/platform_channel.h"
+#include "mojo/public/cpp/system/invitation.h"
+#include "mojo/public/cpp/system/message_pipe.h"
+#include "mojo/public/cpp/system/platform_handle.h"
+#include "mojo/public/cpp/system/simple_watcher.h"
 #include "services/viz/privileged/mojom/viz_main.mojom.h"
+#include "third_party/libyuv/include/libyuv/convert.h"
 #include "third_party/skia/include/core/SkImageEncoder.h"
 #include "third_party/skia/include/core/SkStream.h"
+#include "third_party/skia/include/core/SkSurface.h"
 #include "ui/base/hit_test.h"
 #include "ui/base/ime/init/input_method_initializer.h"
 #include "ui/base/material_design/material_design_controller.h"
@@ -55,6 +97,8 @@
 #include "ui/gfx/geometry/rect.h"
 #include "ui/gfx/native_widget_types.h"
 #include "ui/gfx/skia_util.h"
+#include "ui/gfx/swap_result.h"
+#include "ui/gl/gl_implementation.h"
 #include "ui/gl/gl_switches.h"
 #include "ui/gl/init/gl_factory.h"
 #include "ui/platform_window/platform_window.h"
@@ -83,17 +127,475 @@
 
 namespace demo {
 
+namespace {
+// 录制模式的命令行参数：
+// --capture-format=png|raw|y4m 开启录制，每一帧都交给线程池编码
+// --capture-dir=<dir>          输出目录，默认为可执行文件所在目录
+// --capture-workers=<n>        编码线程数，默认为 CPU 核数（最多4个）
+// --capture-max-pending=<n>    最多允许多少帧排队等待编码，超出则丢帧
+constexpr char kCaptureFormat[] = "capture-format";
+constexpr char kCaptureDir[] = "capture-dir";
+constexpr char kCaptureWorkers[] = "capture-workers";
+constexpr char kCaptureMaxPending[] = "capture-max-pending";
+// 录制统计信息的输出间隔
+constexpr base::TimeDelta kStatsReportInterval =
+    base::TimeDelta::FromSeconds(1);
+// --export-shm 将画面直接渲染到共享内存中，并启动一个 consumer 子进程读取
+constexpr char kExportShm[] = "export-shm";
+// consumer 子进程的标记，由 producer 自动添加
+constexpr char kShmConsumer[] = "shm-consumer";
+constexpr char kShmPipeName[] = "demo_viz_offscreen_frames";
+// benchmark 相关的命令行参数：
+// --fps=<n>      BeginFrame 的频率，0 表示不限帧率（BackToBackBeginFrameSource）
+// --size=<WxH>   离屏画面的大小，默认 300x200
+// --frames=<n>   渲染 n 帧之后退出，并输出每个阶段耗时的分位数
+constexpr char kFps[] = "fps";
+constexpr char kSize[] = "size";
+constexpr char kFrames[] = "frames";
+// --renderer=software|skia|both 选择 viz 使用的 Renderer，both 会依次使用两种
+// Renderer 运行相同的帧，然后输出对比结果。skia 使用 SkiaOutputSurfaceImpl
+// 进行离屏渲染，没有 GPU 的机器上默认使用 SwiftShader。
+constexpr char kRenderer[] = "renderer";
+// 依次运行多组 benchmark（both 或者多个 --stress-quads）时，未指定 --frames
+// 时每组渲染的帧数
+constexpr int kDefaultCompareFrames = 300;
+// 压力测试模式的命令行参数，用于观察 SurfaceAggregator 和 overdraw 随 quad
+// 数量增长的变化：
+// --stress-quads=<m>[,<m>...]  每个 RenderPass 中的 quad 数量，多个值会依次运行
+//                              并输出对比结果，例如 10,100,1000,10000
+// --stress-passes=<n>          RenderPass 数量，默认 1，非 root 的 RenderPass
+//                              通过 RenderPassDrawQuad 画到 root 上
+// --stress-overdraw=<x>        每个 RenderPass 中 quad 面积之和与画面面积之比，
+//                              默认 1.0，越大 quad 之间的重叠越多
+// --stress-opacity=<a>         每个 quad 的透明度，默认 1.0
+// --stress-transform           给每个 quad 加上旋转和缩放
+// --stress-rounded-corner=<r>  给每个 quad 加上半径为 r 的圆角裁剪
+constexpr char kStressQuads[] = "stress-quads";
+constexpr char kStressPasses[] = "stress-passes";
+constexpr char kStressOverdraw[] = "stress-overdraw";
+constexpr char kStressOpacity[] = "stress-opacity";
+constexpr char kStressTransform[] = "stress-transform";
+constexpr char kStressRoundedCorner[] = "stress-rounded-corner";
+// Display::DrawAndSwap 中记录的 SurfaceAggregator::Aggregate 耗时，
+// viz 运行在同一个进程中，可以直接从 StatisticsRecorder 中读取
+constexpr char kAggregateHistogram[] =
+    "Compositing.SurfaceAggregator.AggregateUs";
+
+gfx::Size ParseSize(const std::string& value, const gfx::Size& default_size) {
+  std::vector<base::StringPiece> parts = base::SplitStringPiece(
+      value, "x", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+  int width = 0;
+  int height = 0;
+  if (parts.size() != 2 || !base::StringToInt(parts[0], &width) ||
+      !base::StringToInt(parts[1], &height) || width <= 0 || height <= 0) {
+    return default_size;
+  }
+  return gfx::Size(width, height);
+}
+
+// 读取当前进程的常驻内存(VmRSS)以及峰值(VmHWM)，单位 KB，仅支持 Linux
+void ReadProcessMemoryKb(int64_t* rss_kb, int64_t* peak_rss_kb) {
+  *rss_kb = 0;
+  *peak_rss_kb = 0;
+  std::string status;
+  if (!base::ReadFileToString(base::FilePath("/proc/self/status"), &status))
+    return;
+  for (const auto& line : base::SplitStringPiece(
+           status, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    std::vector<base::StringPiece> fields = base::SplitStringPiece(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    if (fields.size() < 2)
+      continue;
+    if (fields[0] == "VmRSS:")
+      base::StringToInt64(fields[1], rss_kb);
+    else if (fields[0] == "VmHWM:")
+      base::StringToInt64(fields[1], peak_rss_kb);
+  }
+}
+
+// VmHWM 是整个进程的峰值，依次运行多个 renderer 时需要在每次运行前重置，
+// 否则后面的结果会包含前面的峰值。写入 5 到 clear_refs 会把 VmHWM 重置为
+// 当前的 VmRSS（Linux 4.0+）
+bool ResetPeakRss() {
+  constexpr char kResetPeakRss[] = "5";
+  return base::WriteFile(base::FilePath("/proc/self/clear_refs"),
+                         kResetPeakRss, sizeof(kResetPeakRss) - 1) ==
+         sizeof(kResetPeakRss) - 1;
+}
+}  // namespace
+
+enum class RendererType { kSoftware, kSkia };
+
+// 一次 benchmark 的结果，在 display 线程中填写，benchmark 结束后在主线程中读取
+struct BenchmarkResult {
+  std::string renderer;
+  // 对比结果中每一列的标题，例如 SoftwareRenderer/1000
+  std::string label;
+  int frames = 0;
+  double fps = 0;
+  LatencyRecorder create_frame{"CreateFrame"};
+  // SurfaceAggregator::Aggregate 本身的耗时，不包含调度时间
+  LatencyRecorder aggregate{"Aggregate"};
+  LatencyRecorder draw{"Draw"};
+  LatencyRecorder swap{"Swap"};
+  LatencyRecorder frame{"BeginFrameToSwap"};
+  // viz 收到 CF 到画面呈现（presentation feedback）的时间，包含 GPU 线程中
+  // 异步执行的工作，可以用来对比 SkiaRenderer 和 SoftwareRenderer
+  LatencyRecorder present{"Present"};
+  int64_t rss_start_kb = 0;
+  int64_t rss_end_kb = 0;
+  // 无法重置 VmHWM 时为 -1，因为峰值可能来自之前运行的 renderer
+  int64_t peak_rss_kb = 0;
+};
+
+// OutputDevice 和 OffscreenRenderer 共同填写，用于统计每一帧各个阶段的耗时，
+// 只在 display 线程中访问
+struct FrameTiming {
+  // SubmitCompositorFrame 返回的时间
+  base::TimeTicks submit_end;
+  // Surface 聚合完毕，准备开始绘制的时间（DisplayWillDrawAndSwap）
+  base::TimeTicks draw_begin;
+  // 绘制完毕，开始 SwapBuffers 的时间
+  base::TimeTicks swap_begin;
+};
+
+// 将 OnSwapBuffers 拿到的每一帧交给线程池进行编码和写文件，
+// display 线程只做一次像素拷贝，不会被 PNG 压缩或者磁盘 IO 阻塞。
+// 当排队的帧数超过上限时直接丢弃新帧（back-pressure），并统计丢帧数。
+class FrameCapturer {
+ public:
+  enum class Format { kPNG, kRaw, kY4M };
+
+  FrameCapturer(Format format,
+                const base::FilePath& dir,
+                int workers,
+                int max_pending,
+                double fps)
+      : format_(format), dir_(dir), max_pending_(max_pending), fps_(fps) {
+    // y4m 是单个文件流，帧必须按顺序写入，所以只能使用一个 sequence
+    if (format_ == Format::kY4M) {
+      workers = 1;
+      y4m_writer_ = std::make_unique<Y4mWriter>(
+          dir_.AppendASCII("demo_viz.y4m"), "FrameCapturer");
+    }
+    metadata_task_runner_ = base::CreateSequencedTaskRunner(
+        {base::ThreadPool(), base::MayBlock(),
+         base::TaskPriority::USER_VISIBLE,
+         base::TaskShutdownBehavior::BLOCK_SHUTDOWN});
+    metadata_file_ = std::make_unique<base::File>(
+        dir_.AppendASCII("demo_viz_damage.txt"),
+        base::File::FLAG_CREATE_ALWAYS | base::File::FLAG_WRITE);
+    for (int i = 0; i < workers; ++i) {
+      task_runners_.push_back(base::CreateSequencedTaskRunner(
+          {base::ThreadPool(), base::MayBlock(),
+           base::TaskPriority::USER_VISIBLE,
+           base::TaskShutdownBehavior::BLOCK_SHUTDOWN}));
+    }
+    LOG(INFO) << "FrameCapturer: format=" << FormatName(format_)
+              << " dir=" << dir_ << " workers=" << workers
+              << " max_pending=" << max_pending_;
+  }
+
+  // 线程池中的任务通过 Unretained 引用了 FrameCapturer 的成员，
+  // 所以析构时必须先等待它们全部执行完毕
+  ~FrameCapturer() {
+    WaitForPendingTasks();
+    ReportStats();
+  }
+
+  static std::unique_ptr<FrameCapturer> CreateFromCommandLine(double fps) {
+    const base::CommandLine* command_line =
+        base::CommandLine::ForCurrentProcess();
+    if (!command_line->HasSwitch(kCaptureFormat))
+      return nullptr;
+
+    Format format = Format::kPNG;
+    std::string format_name = command_line->GetSwitchValueASCII(kCaptureFormat);
+    if (format_name == "raw") {
+      format = Format::kRaw;
+    } else if (format_name == "y4m") {
+      format = Format::kY4M;
+    } else if (format_name != "png") {
+      LOG(ERROR) << "Unknown capture format: " << format_name
+                 << ", fallback to png";
+    }
+
+    base::FilePath dir = command_line->GetSwitchValuePath(kCaptureDir);
+    if (dir.empty() &&
+        !base::PathService::Get(base::BasePathKey::DIR_EXE, &dir)) {
+      LOG(ERROR) << "Failed to get DIR_EXE";
+      return nullptr;
+    }
+    if (!base::CreateDirectory(dir)) {
+      LOG(ERROR) << "Failed to create capture dir: " << dir;
+      return nullptr;
+    }
+
+    int workers = std::min(base::SysInfo::NumberOfProcessors(), 4);
+    int max_pending = 8;
+    base::StringToInt(command_line->GetSwitchValueASCII(kCaptureWorkers),
+                      &workers);
+    base::StringToInt(command_line->GetSwitchValueASCII(kCaptureMaxPending),
+                      &max_pending);
+    return std::make_unique<FrameCapturer>(format, dir, std::max(workers, 1),
+                                           std::max(max_pending, 1), fps);
+  }
+
+  // 在 display 线程中调用，frame 是 OutputDevice 的影子缓冲区，damage
+  // 是本帧相对于上一帧的脏区域。raw 格式只拷贝和写入脏区域，png/y4m
+  // 需要完整的画面，所以会拷贝整帧。
+  void OnFrame(const SkBitmap& frame, const gfx::Rect& damage) {
+    TRACE_EVENT0("viz", "FrameCapturer::OnFrame");
+    int frame_index = frames_received_++;
+    // 被丢弃帧的脏区域需要合并到下一个被编码的帧中，否则 raw 格式的
+    // 使用方无法还原完整画面
+    gfx::Rect frame_damage = damage;
+    frame_damage.Union(missed_damage_);
+    if (base::subtle::NoBarrier_Load(&pending_) >= max_pending_) {
+      ++frames_dropped_;
+      missed_damage_ = frame_damage;
+      TRACE_COUNTER1("viz", "capture_dropped", frames_dropped_);
+      MaybeReportStats();
+      return;
+    }
+    missed_damage_ = gfx::Rect();
+    if (format_ == Format::kRaw && frame_damage.IsEmpty()) {
+      // 画面没有变化，只记录元数据
+      WriteDamage(frame_index, frame_damage);
+      MaybeReportStats();
+      return;
+    }
+
+    gfx::Rect copy_rect = format_ == Format::kRaw
+                              ? frame_damage
+                              : gfx::Rect(frame.width(), frame.height());
+    SkBitmap bitmap;
+    bitmap.allocPixels(frame.info().makeWH(copy_rect.width(),
+                                           copy_rect.height()));
+    frame.readPixels(bitmap.pixmap(), copy_rect.x(), copy_rect.y());
+    bytes_copied_ += bitmap.computeByteSize();
+    TRACE_COUNTER1("viz", "capture_copied_bytes", bitmap.computeByteSize());
+    WriteDamage(frame_index, frame_damage);
+
+    base::subtle::NoBarrier_AtomicIncrement(&pending_, 1);
+    TRACE_COUNTER1("viz", "capture_pending",
+                   base::subtle::NoBarrier_Load(&pending_));
+    auto& task_runner = task_runners_[frame_index % task_runners_.size()];
+    task_runner->PostTask(
+        FROM_HERE,
+        base::BindOnce(&FrameCapturer::EncodeOnWorker, base::Unretained(this),
+                       frame_index, copy_rect, std::move(bitmap)));
+    MaybeReportStats();
+  }
+
+ private:
+  static const char* FormatName(Format format) {
+    switch (format) {
+      case Format::kPNG:
+        return "png";
+      case Format::kRaw:
+        return "raw";
+      case Format::kY4M:
+        return "y4m";
+    }
+    return "";
+  }
+
+  // 在 display 线程中调用，每个 sequence 中的任务都是按顺序执行的，
+  // 所以只需要在每个 sequence 末尾插入一个任务并等待它们执行
+  void WaitForPendingTasks() {
+    TRACE_EVENT0("viz", "FrameCapturer::WaitForPendingTasks");
+    base::WaitableEvent done(base::WaitableEvent::ResetPolicy::MANUAL,
+                             base::WaitableEvent::InitialState::NOT_SIGNALED);
+    base::RepeatingClosure barrier = base::BarrierClosure(
+        task_runners_.size() + 1,
+        base::BindOnce(&base::WaitableEvent::Signal, base::Unretained(&done)));
+    for (auto& task_runner : task_runners_)
+      task_runner->PostTask(FROM_HERE, barrier);
+    metadata_task_runner_->PostTask(FROM_HERE, barrier);
+    done.Wait();
+  }
+
+  // 每一帧的脏区域写入 demo_viz_damage.txt，每行格式为：
+  // <frame_index> <x> <y> <width> <height>
+  void WriteDamage(int frame_index, const gfx::Rect& damage) {
+    metadata_task_runner_->PostTask(
+        FROM_HERE,
+        base::BindOnce(
+            [](base::File* file, int frame_index, const gfx::Rect& damage) {
+              std::string line = base::StringPrintf(
+                  "%d %d %d %d %d\n", frame_index, damage.x(), damage.y(),
+                  damage.width(), damage.height());
+              file->WriteAtCurrentPos(line.data(), line.size());
+            },
+            base::Unretained(metadata_file_.get()), frame_index, damage));
+  }
+
+  void EncodeOnWorker(int frame_index,
+                      const gfx::Rect& rect,
+                      SkBitmap bitmap) {
+    TRACE_EVENT1("viz", "FrameCapturer::EncodeOnWorker", "frame", frame_index);
+    switch (format_) {
+      case Format::kPNG: {
+        base::FilePath path = dir_.AppendASCII(
+            base::StringPrintf("demo_viz_%06d.png", frame_index));
+        SkFILEWStream stream(path.value().c_str());
+        if (!SkEncodeImage(&stream, bitmap.pixmap(), SkEncodedImageFormat::kPNG,
+                           0)) {
+          LOG(ERROR) << "Failed to encode: " << path;
+        }
+        break;
+      }
+      case Format::kRaw: {
+        // 原始的 RGBA 数据，只包含脏区域，文件名中记录了该区域在画面中的位置，
+        // 第一帧为完整画面，可以用 ffmpeg -f rawvideo -pix_fmt rgba 读取
+        base::FilePath path = dir_.AppendASCII(base::StringPrintf(
+            "demo_viz_%06d_%d_%d_%dx%d.rgba", frame_index, rect.x(), rect.y(),
+            rect.width(), rect.height()));
+        base::WriteFile(path, static_cast<const char*>(bitmap.getPixels()),
+                        bitmap.computeByteSize());
+        break;
+      }
+      case Format::kY4M:
+        WriteY4MFrame(frame_index, bitmap);
+        break;
+    }
+    base::subtle::NoBarrier_AtomicIncrement(&frames_encoded_, 1);
+    base::subtle::NoBarrier_AtomicIncrement(&pending_, -1);
+  }
+
+  // 只会在唯一的 y4m sequence 中调用。frame_index 是 display 输出的帧序号，
+  // 因为排队过多而丢弃的帧由 Y4mWriter 用下一帧补齐，保证播放的时间正确。
+  // 不限帧率时每一帧的时长未知，写入 F0:0
+  void WriteY4MFrame(int frame_index, const SkBitmap& bitmap) {
+    const int width = bitmap.width();
+    const int height = bitmap.height();
+    const int uv_width = (width + 1) / 2;
+    const int uv_height = (height + 1) / 2;
+    y4m_buffer_.resize(width * height + uv_width * uv_height * 2);
+    uint8_t* y = y4m_buffer_.data();
+    uint8_t* u = y + width * height;
+    uint8_t* v = u + uv_width * uv_height;
+    // libyuv 的 ABGR 对应内存中的 RGBA 字节序
+    libyuv::ABGRToI420(static_cast<const uint8_t*>(bitmap.getPixels()),
+                       bitmap.rowBytes(), y, width, u, uv_width, v, uv_width,
+                       width, height);
+    const base::TimeDelta interval =
+        fps_ > 0 ? base::TimeDelta::FromSecondsD(1 / fps_) : base::TimeDelta();
+    y4m_writer_->Write(frame_index, gfx::Size(width, height), interval,
+                       y4m_buffer_.data(), y4m_buffer_.size());
+  }
+
+  // 每 kStatsReportInterval 输出一次统计信息，不依赖帧率，
+  // 不限帧率时也不会每一帧都输出
+  void MaybeReportStats() {
+    const base::TimeTicks now = base::TimeTicks::Now();
+    if (last_stats_time_.is_null())
+      last_stats_time_ = now;
+    if (now - last_stats_time_ < kStatsReportInterval)
+      return;
+    last_stats_time_ = now;
+    ReportStats();
+  }
+
+  void ReportStats() {
+    LOG(INFO) << "FrameCapturer: received=" << frames_received_
+              << " encoded=" << base::subtle::NoBarrier_Load(&frames_encoded_)
+              << " dropped=" << frames_dropped_
+              << " pending=" << base::subtle::NoBarrier_Load(&pending_)
+              << " copied_bytes=" << bytes_copied_;
+  }
+
+  const Format format_;
+  const base::FilePath dir_;
+  const int max_pending_;
+  const double fps_;
+  std::vector<scoped_refptr<base::SequencedTaskRunner>> task_runners_;
+  scoped_refptr<base::SequencedTaskRunner> metadata_task_runner_;
+  // 只在 metadata sequence 中写入
+  std::unique_ptr<base::File> metadata_file_;
+
+  // 以下成员只在 display 线程中访问
+  int frames_received_ = 0;
+  int frames_dropped_ = 0;
+  int64_t bytes_copied_ = 0;
+  gfx::Rect missed_damage_;
+  base::TimeTicks last_stats_time_;
+  // 在 display 线程和 worker 线程中都会访问
+  base::subtle::Atomic32 pending_ = 0;
+  base::subtle::Atomic32 frames_encoded_ = 0;
+
+  // 只在 y4m sequence 中访问
+  std::unique_ptr<Y4mWriter> y4m_writer_;
+  std::vector<uint8_t> y4m_buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(FrameCapturer);
+};
+
 // 实现离屏画面的保存
+// 记录 BeginPaint 传入的脏区域，OnSwapBuffers 时只把脏区域从 SkSurface
+// 拷贝到持久的影子缓冲区中，画面变化很小时每帧只需要拷贝很少的数据。
 class OffscreenSoftwareOutputDevice : public viz::SoftwareOutputDevice {
  public:
+  // capturer 为空时保持原来的行为：每帧同步保存到 demo_viz.png。
+  // save_frames 为 false 时（benchmark 模式）不保存画面，也不需要影子缓冲区，
+  // 避免 PNG 编码和磁盘 IO 计入 Swap 的耗时
+  OffscreenSoftwareOutputDevice(FrameCapturer* capturer, bool save_frames)
+      : capturer_(capturer), save_frames_(save_frames) {}
+
+  void Resize(const gfx::Size& viewport_pixel_size,
+              float scale_factor) override {
+    viz::SoftwareOutputDevice::Resize(viewport_pixel_size, scale_factor);
+    if (shadow_.width() == viewport_pixel_size.width() &&
+        shadow_.height() == viewport_pixel_size.height())
+      return;
+    shadow_.allocPixels(SkImageInfo::Make(
+        viewport_pixel_size.width(), viewport_pixel_size.height(),
+        kRGBA_8888_SkColorType, kPremul_SkAlphaType));
+    // 大小改变后需要拷贝整个画面
+    accumulated_damage_ = gfx::Rect(viewport_pixel_size);
+  }
+
   SkCanvas* BeginPaint(const gfx::Rect& damage_rect) override {
-    DLOG(INFO) << "BeginPaint: get a canvas for paint";
+    DLOG(INFO) << "BeginPaint: get a canvas for paint, damage=" << damage_rect;
+    accumulated_damage_.Union(damage_rect);
     return viz::SoftwareOutputDevice::BeginPaint(damage_rect);
   }
+
+  void set_frame_timing(FrameTiming* timing) { timing_ = timing; }
+
   void OnSwapBuffers(SwapBuffersCallback swap_ack_callback) override {
-    auto image = surface_->makeImageSnapshot();
-    SkBitmap bitmap;
-    DCHECK(image->asLegacyBitmap(&bitmap));
+    if (timing_)
+      timing_->swap_begin = base::TimeTicks::Now();
+    if (!capturer_ && !save_frames_) {
+      accumulated_damage_ = gfx::Rect();
+      viz::SoftwareOutputDevice::OnSwapBuffers(std::move(swap_ack_callback));
+      return;
+    }
+    gfx::Rect damage = accumulated_damage_;
+    damage.Intersect(gfx::Rect(viewport_pixel_size_));
+    accumulated_damage_ = gfx::Rect();
+    {
+      TRACE_EVENT1("viz", "OffscreenSoftwareOutputDevice::CopyDamage",
+                   "damage", damage.ToString());
+      if (!damage.IsEmpty()) {
+        SkPixmap dirty;
+        if (shadow_.pixmap().extractSubset(&dirty,
+                                           gfx::RectToSkIRect(damage))) {
+          surface_->readPixels(dirty, damage.x(), damage.y());
+        }
+      }
+      TRACE_COUNTER1("viz", "damage_bytes",
+                     damage.size().GetArea() * shadow_.bytesPerPixel());
+    }
+
+    if (capturer_) {
+      // display 线程中只拷贝需要的像素，编码交给线程池
+      capturer_->OnFrame(shadow_, damage);
+      viz::SoftwareOutputDevice::OnSwapBuffers(std::move(swap_ack_callback));
+      return;
+    }
+
     // 保存渲染结果到图片文件
     constexpr char filename[] = "demo_viz.png";
     base::FilePath path;
@@ -102,25 +604,695 @@ class OffscreenSoftwareOutputDevice : public viz::SoftwareOutputDevice {
 
     SkFILEWStream stream(path.value().c_str());
     DCHECK(
-        SkEncodeImage(&stream, bitmap.pixmap(), SkEncodedImageFormat::kPNG, 0));
-    DLOG(INFO) << "OnSwapBuffers: save the frame to: " << path;
+        SkEncodeImage(&stream, shadow_.pixmap(), SkEncodedImageFormat::kPNG, 0));
+    DLOG(INFO) << "OnSwapBuffers: save the frame to: " << path
+               << ", damage=" << damage;
     viz::SoftwareOutputDevice::OnSwapBuffers(std::move(swap_ack_callback));
   }
+
+ private:
+  FrameCapturer* capturer_;
+  const bool save_frames_;
+  FrameTiming* timing_ = nullptr;
+  // 保存最近一帧完整画面的影子缓冲区
+  SkBitmap shadow_;
+  // 从上一次 OnSwapBuffers 到现在所有 BeginPaint 的脏区域之和
+  gfx::Rect accumulated_damage_;
+};
+
+// 共享内存导出的消息格式，producer 和 consumer 之间通过一条 mojo message
+// pipe 传递。kRing 消息会附带 count 个只读的 SharedBuffer handle。
+struct ShmFrameMessage {
+  enum Type : uint32_t {
+    // producer -> consumer: 新的 buffer ring
+    kRing,
+    // producer -> consumer: index 对应的 buffer 已经可以读取
+    kFrame,
+    // consumer -> producer: index 对应的 buffer 已经读取完毕，可以重用
+    kRelease,
+  };
+  Type type;
+  uint32_t index;
+  uint32_t frame_number;
+  uint32_t count;
+  int32_t width;
+  int32_t height;
+  uint32_t stride;
+  // 本帧相对于上一帧的脏区域
+  int32_t damage_x;
+  int32_t damage_y;
+  int32_t damage_width;
+  int32_t damage_height;
+};
+
+// 在主线程中创建，整个运行过程中只启动一个 consumer 子进程，依次运行的
+// 每个 OffscreenRenderer 都复用它。其他方法只在当前绑定的 display 线程中
+// 调用，负责把 buffer ring 以及每一帧可读的 buffer 通知给 consumer。
+// 析构时关闭 message pipe，consumer 随之退出。
+class SharedMemoryFrameExporter {
+ public:
+  SharedMemoryFrameExporter() {
+    mojo::PlatformChannel channel;
+    mojo::OutgoingInvitation invitation;
+    pipe_ = invitation.AttachMessagePipe(kShmPipeName);
+
+    base::LaunchOptions options;
+    base::CommandLine command_line(
+        base::CommandLine::ForCurrentProcess()->GetProgram());
+    command_line.AppendSwitch(kShmConsumer);
+    channel.PrepareToPassRemoteEndpoint(&options, &command_line);
+    consumer_process_ = base::LaunchProcess(command_line, options);
+    channel.RemoteProcessLaunchAttempted();
+    mojo::OutgoingInvitation::Send(
+        std::move(invitation), consumer_process_.Handle(),
+        channel.TakeLocalEndpoint(),
+        base::BindRepeating(
+            [](const std::string& error) { LOG(ERROR) << error; }));
+  }
+
+  ~SharedMemoryFrameExporter() {
+    DCHECK(!watcher_);
+    LOG(INFO) << "SharedMemoryFrameExporter: published=" << frames_published_
+              << " overrun=" << overrun_count_;
+  }
+
+  // 在 OffscreenRenderer 的 display 线程中调用，开始接收 consumer 的 kRelease
+  // 消息。SimpleWatcher 只能在创建它的线程中使用，所以每个 renderer 都要
+  // 重新绑定一次。
+  void BindToCurrentThread() {
+    DCHECK(!watcher_);
+    watcher_ = std::make_unique<mojo::SimpleWatcher>(
+        FROM_HERE, mojo::SimpleWatcher::ArmingPolicy::AUTOMATIC);
+    watcher_->Watch(pipe_.get(), MOJO_HANDLE_SIGNAL_READABLE,
+                    base::BindRepeating(&SharedMemoryFrameExporter::OnReadable,
+                                        base::Unretained(this)));
+  }
+
+  // 在 display 线程退出之前调用
+  void Unbind() { watcher_.reset(); }
+
+  // 分配新的 buffer ring，并发送给 consumer。返回每个 buffer 的可写映射。
+  std::vector<base::WritableSharedMemoryMapping> CreateRing(
+      const gfx::Size& size,
+      size_t stride,
+      uint32_t count) {
+    std::vector<base::WritableSharedMemoryMapping> mappings;
+    std::vector<MojoHandle> handles;
+    for (uint32_t i = 0; i < count; ++i) {
+      // producer 持有可写的映射，consumer 只能拿到只读的 region
+      base::MappedReadOnlyRegion shm =
+          base::ReadOnlySharedMemoryRegion::Create(stride * size.height());
+      CHECK(shm.IsValid());
+      mappings.push_back(std::move(shm.mapping));
+      handles.push_back(
+          mojo::WrapReadOnlySharedMemoryRegion(std::move(shm.region))
+              .release()
+              .value());
+    }
+    held_.assign(count, false);
+    last_published_.assign(count, 0);
+
+    ShmFrameMessage message = {};
+    message.type = ShmFrameMessage::kRing;
+    message.count = count;
+    message.width = size.width();
+    message.height = size.height();
+    message.stride = stride;
+    // WriteMessageRaw 会接管 handles 的所有权
+    MojoResult result =
+        mojo::WriteMessageRaw(pipe_.get(), &message, sizeof(message),
+                              handles.data(), handles.size(),
+                              MOJO_WRITE_MESSAGE_FLAG_NONE);
+    DCHECK_EQ(result, MOJO_RESULT_OK);
+    return mappings;
+  }
+
+  // 选择下一帧要写入的 buffer，优先使用 consumer 没有占用的 buffer
+  uint32_t AcquireBuffer() {
+    uint32_t oldest = 0;
+    for (uint32_t i = 0; i < held_.size(); ++i) {
+      if (!held_[i])
+        return i;
+      if (last_published_[i] < last_published_[oldest])
+        oldest = i;
+    }
+    // consumer 读得太慢，只能覆盖最早发布的 buffer，consumer 可能会读到撕裂的画面
+    ++overrun_count_;
+    TRACE_COUNTER1("viz", "shm_overrun", overrun_count_);
+    return oldest;
+  }
+
+  void PublishFrame(uint32_t index, const gfx::Rect& damage) {
+    TRACE_EVENT1("viz", "SharedMemoryFrameExporter::PublishFrame", "index",
+                 index);
+    held_[index] = true;
+    last_published_[index] = ++frames_published_;
+
+    ShmFrameMessage message = {};
+    message.type = ShmFrameMessage::kFrame;
+    message.index = index;
+    message.frame_number = frames_published_;
+    message.damage_x = damage.x();
+    message.damage_y = damage.y();
+    message.damage_width = damage.width();
+    message.damage_height = damage.height();
+    MojoResult result =
+        mojo::WriteMessageRaw(pipe_.get(), &message, sizeof(message), nullptr,
+                              0, MOJO_WRITE_MESSAGE_FLAG_NONE);
+    if (result != MOJO_RESULT_OK)
+      LOG(ERROR) << "PublishFrame failed: " << result;
+  }
+
+ private:
+  void OnReadable(MojoResult result) {
+    while (result == MOJO_RESULT_OK) {
+      std::vector<uint8_t> data;
+      result = mojo::ReadMessageRaw(pipe_.get(), &data, nullptr,
+                                    MOJO_READ_MESSAGE_FLAG_NONE);
+      if (result != MOJO_RESULT_OK || data.size() != sizeof(ShmFrameMessage))
+        break;
+      const auto* message = reinterpret_cast<ShmFrameMessage*>(data.data());
+      if (message->type == ShmFrameMessage::kRelease &&
+          message->index < held_.size()) {
+        held_[message->index] = false;
+      }
+    }
+  }
+
+  base::Process consumer_process_;
+  mojo::ScopedMessagePipeHandle pipe_;
+  std::unique_ptr<mojo::SimpleWatcher> watcher_;
+  // consumer 正在读取的 buffer
+  std::vector<bool> held_;
+  // 每个 buffer 最后一次发布时的帧号
+  std::vector<uint32_t> last_published_;
+  uint32_t frames_published_ = 0;
+  uint32_t overrun_count_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryFrameExporter);
+};
+
+// 直接渲染到共享内存 buffer ring 中的 OutputDevice，不需要任何编码或整帧拷贝。
+// 由于每个 buffer 中保存的是更早的画面，切换 buffer 时需要把其他帧的脏区域
+// 从最新的 buffer 中补齐（类似 EGL 的 buffer age）。
+class SharedMemoryOutputDevice : public viz::SoftwareOutputDevice {
+ public:
+  explicit SharedMemoryOutputDevice(SharedMemoryFrameExporter* exporter)
+      : exporter_(exporter) {}
+
+  void Resize(const gfx::Size& viewport_pixel_size,
+              float scale_factor) override {
+    if (viewport_pixel_size_ == viewport_pixel_size && !buffers_.empty())
+      return;
+    viewport_pixel_size_ = viewport_pixel_size;
+    SkImageInfo info = SkImageInfo::Make(
+        viewport_pixel_size.width(), viewport_pixel_size.height(),
+        kRGBA_8888_SkColorType, kPremul_SkAlphaType);
+    buffers_.clear();
+    auto mappings = exporter_->CreateRing(viewport_pixel_size,
+                                          info.minRowBytes(), kBufferCount);
+    for (auto& mapping : mappings) {
+      Buffer buffer;
+      buffer.surface = SkSurface::MakeRasterDirect(info, mapping.memory(),
+                                                   info.minRowBytes());
+      buffer.mapping = std::move(mapping);
+      // 新的 buffer 内容未知，需要整帧重绘
+      buffer.stale = gfx::Rect(viewport_pixel_size);
+      buffers_.push_back(std::move(buffer));
+    }
+    current_ = 0;
+    last_painted_ = -1;
+  }
+
+  SkCanvas* BeginPaint(const gfx::Rect& damage_rect) override {
+    current_ = exporter_->AcquireBuffer();
+    Buffer& buffer = buffers_[current_];
+    damage_rect_ = damage_rect;
+    // 本帧不会重绘的脏区域需要从最新的画面中拷贝过来
+    if (last_painted_ >= 0 && last_painted_ != static_cast<int>(current_) &&
+        !damage_rect.Contains(buffer.stale) && !buffer.stale.IsEmpty()) {
+      TRACE_EVENT1("viz", "SharedMemoryOutputDevice::CopyStale", "stale",
+                   buffer.stale.ToString());
+      SkPixmap dst;
+      buffer.surface->peekPixels(&dst);
+      SkPixmap stale;
+      dst.extractSubset(&stale, gfx::RectToSkIRect(buffer.stale));
+      buffers_[last_painted_].surface->readPixels(stale, buffer.stale.x(),
+                                                  buffer.stale.y());
+    }
+    buffer.stale = gfx::Rect();
+    return buffer.surface->getCanvas();
+  }
+
+  void EndPaint() override {
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      if (i != current_)
+        buffers_[i].stale.Union(damage_rect_);
+    }
+    last_painted_ = current_;
+  }
+
+  void set_frame_timing(FrameTiming* timing) { timing_ = timing; }
+
+  void OnSwapBuffers(SwapBuffersCallback swap_ack_callback) override {
+    if (timing_)
+      timing_->swap_begin = base::TimeTicks::Now();
+    if (last_painted_ >= 0)
+      exporter_->PublishFrame(current_, damage_rect_);
+    viz::SoftwareOutputDevice::OnSwapBuffers(std::move(swap_ack_callback));
+  }
+
+ private:
+  // 3个 buffer：一个正在绘制，一个 consumer 正在读取，一个备用
+  static constexpr uint32_t kBufferCount = 3;
+
+  struct Buffer {
+    base::WritableSharedMemoryMapping mapping;
+    sk_sp<SkSurface> surface;
+    // 该 buffer 上次绘制之后其他帧产生的脏区域
+    gfx::Rect stale;
+  };
+
+  SharedMemoryFrameExporter* exporter_;
+  FrameTiming* timing_ = nullptr;
+  std::vector<Buffer> buffers_;
+  uint32_t current_ = 0;
+  int last_painted_ = -1;
+};
+
+// 外部进程中的 consumer 示例，只读映射 buffer ring，收到帧通知后读取画面，
+// 然后归还 buffer。实际项目中这里可以直接把 buffer 上传为纹理进行合成。
+// producer 退出（pipe 被关闭）时调用 quit_closure 结束子进程。
+class SharedMemoryFrameConsumer {
+ public:
+  explicit SharedMemoryFrameConsumer(base::OnceClosure quit_closure)
+      : watcher_(FROM_HERE, mojo::SimpleWatcher::ArmingPolicy::AUTOMATIC),
+        quit_closure_(std::move(quit_closure)) {
+    mojo::IncomingInvitation invitation = mojo::IncomingInvitation::Accept(
+        mojo::PlatformChannel::RecoverPassedEndpointFromCommandLine(
+            *base::CommandLine::ForCurrentProcess()));
+    pipe_ = invitation.ExtractMessagePipe(kShmPipeName);
+    watcher_.Watch(pipe_.get(), MOJO_HANDLE_SIGNAL_READABLE,
+                   base::BindRepeating(&SharedMemoryFrameConsumer::OnReadable,
+                                       base::Unretained(this)));
+  }
+
+ private:
+  void OnReadable(MojoResult result) {
+    if (result != MOJO_RESULT_OK) {
+      LOG(INFO) << "pipe closed. result= " << result;
+      watcher_.Cancel();
+      if (quit_closure_)
+        std::move(quit_closure_).Run();
+      return;
+    }
+    while (true) {
+      std::vector<uint8_t> data;
+      std::vector<mojo::ScopedHandle> handles;
+      if (mojo::ReadMessageRaw(pipe_.get(), &data, &handles,
+                               MOJO_READ_MESSAGE_FLAG_NONE) != MOJO_RESULT_OK ||
+          data.size() != sizeof(ShmFrameMessage)) {
+        break;
+      }
+      const auto* message = reinterpret_cast<ShmFrameMessage*>(data.data());
+      if (message->type == ShmFrameMessage::kRing)
+        OnRing(*message, std::move(handles));
+      else if (message->type == ShmFrameMessage::kFrame)
+        OnFrame(*message);
+    }
+  }
+
+  void OnRing(const ShmFrameMessage& message,
+              std::vector<mojo::ScopedHandle> handles) {
+    mappings_.clear();
+    for (auto& handle : handles) {
+      base::ReadOnlySharedMemoryRegion region =
+          mojo::UnwrapReadOnlySharedMemoryRegion(
+              mojo::ScopedSharedBufferHandle::From(std::move(handle)));
+      mappings_.push_back(region.Map());
+      DCHECK(mappings_.back().IsValid());
+    }
+    info_ = SkImageInfo::Make(message.width, message.height,
+                              kRGBA_8888_SkColorType, kPremul_SkAlphaType);
+    stride_ = message.stride;
+    LOG(INFO) << "consumer: ring of " << mappings_.size() << " buffers "
+              << message.width << "x" << message.height;
+  }
+
+  void OnFrame(const ShmFrameMessage& message) {
+    TRACE_EVENT1("viz", "SharedMemoryFrameConsumer::OnFrame", "index",
+                 message.index);
+    if (message.index < mappings_.size()) {
+      // 直接读取共享内存中的画面，这里只取脏区域中心的像素作为演示
+      SkPixmap pixmap(info_, mappings_[message.index].memory(), stride_);
+      gfx::Rect damage(message.damage_x, message.damage_y,
+                       message.damage_width, message.damage_height);
+      if (!damage.IsEmpty()) {
+        gfx::Point center = damage.CenterPoint();
+        DLOG(INFO) << "consumer: frame " << message.frame_number
+                   << " buffer=" << message.index << " damage=" << damage
+                   << " color=" << std::hex
+                   << pixmap.getColor(center.x(), center.y());
+      }
+    }
+    ShmFrameMessage release = {};
+    release.type = ShmFrameMessage::kRelease;
+    release.index = message.index;
+    mojo::WriteMessageRaw(pipe_.get(), &release, sizeof(release), nullptr, 0,
+                          MOJO_WRITE_MESSAGE_FLAG_NONE);
+  }
+
+  mojo::ScopedMessagePipeHandle pipe_;
+  mojo::SimpleWatcher watcher_;
+  base::OnceClosure quit_closure_;
+  std::vector<base::ReadOnlySharedMemoryMapping> mappings_;
+  SkImageInfo info_;
+  size_t stride_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryFrameConsumer);
+};
+
+// 生成大量 quad 的 CompositorFrame，用于 viz 的压力测试。
+// 生成 passes 个 RenderPass，每个 RenderPass 中有 quads_per_pass 个 quad，
+// 依次使用 SolidColor、Tile、Texture、Picture 四种类型，每个 quad 都有自己的
+// SharedQuadState，类似 cc 中每个 layer 一个 SharedQuadState。
+// Tile/Texture 使用软件资源，PictureDrawQuad 也只有 SoftwareRenderer 支持
+// （SkiaRenderer 中是 NOTREACHED），所以只能配合 SoftwareRenderer 使用。
+// Tile/Texture 使用的共享内存在初始化时分配一次，之后每一帧重复使用。
+class QuadStressFrameGenerator {
+ public:
+  struct Params {
+    int passes = 1;
+    int quads_per_pass = 0;
+    float overdraw = 1.f;
+    float opacity = 1.f;
+    bool transform = false;
+    float rounded_corner = 0.f;
+
+    static Params FromCommandLine(int quads_per_pass) {
+      const base::CommandLine* command_line =
+          base::CommandLine::ForCurrentProcess();
+      Params params;
+      params.quads_per_pass = quads_per_pass;
+      double value = 0;
+      if (command_line->HasSwitch(kStressPasses)) {
+        base::StringToInt(command_line->GetSwitchValueASCII(kStressPasses),
+                          &params.passes);
+        params.passes = std::max(params.passes, 1);
+      }
+      if (base::StringToDouble(
+              command_line->GetSwitchValueASCII(kStressOverdraw), &value) &&
+          value > 0) {
+        params.overdraw = value;
+      }
+      if (base::StringToDouble(
+              command_line->GetSwitchValueASCII(kStressOpacity), &value)) {
+        params.opacity = base::ClampToRange(value, 0.0, 1.0);
+      }
+      params.transform = command_line->HasSwitch(kStressTransform);
+      if (base::StringToDouble(
+              command_line->GetSwitchValueASCII(kStressRoundedCorner),
+              &value) &&
+          value > 0) {
+        params.rounded_corner = value;
+      }
+      return params;
+    }
+  };
+
+  // support 用于注册 Tile/Texture 使用的共享内存，需要比 generator 活得更久
+  QuadStressFrameGenerator(const Params& params,
+                           viz::CompositorFrameSinkSupport* support)
+      : params_(params) {
+    AllocateResources(support);
+    // PictureDrawQuad 在 viz 中进行光栅化，所以 display list 只需要生成一次
+    picture_ = base::MakeRefCounted<cc::DisplayItemList>();
+    picture_->StartPaint();
+    picture_->push<cc::DrawColorOp>(SK_ColorWHITE, SkBlendMode::kSrc);
+    cc::PaintFlags flags;
+    flags.setAntiAlias(true);
+    flags.setColor(SK_ColorMAGENTA);
+    picture_->push<cc::DrawOvalOp>(
+        SkRect::MakeWH(kContentSize, kContentSize), flags);
+    picture_->EndPaintOfUnpaired(gfx::Rect(kContentSize, kContentSize));
+    picture_->Finalize();
+    LOG(INFO) << "QuadStressFrameGenerator: passes=" << params_.passes
+              << " quads_per_pass=" << params_.quads_per_pass
+              << " overdraw=" << params_.overdraw
+              << " opacity=" << params_.opacity
+              << " transform=" << params_.transform
+              << " rounded_corner=" << params_.rounded_corner;
+  }
+
+  int quads_per_frame() const {
+    // 每个非 root 的 RenderPass 还会在 root 上生成一个 RenderPassDrawQuad
+    return params_.passes * params_.quads_per_pass + params_.passes - 1;
+  }
+
+  // 生成所有 RenderPass，root RenderPass 在最后
+  void AppendRenderPasses(const gfx::Rect& output_rect,
+                          uint32_t frame_index,
+                          viz::CompositorFrame* frame) {
+    TRACE_EVENT1("viz", "QuadStressFrameGenerator::AppendRenderPasses",
+                 "quads", quads_per_frame());
+    constexpr viz::RenderPassId kRootRenderPassId = 1;
+    for (int i = 1; i < params_.passes; ++i) {
+      auto render_pass = viz::RenderPass::Create();
+      render_pass->SetNew(kRootRenderPassId + i, output_rect, output_rect,
+                          gfx::Transform());
+      AppendQuads(render_pass.get(), output_rect, i, frame_index);
+      frame->render_pass_list.push_back(std::move(render_pass));
+    }
+
+    auto root_pass = viz::RenderPass::Create();
+    root_pass->SetNew(kRootRenderPassId, output_rect, output_rect,
+                      gfx::Transform());
+    for (int i = 1; i < params_.passes; ++i)
+      AppendRenderPassDrawQuad(root_pass.get(), output_rect,
+                               kRootRenderPassId + i);
+    AppendQuads(root_pass.get(), output_rect, 0, frame_index);
+    frame->render_pass_list.push_back(std::move(root_pass));
+
+    // 同一个资源重复提交时 viz 只会增加引用计数
+    frame->resource_list.insert(frame->resource_list.end(), resources_.begin(),
+                                resources_.end());
+  }
+
+ private:
+  static constexpr int kContentSize = 64;
+  static constexpr size_t kResourceCount = 4;
+
+  void AllocateResources(viz::CompositorFrameSinkSupport* support) {
+    constexpr SkColor kResourceColors[] = {SK_ColorRED, SK_ColorGREEN,
+                                           SK_ColorBLUE, SK_ColorYELLOW};
+    const gfx::Size size(kContentSize, kContentSize);
+    for (size_t i = 0; i < kResourceCount; ++i) {
+      base::MappedReadOnlyRegion shm =
+          viz::bitmap_allocation::AllocateSharedBitmap(size, viz::RGBA_8888);
+      SkImageInfo info = SkImageInfo::MakeN32Premul(size.width(),
+                                                    size.height());
+      SkBitmap bitmap;
+      bitmap.installPixels(info, shm.mapping.memory(), info.minRowBytes());
+      SkCanvas canvas(bitmap);
+      canvas.clear(kResourceColors[i]);
+      canvas.drawCircle(kContentSize / 2, kContentSize / 2, kContentSize / 4,
+                        SkPaint(SkColor4f::FromColor(SK_ColorWHITE)));
+
+      viz::SharedBitmapId id = viz::SharedBitmap::GenerateId();
+      support->DidAllocateSharedBitmap(std::move(shm.region), id);
+      viz::TransferableResource resource =
+          viz::TransferableResource::MakeSoftware(id, size, viz::RGBA_8888);
+      resource.id = i + 1;
+      resources_.push_back(resource);
+    }
+  }
+
+  // quad 的位置由 quad 序号决定，每一帧整体平移一点，保证每一帧都有变化
+  gfx::Rect QuadRect(const gfx::Rect& output_rect,
+                     int pass_index,
+                     int quad_index,
+                     uint32_t frame_index) const {
+    const int side = std::max(
+        1, static_cast<int>(std::sqrt(params_.overdraw * output_rect.width() *
+                                      output_rect.height() /
+                                      params_.quads_per_pass)));
+    uint32_t hash = (quad_index + 1) * 2654435761u ^ (pass_index + 1) * 40503u;
+    const int x_range = std::max(1, output_rect.width() - side);
+    const int y_range = std::max(1, output_rect.height() - side);
+    const int x = (hash % x_range + frame_index) % x_range;
+    const int y = ((hash >> 16) % y_range + frame_index / 2) % y_range;
+    return gfx::Rect(x, y, side, side);
+  }
+
+  void AppendQuads(viz::RenderPass* render_pass,
+                   const gfx::Rect& output_rect,
+                   int pass_index,
+                   uint32_t frame_index) {
+    constexpr SkColor kColors[] = {SK_ColorRED, SK_ColorGREEN, SK_ColorBLUE,
+                                   SK_ColorYELLOW, SK_ColorCYAN};
+    const bool needs_blending =
+        params_.opacity < 1.f || params_.rounded_corner > 0;
+    const gfx::Size content_size(kContentSize, kContentSize);
+    for (int i = 0; i < params_.quads_per_pass; ++i) {
+      const gfx::Rect target_rect =
+          QuadRect(output_rect, pass_index, i, frame_index);
+      const gfx::Rect quad_rect(target_rect.size());
+      gfx::Transform transform;
+      transform.Translate(target_rect.x(), target_rect.y());
+      if (params_.transform) {
+        // 绕 quad 中心旋转并缩放，使 quad 不再是轴对齐的
+        transform.Translate(quad_rect.width() / 2.f,
+                            quad_rect.height() / 2.f);
+        transform.Rotate((i * 7 + frame_index) % 360);
+        transform.Scale(0.8f, 0.8f);
+        transform.Translate(-quad_rect.width() / 2.f,
+                            -quad_rect.height() / 2.f);
+      }
+      gfx::RRectF rounded_corner_bounds;
+      if (params_.rounded_corner > 0) {
+        // rounded_corner_bounds 位于 RenderPass 的坐标系中
+        gfx::RectF bounds(quad_rect);
+        transform.TransformRect(&bounds);
+        rounded_corner_bounds =
+            gfx::RRectF(bounds, params_.rounded_corner);
+      }
+
+      auto* quad_state = render_pass->CreateAndAppendSharedQuadState();
+      quad_state->SetAll(
+          transform,
+          /*quad_layer_rect=*/quad_rect,
+          /*visible_quad_layer_rect=*/quad_rect, rounded_corner_bounds,
+          /*clip_rect=*/output_rect,
+          /*is_clipped=*/true, /*are_contents_opaque=*/!needs_blending,
+          params_.opacity,
+          /*blend_mode=*/SkBlendMode::kSrcOver, /*sorting_context_id=*/0);
+
+      const SkColor color = kColors[(i + pass_index) % base::size(kColors)];
+      const viz::ResourceId resource = resources_[i % resources_.size()].id;
+      // 0: SolidColor 1: Tile 2: Texture 3: Picture
+      switch (i % 4) {
+        case 0: {
+          auto* quad =
+              render_pass->CreateAndAppendDrawQuad<viz::SolidColorDrawQuad>();
+          quad->SetNew(quad_state, quad_rect, quad_rect, color, false);
+          break;
+        }
+        case 1: {
+          auto* quad =
+              render_pass->CreateAndAppendDrawQuad<viz::TileDrawQuad>();
+          quad->SetNew(quad_state, quad_rect, quad_rect, needs_blending,
+                       resource, gfx::RectF(gfx::Rect(content_size)),
+                       content_size, true, false, false);
+          break;
+        }
+        case 2: {
+          auto* quad =
+              render_pass->CreateAndAppendDrawQuad<viz::TextureDrawQuad>();
+          float vertex_opacity[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+          quad->SetNew(quad_state, quad_rect, quad_rect, needs_blending,
+                       resource, true, gfx::PointF(0.f, 0.f),
+                       gfx::PointF(1.f, 1.f), SK_ColorTRANSPARENT,
+                       vertex_opacity, false, false, false,
+                       gfx::ProtectedVideoType::kClear);
+          break;
+        }
+        default: {
+          auto* quad =
+              render_pass->CreateAndAppendDrawQuad<viz::PictureDrawQuad>();
+          quad->SetNew(quad_state, quad_rect, quad_rect, needs_blending,
+                       gfx::RectF(quad_rect), quad_rect.size(), false,
+                       viz::RGBA_8888, quad_rect, 1.f, {}, picture_);
+          break;
+        }
+      }
+    }
+  }
+
+  void AppendRenderPassDrawQuad(viz::RenderPass* render_pass,
+                                const gfx::Rect& output_rect,
+                                viz::RenderPassId child_pass_id) {
+    auto* quad_state = render_pass->CreateAndAppendSharedQuadState();
+    quad_state->SetAll(
+        gfx::Transform(),
+        /*quad_layer_rect=*/output_rect,
+        /*visible_quad_layer_rect=*/output_rect,
+        /*rounded_corner_bounds=*/gfx::RRectF(),
+        /*clip_rect=*/gfx::Rect(),
+        /*is_clipped=*/false, /*are_contents_opaque=*/false, params_.opacity,
+        /*blend_mode=*/SkBlendMode::kSrcOver, /*sorting_context_id=*/0);
+    auto* quad =
+        render_pass->CreateAndAppendDrawQuad<viz::RenderPassDrawQuad>();
+    quad->SetNew(quad_state, output_rect, output_rect, child_pass_id,
+                 /*mask_resource_id=*/0, gfx::RectF(), gfx::Size(),
+                 gfx::Vector2dF(1.f, 1.f), gfx::PointF(),
+                 gfx::RectF(output_rect), false,
+                 /*backdrop_filter_quality=*/1.f);
+  }
+
+  const Params params_;
+  std::vector<viz::TransferableResource> resources_;
+  scoped_refptr<cc::DisplayItemList> picture_;
+
+  DISALLOW_COPY_AND_ASSIGN(QuadStressFrameGenerator);
 };
 
 // 离屏画面的生成，类似Renderer进程做的事情
 class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
                           public viz::DisplayClient {
  public:
-  OffscreenRenderer() : thread_("OffscreenRenderer") {
+  // quit_closure 会在 benchmark 结束后在主线程中调用
+  // stress_quads 大于 0 时使用 QuadStressFrameGenerator 生成 CF
+  // exporter 不为空时把画面渲染到共享内存中，需要比 renderer 活得更久
+  OffscreenRenderer(RendererType type,
+                    int stress_quads,
+                    SharedMemoryFrameExporter* exporter,
+                    base::OnceClosure quit_closure)
+      : type_(type),
+        stress_quads_(stress_quads),
+        thread_("OffscreenRenderer"),
+        main_task_runner_(base::ThreadTaskRunnerHandle::Get()),
+        quit_closure_(std::move(quit_closure)),
+        exporter_(exporter) {
+    result_.renderer = type_ == RendererType::kSkia ? "SkiaRenderer"
+                                                    : "SoftwareRenderer";
+    result_.label = result_.renderer;
+    if (stress_quads_ > 0)
+      result_.label += "/" + base::NumberToString(stress_quads_);
+    const base::CommandLine* command_line =
+        base::CommandLine::ForCurrentProcess();
+    // 录制模式下编码不会阻塞 display 线程，所以可以使用 60fps
+    if (command_line->HasSwitch(kCaptureFormat))
+      fps_ = 60.0;
+    if (command_line->HasSwitch(kFps))
+      base::StringToDouble(command_line->GetSwitchValueASCII(kFps), &fps_);
+    if (command_line->HasSwitch(kSize))
+      size_ = ParseSize(command_line->GetSwitchValueASCII(kSize), size_);
+    if (command_line->HasSwitch(kFrames)) {
+      base::StringToInt(command_line->GetSwitchValueASCII(kFrames),
+                        &frames_to_run_);
+    }
+    LOG(INFO) << "OffscreenRenderer: " << result_.renderer
+              << " fps=" << (fps_ > 0 ? fps_ : 0)
+              << " size=" << size_.ToString() << " frames=" << frames_to_run_;
     CHECK(thread_.Start());
     thread_.task_runner()->PostTask(
         FROM_HERE, base::BindOnce(&OffscreenRenderer::InitializeOnThread,
                                   base::Unretained(this)));
   }
 
+  ~OffscreenRenderer() override {
+    thread_.task_runner()->PostTask(
+        FROM_HERE, base::BindOnce(&OffscreenRenderer::TearDownOnThread,
+                                  base::Unretained(this)));
+    thread_.Stop();
+  }
+
+  // 只能在 quit_closure 被调用之后读取
+  const BenchmarkResult& result() const { return result_; }
+
  private:
   void InitializeOnThread() {
+    capturer_ = FrameCapturer::CreateFromCommandLine(fps_);
     shared_bitmap_manager_ = std::make_unique<viz::ServerSharedBitmapManager>();
     frame_sink_manager_ = std::make_unique<viz::FrameSinkManagerImpl>(
         shared_bitmap_manager_.get());
@@ -141,21 +1313,53 @@ class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
     // 表示一个timer，会根据设置定时触发回调
     auto time_source =
         std::make_unique<viz::DelayBasedTimeSource>(task_runner.get());
+    if (fps_ > 0) {
+      time_source->SetTimebaseAndInterval(
+          base::TimeTicks(), base::TimeDelta::FromMicroseconds(
+                                 base::Time::kMicrosecondsPerSecond / fps_));
+      // 用于定时请求BeginFrame
+      begin_frame_source_ = std::make_unique<viz::DelayBasedBeginFrameSource>(
+          std::move(time_source), viz::BeginFrameSource::kNotRestartableId);
+    } else {
+      // 不限帧率，上一帧完成后立即开始下一帧，用于测量吞吐量
+      begin_frame_source_ = std::make_unique<viz::BackToBackBeginFrameSource>(
+          std::move(time_source));
+    }
 
-    time_source->SetTimebaseAndInterval(
-        base::TimeTicks(), base::TimeDelta::FromMicroseconds(
-                               base::Time::kMicrosecondsPerSecond / fps_));
-    // 用于定时请求BeginFrame
-    begin_frame_source_ = std::make_unique<viz::DelayBasedBeginFrameSource>(
-        std::move(time_source), viz::BeginFrameSource::kNotRestartableId);
-
-    auto output_surface = std::make_unique<viz::SoftwareOutputSurface>(
-        std::make_unique<OffscreenSoftwareOutputDevice>());
+    viz::RendererSettings settings = viz::CreateRendererSettings();
+    std::unique_ptr<viz::OutputSurface> output_surface;
+    if (type_ == RendererType::kSkia) {
+      // SkiaRenderer 只能配合 SkiaOutputSurface 使用，kNullSurfaceHandle
+      // 表示使用 SkiaOutputDeviceOffscreen 进行离屏渲染
+      settings.use_skia_renderer = true;
+      output_surface = viz::SkiaOutputSurfaceImpl::Create(
+          std::make_unique<viz::SkiaOutputSurfaceDependencyImpl>(
+              viz::TestGpuServiceHolder::GetInstance()->gpu_service(),
+              gpu::kNullSurfaceHandle),
+          settings);
+      if (capturer_ || exporter_) {
+        LOG(WARNING) << "capture/export-shm only support SoftwareRenderer";
+      }
+    } else {
+      settings.use_skia_renderer = false;
+      std::unique_ptr<viz::SoftwareOutputDevice> output_device;
+      if (exporter_) {
+        exporter_->BindToCurrentThread();
+        auto device = std::make_unique<SharedMemoryOutputDevice>(exporter_);
+        device->set_frame_timing(&timing_);
+        output_device = std::move(device);
+      } else {
+        auto device = std::make_unique<OffscreenSoftwareOutputDevice>(
+            capturer_.get(), /*save_frames=*/frames_to_run_ == 0);
+        device->set_frame_timing(&timing_);
+        output_device = std::move(device);
+      }
+      output_surface = std::make_unique<viz::SoftwareOutputSurface>(
+          std::move(output_device));
+    }
     auto scheduler = std::make_unique<viz::DisplayScheduler>(
         begin_frame_source_.get(), task_runner.get(),
         output_surface->capabilities().max_frames_pending);
-    viz::RendererSettings settings = viz::CreateRendererSettings();
-    settings.use_skia_renderer = false;
     display_ = std::make_unique<viz::Display>(
         shared_bitmap_manager_.get(), settings, root_frame_sink_id_,
         std::move(output_surface), std::move(scheduler), task_runner);
@@ -166,7 +1370,77 @@ class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
                                                   root_frame_sink_id_);
     display_->Resize(size_);
     display_->SetVisible(true);
+    if (stress_quads_ > 0) {
+      auto params = QuadStressFrameGenerator::Params::FromCommandLine(
+          stress_quads_);
+      stress_generator_ =
+          std::make_unique<QuadStressFrameGenerator>(params, support_.get());
+    }
     support_->SetNeedsBeginFrame(true);
+    benchmark_start_ = base::TimeTicks::Now();
+    peak_rss_reset_ = ResetPeakRss();
+    // 丢弃之前运行的 renderer 记录的数据
+    TakeAggregateTime();
+    ReadProcessMemoryKb(&result_.rss_start_kb, &result_.peak_rss_kb);
+  }
+
+  // display_ 先于 support_ 销毁，和 RootCompositorFrameSinkImpl 的顺序一致；
+  // OutputDevice 引用了 capturer_，所以 capturer_ 最后销毁，它的析构会等待
+  // 线程池中的编码任务执行完毕
+  void TearDownOnThread() {
+    frame_sink_manager_->UnregisterBeginFrameSource(begin_frame_source_.get());
+    display_.reset();
+    support_.reset();
+    begin_frame_source_.reset();
+    frame_sink_manager_.reset();
+    shared_bitmap_manager_.reset();
+    stress_generator_.reset();
+    if (exporter_)
+      exporter_->Unbind();
+    capturer_.reset();
+  }
+
+  // 返回上一次调用之后 SurfaceAggregator 的总耗时。每次 DrawAndSwap 只会
+  // 记录一个样本，sum 是精确值，不受直方图 bucket 的影响
+  base::TimeDelta TakeAggregateTime() {
+    base::HistogramBase* histogram =
+        base::StatisticsRecorder::FindHistogram(kAggregateHistogram);
+    if (!histogram)
+      return base::TimeDelta();
+    std::unique_ptr<base::HistogramSamples> samples =
+        histogram->SnapshotDelta();
+    return base::TimeDelta::FromMicroseconds(samples->sum());
+  }
+
+  // 输出各个阶段耗时的分位数，然后通知主线程退出。
+  // display 可能跳过或者合并提交的帧，所以 swap 的帧数可能少于提交的帧数
+  void FinishBenchmark() {
+    if (benchmark_finished_)
+      return;
+    benchmark_finished_ = true;
+    support_->SetNeedsBeginFrame(false);
+    base::TimeDelta elapsed = base::TimeTicks::Now() - benchmark_start_;
+    result_.frames = frames_swapped_;
+    result_.fps = frames_swapped_ / elapsed.InSecondsF();
+    ReadProcessMemoryKb(&result_.rss_end_kb, &result_.peak_rss_kb);
+    if (!peak_rss_reset_)
+      result_.peak_rss_kb = -1;
+    LOG(INFO) << "Benchmark(" << result_.label << "): " << frames_swapped_
+              << " frames " << size_.ToString() << " in "
+              << elapsed.InMillisecondsF() << "ms, " << result_.fps << " fps";
+    if (frames_swapped_ < frames_submitted_) {
+      LOG(INFO) << "Benchmark(" << result_.label << "): "
+                << frames_submitted_ - frames_swapped_
+                << " submitted frames were not drawn";
+    }
+    for (const LatencyRecorder* recorder :
+         {&result_.create_frame, &result_.aggregate, &result_.draw,
+          &result_.swap, &result_.frame, &result_.present}) {
+      LOG(INFO) << "Benchmark(" << result_.label
+                << "): " << recorder->ToString();
+    }
+    if (quit_closure_)
+      main_task_runner_->PostTask(FROM_HERE, std::move(quit_closure_));
   }
 
   viz::CompositorFrame CreateFrame(const ::viz::BeginFrameArgs& args) {
@@ -182,6 +1456,11 @@ class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
     const int kRenderPassId = 1;
     const gfx::Rect& output_rect = gfx::Rect(size_);
     const gfx::Rect& damage_rect = output_rect;
+    if (stress_generator_) {
+      stress_generator_->AppendRenderPasses(output_rect, frames_submitted_,
+                                            &frame);
+      return frame;
+    }
     std::unique_ptr<viz::RenderPass> render_pass = viz::RenderPass::Create();
     render_pass->SetNew(kRenderPassId, output_rect, damage_rect,
                         gfx::Transform());
@@ -210,23 +1489,61 @@ class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
     return frame;
   }
 
+  // 每个提交的 CF 都会收到 ack，无论它是否被 display 绘制。
+  // 所有帧都提交并且 ack 之后结束 benchmark，ack 在 Display::DrawAndSwap
+  // 的聚合阶段发出，post 一个任务使最后一帧的 swap 先完成统计
   void DidReceiveCompositorFrameAck(
-      const std::vector<::viz::ReturnedResource>& resources) override {}
+      const std::vector<::viz::ReturnedResource>& resources) override {
+    DCHECK_GT(frames_pending_ack_, 0);
+    --frames_pending_ack_;
+    if (frames_to_run_ > 0 && frames_submitted_ >= frames_to_run_ &&
+        frames_pending_ack_ == 0) {
+      thread_.task_runner()->PostTask(
+          FROM_HERE, base::BindOnce(&OffscreenRenderer::FinishBenchmark,
+                                    base::Unretained(this)));
+    }
+  }
 
   void OnBeginFrame(
       const ::viz::BeginFrameArgs& args,
       const base::flat_map<uint32_t, ::viz::FrameTimingDetails>& details)
       override {
     DLOG(INFO) << "OnBeginFrame: submit a new frame";
+    for (const auto& detail : details) {
+      const viz::FrameTimingDetails& timing = detail.second;
+      if (!timing.presentation_feedback.timestamp.is_null()) {
+        result_.present.Add(timing.presentation_feedback.timestamp -
+                            timing.received_compositor_frame_timestamp);
+      }
+      // SkiaOutputSurface 在 GPU 线程中执行 SwapBuffers，真实的耗时通过
+      // SwapTimings 返回；SoftwareOutputSurface 的 SwapTimings 只是同一个
+      // 时间点，所以软件渲染使用 OutputDevice 中记录的时间
+      const gfx::SwapTimings& swap = timing.swap_timings;
+      if (type_ == RendererType::kSkia && !swap.swap_start.is_null() &&
+          !swap.swap_end.is_null()) {
+        result_.swap.Add(swap.swap_end - swap.swap_start);
+      }
+    }
     if (support_->last_activated_local_surface_id() !=
         root_local_surface_id_.local_surface_id()) {
       display_->SetLocalSurfaceId(root_local_surface_id_.local_surface_id(),
                                   1.0f);
     }
+    if (frames_to_run_ > 0 && frames_submitted_ >= frames_to_run_) {
+      support_->DidNotProduceFrame(viz::BeginFrameAck(args, false));
+      return;
+    }
+    base::TimeTicks begin = base::TimeTicks::Now();
+    viz::CompositorFrame frame = CreateFrame(args);
+    result_.create_frame.Add(base::TimeTicks::Now() - begin);
     support_->SubmitCompositorFrame(root_local_surface_id_.local_surface_id(),
-                                    CreateFrame(args),
+                                    std::move(frame),
                                     base::Optional<viz::HitTestRegionList>(),
                                     /*trace_time=*/0);
+    ++frames_submitted_;
+    ++frames_pending_ack_;
+    timing_.submit_end = base::TimeTicks::Now();
+    frame_begin_ = begin;
   }
 
   void OnBeginFramePausedChanged(bool paused) override {}
@@ -237,8 +1554,28 @@ class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
   // viz::DisplayClient overrides.
   void DisplayOutputSurfaceLost() override {}
   void DisplayWillDrawAndSwap(bool will_draw_and_swap,
-                              viz::RenderPassList* render_passes) override {}
-  void DisplayDidDrawAndSwap() override {}
+                              viz::RenderPassList* render_passes) override {
+    timing_.draw_begin = base::TimeTicks::Now();
+  }
+  void DisplayDidDrawAndSwap() override {
+    base::TimeTicks now = base::TimeTicks::Now();
+    // SkiaOutputSurface 不经过我们的 OutputDevice，绘制和 SwapBuffers
+    // 都在 GPU 线程中异步执行，display 线程中的耗时全部计入 Draw，
+    // Swap 的耗时在 OnBeginFrame 中从 FrameTimingDetails 中读取
+    const bool has_device_swap = !timing_.swap_begin.is_null();
+    if (!has_device_swap)
+      timing_.swap_begin = now;
+    const base::TimeDelta aggregate = TakeAggregateTime();
+    if (!timing_.submit_end.is_null()) {
+      result_.aggregate.Add(aggregate);
+      result_.draw.Add(timing_.swap_begin - timing_.draw_begin);
+      if (has_device_swap)
+        result_.swap.Add(now - timing_.swap_begin);
+      result_.frame.Add(now - frame_begin_);
+    }
+    timing_ = FrameTiming();
+    ++frames_swapped_;
+  }
   void DisplayDidReceiveCALayerParams(
       const gfx::CALayerParams& ca_layer_params) override {}
   void DisplayDidCompleteSwapWithSize(const gfx::Size& pixel_size) override {}
@@ -248,23 +1585,87 @@ class OffscreenRenderer : public viz::mojom::CompositorFrameSinkClient,
     return frame_sink_manager_->GetPreferredFrameIntervalForFrameSinkId(id);
   }
 
+  const RendererType type_;
+  const int stress_quads_;
   base::Thread thread_;
+  scoped_refptr<base::SingleThreadTaskRunner> main_task_runner_;
+  base::OnceClosure quit_closure_;
+  SharedMemoryFrameExporter* const exporter_;
+  std::unique_ptr<FrameCapturer> capturer_;
   std::unique_ptr<viz::ServerSharedBitmapManager> shared_bitmap_manager_;
   std::unique_ptr<viz::FrameSinkManagerImpl> frame_sink_manager_;
   std::unique_ptr<viz::CompositorFrameSinkSupport> support_;
-  std::unique_ptr<viz::DelayBasedBeginFrameSource> begin_frame_source_;
+  std::unique_ptr<viz::SyntheticBeginFrameSource> begin_frame_source_;
   std::unique_ptr<viz::Display> display_;
-  // 由于要将显示存储为图片，所以使用1FPS
+  std::unique_ptr<QuadStressFrameGenerator> stress_generator_;
+  // 由于要将显示存储为图片，所以使用1FPS，录制模式下使用60FPS，
+  // 可以使用 --fps 修改，0 表示不限帧率
   double fps_ = 1.0;
-  // 画面大小为 300x200
+  // 画面大小默认为 300x200，可以使用 --size 修改
   gfx::Size size_{300, 200};
 
+  // benchmark 统计，只在 display 线程中访问
+  // 渲染多少帧之后退出，0 表示一直运行
+  int frames_to_run_ = 0;
+  int frames_submitted_ = 0;
+  int frames_swapped_ = 0;
+  // 已经提交但还没有收到 ack 的帧数
+  int frames_pending_ack_ = 0;
+  bool benchmark_finished_ = false;
+  base::TimeTicks benchmark_start_;
+  base::TimeTicks frame_begin_;
+  // 是否成功重置了 VmHWM，失败时不输出峰值
+  bool peak_rss_reset_ = false;
+  FrameTiming timing_;
+  BenchmarkResult result_;
+
   viz::FrameSinkId root_frame_sink_id_{0, 1};
   viz::ParentLocalSurfaceIdAllocator root_local_surface_id_allocator_;
   viz::LocalSurfaceIdAllocation root_local_surface_id_;
   viz::FrameTokenGenerator frame_token_generator_;
 };
 
+// 输出多组 benchmark 的对比结果，例如 SoftwareRenderer 和 SkiaRenderer，
+// 或者不同的 quad 数量
+void PrintComparison(const std::vector<BenchmarkResult>& results) {
+  std::string header = base::StringPrintf("%-22s", "");
+  for (const auto& result : results)
+    header += base::StringPrintf("%20s", result.label.c_str());
+  LOG(INFO) << "Benchmark comparison:";
+  LOG(INFO) << header;
+
+  auto print_row = [&results](const std::string& name, auto value) {
+    std::string row = base::StringPrintf("%-22s", name.c_str());
+    for (const auto& result : results)
+      row += base::StringPrintf("%20s", value(result).c_str());
+    LOG(INFO) << row;
+  };
+  print_row("fps", [](const BenchmarkResult& r) {
+    return base::StringPrintf("%.1f", r.fps);
+  });
+  for (auto member :
+       {&BenchmarkResult::create_frame, &BenchmarkResult::aggregate,
+        &BenchmarkResult::draw, &BenchmarkResult::swap,
+        &BenchmarkResult::present}) {
+    for (double percentile : {50.0, 90.0, 99.0}) {
+      const std::string name =
+          base::StringPrintf("%s p%.0f (ms)",
+                             (results[0].*member).name().c_str(), percentile);
+      print_row(name, [member, percentile](const BenchmarkResult& r) {
+        return base::StringPrintf(
+            "%.3f", (r.*member).Percentile(percentile).InMillisecondsF());
+      });
+    }
+  }
+  print_row("RSS delta (KB)", [](const BenchmarkResult& r) {
+    return base::NumberToString(r.rss_end_kb - r.rss_start_kb);
+  });
+  print_row("peak RSS (KB)", [](const BenchmarkResult& r) {
+    return r.peak_rss_kb < 0 ? std::string("n/a")
+                             : base::NumberToString(r.peak_rss_kb);
+  });
+}
+
 }  // namespace demo
 
 int main(int argc, char** argv) {
@@ -293,8 +1694,52 @@ int main(int argc, char** argv) {
       mojo_thread.task_runner(),
       mojo::core::ScopedIPCSupport::ShutdownPolicy::CLEAN);
 
-  // 加载相应平台的GL库及GL绑定
-  // gl::init::InitializeGLOneOff();
+  base::CommandLine* command_line = base::CommandLine::ForCurrentProcess();
+  const std::string renderer_name =
+      command_line->GetSwitchValueASCII(demo::kRenderer);
+  std::vector<demo::RendererType> renderer_types;
+  if (renderer_name == "skia") {
+    renderer_types = {demo::RendererType::kSkia};
+  } else if (renderer_name == "both") {
+    renderer_types = {demo::RendererType::kSoftware,
+                      demo::RendererType::kSkia};
+  } else {
+    renderer_types = {demo::RendererType::kSoftware};
+  }
+  // 压力测试的 quad 数量，0 表示不使用 QuadStressFrameGenerator
+  std::vector<int> stress_quads;
+  const std::string stress_quads_value =
+      command_line->GetSwitchValueASCII(demo::kStressQuads);
+  for (const auto& value :
+       base::SplitStringPiece(stress_quads_value, ",", base::TRIM_WHITESPACE,
+                              base::SPLIT_WANT_NONEMPTY)) {
+    int quads = 0;
+    if (base::StringToInt(value, &quads) && quads > 0)
+      stress_quads.push_back(quads);
+  }
+  if (!stress_quads.empty() &&
+      renderer_types.back() == demo::RendererType::kSkia) {
+    LOG(ERROR) << "--stress-quads only supports --renderer=software";
+    return 1;
+  }
+  if (stress_quads.empty())
+    stress_quads.push_back(0);
+  // 录制和共享内存导出只支持 SoftwareRenderer：SkiaRenderer 的画面不经过
+  // OffscreenSoftwareOutputDevice，consumer 子进程会一直等不到任何帧。
+  // 对比模式下两种 Renderer 的输出路径也必须相同，否则对比结果没有意义
+  if (renderer_types.back() == demo::RendererType::kSkia &&
+      (command_line->HasSwitch(demo::kCaptureFormat) ||
+       command_line->HasSwitch(demo::kExportShm))) {
+    LOG(ERROR) << "--capture-format and --export-shm only support "
+                  "--renderer=software";
+    return 1;
+  }
+  // 对比模式下必须在有限的帧数之后结束
+  if (renderer_types.size() * stress_quads.size() > 1 &&
+      !command_line->HasSwitch(demo::kFrames)) {
+    command_line->AppendSwitchASCII(
+        demo::kFrames, base::NumberToString(demo::kDefaultCompareFrames));
+  }
 
   // 初始化ICU(i18n),也就是icudtl.dat，views依赖ICU
   base::i18n::InitializeICU();
@@ -314,12 +1759,47 @@ int main(int argc, char** argv) {
   // 这些错误大多是并发导致的代码执行顺序问题，所以修改起来没有那么容易。
   ui::SetDefaultX11ErrorHandlers();
 
+  // 共享内存导出模式下的 consumer 子进程
+  if (base::CommandLine::ForCurrentProcess()->HasSwitch(demo::kShmConsumer)) {
+    logging::SetLogPrefix("consumer");
+    demo::SharedMemoryFrameConsumer consumer(run_loop.QuitClosure());
+    run_loop.Run();
+    return 0;
+  }
+
   // 每秒生成一张图片保存到文件中
-  // 可以使用这种原理将浏览器嵌入其他程序，当然这个demo演示的并不是最优方案，只是一种可行方案
-  demo::OffscreenRenderer renderer;
+  // 可以使用这种原理将浏览器嵌入其他程序，当然这个demo演示的并不是最优方案，只是一种可行方案，
+  // 使用 --export-shm 可以直接把画面渲染到共享内存中交给其他进程，避免编码和拷贝
+  // 加载相应平台的GL库及GL绑定，只有 SkiaRenderer 需要，
+  // 默认使用 SwiftShader 以便在没有 GPU 的服务器上运行
+  if (renderer_types.back() == demo::RendererType::kSkia) {
+    if (!command_line->HasSwitch(switches::kUseGL)) {
+      command_line->AppendSwitchASCII(switches::kUseGL,
+                                      gl::kGLImplementationSwiftShaderName);
+    }
+    gl::init::InitializeGLOneOff();
+  }
 
-  LOG(INFO) << "running...";
-  run_loop.Run();
+  // 所有 renderer 共用一个 consumer 子进程
+  std::unique_ptr<demo::SharedMemoryFrameExporter> exporter;
+  if (command_line->HasSwitch(demo::kExportShm))
+    exporter = std::make_unique<demo::SharedMemoryFrameExporter>();
+
+  std::vector<demo::BenchmarkResult> results;
+  for (demo::RendererType type : renderer_types) {
+    for (int quads : stress_quads) {
+      base::RunLoop renderer_run_loop;
+      demo::OffscreenRenderer renderer(type, quads, exporter.get(),
+                                       renderer_run_loop.QuitClosure());
+      LOG(INFO) << "running...";
+      renderer_run_loop.Run();
+      results.push_back(renderer.result());
+    }
+  }
+  if (results.size() > 1)
+    demo::PrintComparison(results);
 
+  // 等待 BLOCK_SHUTDOWN 的任务执行完毕，然后停止线程池
+  base::ThreadPoolInstance::Get()->Shutdown();
   return 0;
 }
@@ -0,0 +1,200 @@
+#ifndef DEMO_DEMO_VIZ_FRAME_TIMING_REPORTER_H
+#define DEMO_DEMO_VIZ_FRAME_TIMING_REPORTER_H
+
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <string>
+
+#include "base/callback.h"
+#include "base/containers/flat_map.h"
+#include "base/logging.h"
+#include "base/macros.h"
+#include "base/time/time.h"
+#include "base/trace_event/trace_event.h"
+#include "components/viz/common/frame_sinks/begin_frame_args.h"
+#include "components/viz/common/frame_timing_details.h"
+#include "demo/common/latency_recorder.h"
+
+namespace demo {
+
+constexpr base::TimeDelta kFrameTimingReportInterval =
+    base::TimeDelta::FromSeconds(10);
+
+// 消费 OnBeginFrame 中 viz 送回的 FrameTimingDetails，统计每一帧从提交到上屏
+// 的延迟、上屏间隔的分布以及掉帧数。
+// 只有在相邻的两个 BeginFrame 中都提交了 CF 时才统计这两帧的上屏间隔，
+// 间隔超过一个 vsync 的部分记为掉帧，client 空闲时不会被误算为掉帧。
+// 每一帧通过 trace counter 输出，每 kFrameTimingReportInterval 输出一次汇总。
+// 非线程安全，需要在 client 所在的线程中使用。
+class FrameTimingReporter {
+ public:
+  // 每一帧成功上屏之后调用，参数为提交到上屏的延迟和这一帧之前掉帧的数量，
+  // 用于把多个 frame sink 的数据汇总到一起
+  using FramePresentedCallback =
+      base::RepeatingCallback<void(base::TimeDelta latency, int64_t dropped)>;
+
+  explicit FrameTimingReporter(const std::string& name)
+      : name_(name),
+        submit_to_present_("SubmitToPresent"),
+        submit_to_receive_("SubmitToReceive"),
+        submit_to_draw_("SubmitToDraw"),
+        receive_to_draw_("ReceiveToDraw"),
+        draw_to_present_("DrawToPresent"),
+        frame_interval_("FrameInterval") {}
+
+  // 提交 CF 之后调用
+  void DidSubmitFrame(uint32_t frame_token, const viz::BeginFrameArgs& args) {
+    submitted_frames_[frame_token] = {base::TimeTicks::Now(),
+                                      args.frame_id.sequence_number,
+                                      args.interval};
+  }
+
+  void set_frame_presented_callback(FramePresentedCallback callback) {
+    frame_presented_callback_ = std::move(callback);
+  }
+
+  // 传入 OnBeginFrame 收到的 details
+  void DidReceiveTimingDetails(
+      const base::flat_map<uint32_t, viz::FrameTimingDetails>& details) {
+    for (const auto& detail : details)
+      OnFramePresented(detail.first, detail.second);
+    if (last_report_time_.is_null())
+      last_report_time_ = base::TimeTicks::Now();
+    if (base::TimeTicks::Now() - last_report_time_ >=
+        kFrameTimingReportInterval) {
+      Report();
+    }
+  }
+
+ private:
+  struct SubmittedFrame {
+    base::TimeTicks submit_time;
+    uint64_t sequence_number;
+    base::TimeDelta interval;
+  };
+
+  void OnFramePresented(uint32_t frame_token,
+                        const viz::FrameTimingDetails& details) {
+    // 早于这一帧提交的 CF 如果还没有收到 feedback，说明已经被丢弃
+    auto end = submitted_frames_.upper_bound(frame_token);
+    auto it = submitted_frames_.find(frame_token);
+    if (it == submitted_frames_.end()) {
+      submitted_frames_.erase(submitted_frames_.begin(), end);
+      return;
+    }
+    const SubmittedFrame frame = it->second;
+    discarded_frames_ += std::distance(submitted_frames_.begin(), it);
+    submitted_frames_.erase(submitted_frames_.begin(), end);
+
+    const gfx::PresentationFeedback& feedback = details.presentation_feedback;
+    if (feedback.failed()) {
+      ++failed_frames_;
+      TRACE_EVENT_INSTANT1("viz", "FrameTimingReporter::PresentationFailed",
+                           TRACE_EVENT_SCOPE_THREAD, "frame_token",
+                           frame_token);
+      return;
+    }
+    ++presented_frames_;
+
+    const base::TimeDelta latency = feedback.timestamp - frame.submit_time;
+    submit_to_present_.Add(latency);
+    if (!details.received_compositor_frame_timestamp.is_null())
+      submit_to_receive_.Add(details.received_compositor_frame_timestamp -
+                             frame.submit_time);
+    if (!details.draw_start_timestamp.is_null()) {
+      submit_to_draw_.Add(details.draw_start_timestamp - frame.submit_time);
+      if (!details.received_compositor_frame_timestamp.is_null()) {
+        receive_to_draw_.Add(details.draw_start_timestamp -
+                             details.received_compositor_frame_timestamp);
+      }
+      draw_to_present_.Add(feedback.timestamp - details.draw_start_timestamp);
+    }
+    TRACE_COUNTER_ID1("viz", "PresentLatencyUs", this,
+                      latency.InMicroseconds());
+
+    // 两帧由相邻的 BeginFrame 产生时，理想的上屏间隔正好是一个 vsync
+    int64_t missed = 0;
+    if (!last_present_time_.is_null() &&
+        frame.sequence_number == last_sequence_number_ + 1) {
+      const base::TimeDelta interval = feedback.timestamp - last_present_time_;
+      const base::TimeDelta vsync =
+          feedback.interval.is_zero() ? frame.interval : feedback.interval;
+      frame_interval_.Add(interval);
+      if (!vsync.is_zero()) {
+        missed = std::max<int64_t>(
+            std::lround(interval.InMicrosecondsF() / vsync.InMicrosecondsF()) -
+                1,
+            0);
+        dropped_frames_ += missed;
+        total_dropped_frames_ += missed;
+      }
+      ++expected_frames_;
+      TRACE_COUNTER_ID1("viz", "FrameIntervalUs", this,
+                        interval.InMicroseconds());
+      TRACE_COUNTER_ID1("viz", "DroppedFrames", this, total_dropped_frames_);
+    }
+    last_present_time_ = feedback.timestamp;
+    last_sequence_number_ = frame.sequence_number;
+    if (frame_presented_callback_)
+      frame_presented_callback_.Run(latency, missed);
+  }
+
+  void Report() {
+    const double dropped_percent =
+        expected_frames_ + dropped_frames_
+            ? 100.0 * dropped_frames_ / (expected_frames_ + dropped_frames_)
+            : 0;
+    LOG(INFO) << "FrameTiming[" << name_ << "]: presented=" << presented_frames_
+              << " failed=" << failed_frames_
+              << " discarded=" << discarded_frames_
+              << " dropped=" << dropped_frames_ << " ("
+              << dropped_percent << "%)\n  " << submit_to_present_.ToString()
+              << "\n  " << submit_to_receive_.ToString() << "\n  "
+              << submit_to_draw_.ToString() << "\n  "
+              << receive_to_draw_.ToString() << "\n  "
+              << draw_to_present_.ToString() << "\n"
+              << frame_interval_.ToHistogramString(
+                     base::TimeDelta::FromMilliseconds(4));
+    presented_frames_ = 0;
+    failed_frames_ = 0;
+    discarded_frames_ = 0;
+    dropped_frames_ = 0;
+    expected_frames_ = 0;
+    submit_to_present_.Reset();
+    submit_to_receive_.Reset();
+    submit_to_draw_.Reset();
+    receive_to_draw_.Reset();
+    draw_to_present_.Reset();
+    frame_interval_.Reset();
+    last_report_time_ = base::TimeTicks::Now();
+  }
+
+  const std::string name_;
+  // 已经提交、还没有收到 FrameTimingDetails 的帧
+  base::flat_map<uint32_t, SubmittedFrame> submitted_frames_;
+  base::TimeTicks last_present_time_;
+  uint64_t last_sequence_number_ = 0;
+  base::TimeTicks last_report_time_;
+  int64_t total_dropped_frames_ = 0;
+  FramePresentedCallback frame_presented_callback_;
+
+  // 本次统计周期内的数据
+  int64_t presented_frames_ = 0;
+  int64_t failed_frames_ = 0;
+  int64_t discarded_frames_ = 0;
+  int64_t dropped_frames_ = 0;
+  int64_t expected_frames_ = 0;
+  LatencyRecorder submit_to_present_;
+  LatencyRecorder submit_to_receive_;
+  LatencyRecorder submit_to_draw_;
+  LatencyRecorder receive_to_draw_;
+  LatencyRecorder draw_to_present_;
+  LatencyRecorder frame_interval_;
+
+  DISALLOW_COPY_AND_ASSIGN(FrameTimingReporter);
+};
+
+}  // namespace demo
+
+#endif  // DEMO_DEMO_VIZ_FRAME_TIMING_REPORTER_H
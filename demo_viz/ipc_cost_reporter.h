@@ -0,0 +1,101 @@
+#ifndef DEMO_DEMO_VIZ_IPC_COST_REPORTER_H
+#define DEMO_DEMO_VIZ_IPC_COST_REPORTER_H
+
+#include <algorithm>
+#include <string>
+
+#include "base/logging.h"
+#include "base/macros.h"
+#include "base/time/time.h"
+#include "base/trace_event/trace_event.h"
+
+namespace demo {
+
+constexpr base::TimeDelta kIpcCostReportInterval =
+    base::TimeDelta::FromSeconds(10);
+
+// 统计 client 和 viz 之间每一帧的 IPC 开销：收发的消息数、消息的字节数，以及
+// 通过共享内存或 GPU channel 传输的像素字节数。
+// 两次 DidSubmitFrame() 之间记录的消息都算作后一帧的开销。
+// 字节数由调用方提供，一般是 mojom struct 序列化之后的大小，不包括消息头和
+// handle，用于对比进程内和进程外布局时每一帧需要跨越边界的数据量。
+// 非线程安全，需要在 client 所在的线程中使用。
+class IpcCostReporter {
+ public:
+  explicit IpcCostReporter(const std::string& name) : name_(name) {}
+
+  void DidSendMessage(size_t bytes = 0) {
+    ++sent_messages_;
+    sent_bytes_ += bytes;
+    frame_bytes_ += bytes;
+  }
+
+  void DidReceiveMessage(size_t bytes = 0) {
+    ++received_messages_;
+    received_bytes_ += bytes;
+    frame_bytes_ += bytes;
+  }
+
+  // 无法直接观测的消息，例如 SharedImageInterface 的调用，它们会在 GPU channel
+  // 上被合并或延迟 flush，这里按每次调用一条消息估算，和实际的消息分开统计
+  void DidSendEstimatedMessage() { ++estimated_messages_; }
+
+  // 不经过消息本身传输的像素数据，例如共享内存中的 bitmap
+  void DidTransferPixels(size_t bytes) { pixel_bytes_ += bytes; }
+
+  // 提交 CF 之后调用，结束当前帧的统计
+  void DidSubmitFrame() {
+    ++frames_;
+    max_frame_bytes_ = std::max(max_frame_bytes_, frame_bytes_);
+    TRACE_COUNTER_ID1("ipc", "IpcBytesPerFrame", this, frame_bytes_);
+    frame_bytes_ = 0;
+
+    const base::TimeTicks now = base::TimeTicks::Now();
+    if (last_report_time_.is_null())
+      last_report_time_ = now;
+    if (now - last_report_time_ >= kIpcCostReportInterval)
+      Report(now);
+  }
+
+ private:
+  void Report(base::TimeTicks now) {
+    const double frames = std::max<int64_t>(frames_, 1);
+    LOG(INFO) << "IpcCost[" << name_ << "]: frames=" << frames_
+              << " sent_msgs/frame=" << sent_messages_ / frames
+              << " recv_msgs/frame=" << received_messages_ / frames
+              << " est_gpu_msgs/frame=" << estimated_messages_ / frames
+              << " sent_bytes/frame=" << sent_bytes_ / frames
+              << " recv_bytes/frame=" << received_bytes_ / frames
+              << " max_bytes/frame=" << max_frame_bytes_
+              << " pixel_bytes/frame=" << pixel_bytes_ / frames;
+    frames_ = 0;
+    sent_messages_ = 0;
+    received_messages_ = 0;
+    estimated_messages_ = 0;
+    sent_bytes_ = 0;
+    received_bytes_ = 0;
+    pixel_bytes_ = 0;
+    max_frame_bytes_ = 0;
+    last_report_time_ = now;
+  }
+
+  const std::string name_;
+  size_t frame_bytes_ = 0;
+  base::TimeTicks last_report_time_;
+
+  // 本次统计周期内的数据
+  int64_t frames_ = 0;
+  int64_t sent_messages_ = 0;
+  int64_t received_messages_ = 0;
+  int64_t estimated_messages_ = 0;
+  size_t sent_bytes_ = 0;
+  size_t received_bytes_ = 0;
+  size_t pixel_bytes_ = 0;
+  size_t max_frame_bytes_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(IpcCostReporter);
+};
+
+}  // namespace demo
+
+#endif  // DEMO_DEMO_VIZ_IPC_COST_REPORTER_H
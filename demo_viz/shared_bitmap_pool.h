@@ -0,0 +1,147 @@
+#ifndef DEMO_DEMO_VIZ_SHARED_BITMAP_POOL_H
+#define DEMO_DEMO_VIZ_SHARED_BITMAP_POOL_H
+
+#include <memory>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/containers/flat_set.h"
+#include "base/macros.h"
+#include "base/memory/read_only_shared_memory_region.h"
+#include "base/memory/weak_ptr.h"
+#include "base/trace_event/trace_event.h"
+#include "components/viz/client/client_resource_provider.h"
+#include "components/viz/common/resources/bitmap_allocation.h"
+#include "components/viz/common/resources/resource_format.h"
+#include "components/viz/common/resources/shared_bitmap.h"
+#include "components/viz/common/resources/single_release_callback.h"
+#include "components/viz/common/resources/transferable_resource.h"
+#include "services/viz/public/mojom/compositing/compositor_frame_sink.mojom.h"
+#include "third_party/skia/include/core/SkBitmap.h"
+#include "ui/gfx/geometry/size.h"
+
+namespace demo {
+
+// 复用通过 DidAllocateSharedBitmap 注册到 viz 的共享内存。
+// 每一帧都分配新的共享内存并通过 mojo 注册会产生一次系统调用和一次 IPC，
+// 当很多 client 同时刷新时这是最主要的开销。
+// 资源被 viz 归还（ReclaimResources/DidReceiveCompositorFrameAck 中
+// RemoveImportedResource）之后会回到池中，下次相同大小和格式的请求直接复用，
+// 只有池中没有可用的共享内存时才会重新分配。
+// 非线程安全，需要在 client 所在的线程中使用。
+class SharedBitmapPool {
+ public:
+  // frame_sink 和 resource_provider 需要比 pool 活得更久
+  SharedBitmapPool(viz::mojom::CompositorFrameSink* frame_sink,
+                   viz::ClientResourceProvider* resource_provider,
+                   size_t max_free_buffers = 4)
+      : frame_sink_(frame_sink),
+        resource_provider_(resource_provider),
+        max_free_buffers_(max_free_buffers) {}
+
+  // 池中空闲的以及还在 viz 中使用的共享内存都需要通知 viz 删除，
+  // 否则 viz 会一直保留这些注册。还在使用的 buffer 由 release callback 持有，
+  // pool 销毁之后 callback 不会再把它们放回池中
+  ~SharedBitmapPool() {
+    for (const viz::SharedBitmapId& id : registered_ids_)
+      frame_sink_->DidDeleteSharedBitmap(id);
+  }
+
+  // 把 source 拷贝到池中的共享内存并导入 ClientResourceProvider
+  viz::ResourceId ImportBitmap(const gfx::Size& size, const SkBitmap& source) {
+    TRACE_EVENT0("viz", "SharedBitmapPool::ImportBitmap");
+    constexpr viz::ResourceFormat kFormat = viz::RGBA_8888;
+    std::unique_ptr<Buffer> buffer = TakeFreeBuffer(size, kFormat);
+    if (!buffer) {
+      buffer = std::make_unique<Buffer>();
+      buffer->id = viz::SharedBitmap::GenerateId();
+      buffer->size = size;
+      buffer->format = kFormat;
+      // 创建共享内存
+      base::MappedReadOnlyRegion shm =
+          viz::bitmap_allocation::AllocateSharedBitmap(size, kFormat);
+      buffer->mapping = std::move(shm.mapping);
+      // 将共享内存及与之对应的资源Id发送到 viz service 端
+      frame_sink_->DidAllocateSharedBitmap(std::move(shm.region), buffer->id);
+      registered_ids_.insert(buffer->id);
+      ++allocated_count_;
+    } else {
+      ++reused_count_;
+    }
+    TRACE_COUNTER2("viz", "SharedBitmapPool", "allocated", allocated_count_,
+                   "reused", reused_count_);
+
+    SkImageInfo info = SkImageInfo::MakeN32Premul(size.width(), size.height());
+    // 将 SkBitmap 中的像素数据拷贝到共享内存
+    source.readPixels(info, buffer->mapping.memory(), info.minRowBytes(), 0, 0);
+
+    viz::TransferableResource resource =
+        viz::TransferableResource::MakeSoftware(buffer->id, size, kFormat);
+    // 资源被归还之后 buffer 通过 release callback 回到池中
+    return resource_provider_->ImportResource(
+        resource, viz::SingleReleaseCallback::Create(base::BindOnce(
+                      &SharedBitmapPool::OnResourceReleased,
+                      weak_factory_.GetWeakPtr(), std::move(buffer))));
+  }
+
+  size_t allocated_count() const { return allocated_count_; }
+  size_t reused_count() const { return reused_count_; }
+
+ private:
+  struct Buffer {
+    viz::SharedBitmapId id;
+    gfx::Size size;
+    viz::ResourceFormat format;
+    base::WritableSharedMemoryMapping mapping;
+  };
+
+  std::unique_ptr<Buffer> TakeFreeBuffer(const gfx::Size& size,
+                                         viz::ResourceFormat format) {
+    for (auto it = free_buffers_.begin(); it != free_buffers_.end(); ++it) {
+      if ((*it)->size == size && (*it)->format == format) {
+        std::unique_ptr<Buffer> buffer = std::move(*it);
+        free_buffers_.erase(it);
+        return buffer;
+      }
+    }
+    return nullptr;
+  }
+
+  void OnResourceReleased(std::unique_ptr<Buffer> buffer,
+                          const gpu::SyncToken& sync_token,
+                          bool is_lost) {
+    if (is_lost) {
+      DeleteBuffer(std::move(buffer));
+      return;
+    }
+    free_buffers_.push_back(std::move(buffer));
+    // 空闲的共享内存过多时释放最早归还的那一块，避免大小变化之后一直占用内存
+    if (free_buffers_.size() > max_free_buffers_) {
+      DeleteBuffer(std::move(free_buffers_.front()));
+      free_buffers_.erase(free_buffers_.begin());
+    }
+  }
+
+  void DeleteBuffer(std::unique_ptr<Buffer> buffer) {
+    frame_sink_->DidDeleteSharedBitmap(buffer->id);
+    registered_ids_.erase(buffer->id);
+  }
+
+  viz::mojom::CompositorFrameSink* const frame_sink_;
+  viz::ClientResourceProvider* const resource_provider_;
+  const size_t max_free_buffers_;
+  std::vector<std::unique_ptr<Buffer>> free_buffers_;
+  // 通过 DidAllocateSharedBitmap 注册到 viz 并且还没有删除的共享内存，
+  // 包括池中空闲的和还在 viz 中使用的
+  base::flat_set<viz::SharedBitmapId> registered_ids_;
+  size_t allocated_count_ = 0;
+  size_t reused_count_ = 0;
+
+  base::WeakPtrFactory<SharedBitmapPool> weak_factory_{this};
+
+  DISALLOW_COPY_AND_ASSIGN(SharedBitmapPool);
+};
+
+}  // namespace demo
+
+#endif  // DEMO_DEMO_VIZ_SHARED_BITMAP_POOL_H
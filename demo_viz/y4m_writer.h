@@ -0,0 +1,121 @@
+#ifndef DEMO_DEMO_VIZ_Y4M_WRITER_H
+#define DEMO_DEMO_VIZ_Y4M_WRITER_H
+
+#include <algorithm>
+#include <cinttypes>
+#include <string>
+
+#include "base/files/file.h"
+#include "base/files/file_path.h"
+#include "base/logging.h"
+#include "base/macros.h"
+#include "base/strings/stringprintf.h"
+#include "base/time/time.h"
+#include "base/trace_event/trace_event.h"
+#include "ui/gfx/geometry/size.h"
+
+namespace demo {
+
+// 把 I420 帧按顺序写入 y4m（或者不带文件头的 .yuv）文件。
+// frame_index 是帧在输出视频中的位置，每个位置占 interval 的时长，
+// 和上一帧之间空缺的位置（被丢弃或者跳过的帧）用当前帧重复补齐，
+// 使播放的时间和实际一致；一次最多补齐 kMaxRepeat 帧，避免长时间空闲之后
+// 写入大量重复的数据。
+// 非线程安全，调用方需要保证按顺序在同一时刻只有一个线程调用。
+class Y4mWriter {
+ public:
+  Y4mWriter(const base::FilePath& path, const std::string& name)
+      : path_(path),
+        name_(name),
+        raw_(path.MatchesExtension(FILE_PATH_LITERAL(".yuv"))) {}
+
+  ~Y4mWriter() {
+    if (dropped_ || repeated_) {
+      LOG(INFO) << name_ << ": dropped " << dropped_ << " frames, repeated "
+                << repeated_ << " frames";
+    }
+  }
+
+  // interval 只在写入第一帧时用于生成 y4m 的帧率，为 0 时表示帧率未知。
+  // frame_index 不大于上一帧或者大小和第一帧不同时丢弃该帧，返回 false
+  bool Write(int64_t frame_index,
+             const gfx::Size& size,
+             base::TimeDelta interval,
+             const uint8_t* data,
+             size_t data_size) {
+    TRACE_EVENT1("viz", "Y4mWriter::Write", "frame", frame_index);
+    if (frame_index <= last_frame_index_ ||
+        (file_.IsValid() && size != size_)) {
+      ++dropped_;
+      return false;
+    }
+    if (!file_.IsValid() && !Open(size, interval))
+      return false;
+
+    // 第一帧只写一次，之后每帧重复 frame_index 的增量次
+    constexpr int64_t kMaxRepeat = 60;
+    const int64_t repeat =
+        last_frame_index_ < 0
+            ? 1
+            : std::min(frame_index - last_frame_index_, kMaxRepeat);
+    last_frame_index_ = frame_index;
+    for (int64_t i = 0; i < repeat; ++i) {
+      if (!raw_) {
+        constexpr char kFrameHeader[] = "FRAME\n";
+        file_.WriteAtCurrentPos(kFrameHeader, sizeof(kFrameHeader) - 1);
+      }
+      file_.WriteAtCurrentPos(reinterpret_cast<const char*>(data), data_size);
+    }
+    repeated_ += repeat - 1;
+    return true;
+  }
+
+  int64_t dropped() const { return dropped_; }
+  int64_t repeated() const { return repeated_; }
+
+ private:
+  bool Open(const gfx::Size& size, base::TimeDelta interval) {
+    file_.Initialize(path_,
+                     base::File::FLAG_CREATE_ALWAYS | base::File::FLAG_WRITE);
+    if (!file_.IsValid()) {
+      LOG(ERROR) << name_ << ": failed to open " << path_;
+      return false;
+    }
+    size_ = size;
+    if (!raw_) {
+      // 帧率以微秒为分母表示，帧率未知时写入 F0:0。viz 和 libyuv
+      // 输出的都是 BT.601 limited range，色度位于 2x2 像素的中心，
+      // 所以使用 C420 而不是表示 full range 的 C420jpeg
+      const int64_t interval_us =
+          std::max<int64_t>(interval.InMicroseconds(), 0);
+      const int rate =
+          interval_us > 0
+              ? static_cast<int>(base::Time::kMicrosecondsPerSecond)
+              : 0;
+      std::string header = base::StringPrintf(
+          "YUV4MPEG2 W%d H%d F%d:%" PRId64
+          " Ip A1:1 C420 XCOLORRANGE=LIMITED\n",
+          size_.width(), size_.height(), rate, interval_us);
+      file_.WriteAtCurrentPos(header.data(), header.size());
+    }
+    LOG(INFO) << name_ << ": write " << size_.ToString() << " frames to "
+              << path_ << " interval=" << interval;
+    return true;
+  }
+
+  const base::FilePath path_;
+  const std::string name_;
+  const bool raw_;
+
+  base::File file_;
+  gfx::Size size_;
+  int64_t last_frame_index_ = -1;
+  int64_t dropped_ = 0;
+  int64_t repeated_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(Y4mWriter);
+};
+
+}  // namespace demo
+
+#endif  // DEMO_DEMO_VIZ_Y4M_WRITER_H